@@ -1,7 +1,39 @@
 #include "Animation.hpp"
+#include "FrameBlender.hpp"
+#include "FrameStore.hpp"
+#include "FrameWriter.hpp"
+#include "Profiler.hpp"
+#include "Trajectory.hpp"
+#include "VisibilityPolygon.hpp"
+
+namespace {
+	const int MAX_GRID_CELLS = 1024; // Across and down an ObjectGrid.
+
+	// Textures of destroyed frames, waiting for the UI thread.
+	boost::mutex g_releasedTexturesMutex;
+	std::vector<SDL_Texture *> g_releasedTextures;
+}
+
+void Frame::releaseTexture(SDL_Texture *texture)
+{
+	boost::lock_guard<boost::mutex> lock(g_releasedTexturesMutex);
+	g_releasedTextures.push_back(texture);
+}
+
+void Frame::destroyReleasedTextures(void)
+{
+	std::vector<SDL_Texture *> textures;
+	{
+		boost::lock_guard<boost::mutex> lock(g_releasedTexturesMutex);
+		textures.swap(g_releasedTextures);
+	}
+	for (std::vector<SDL_Texture *>::iterator it = textures.begin(); it != textures.end(); ++ it) {
+		SDL_DestroyTexture(*it);
+	}
+}
 
 Animation::Animation() :
-	m_world(NULL), m_light(NULL)
+	m_frames(new MemoryFrameStore()), m_cancelled(false), m_world(NULL), m_trajectoryKey(0), m_replaying(false), m_stepIndex(0), m_physicsRate(320.0), m_outputRate(320.0), m_physicsSteps(0), m_backgroundPattern(NULL), m_backgroundSurface(NULL), m_tileCount(1), m_dirtyRects(false), m_batchDraw(false), m_spriteAngleStep(0.0), m_spriteScale(0.0), m_shadowScale(1), m_blendFrameCount(16), m_blendCurve("sine"), m_blendStep(16), m_frameSpan(1)
 {
 	m_paused = false;
 	m_reversed = false;
@@ -13,112 +45,306 @@ Animation::Animation() :
 
 Animation::~Animation()
 {
+	// A lazy store draws with everything below; stop it first.
+	m_frames.reset();
+
 	if (m_world != NULL) delete m_world;
 
 	for (std::map<std::string, cairo_pattern_t *>::iterator it = m_imagePatterns.begin(); it != m_imagePatterns.end(); ++ it) {
 		cairo_pattern_destroy(it->second);
 	}
+
+	if (m_backgroundPattern != NULL) cairo_pattern_destroy(m_backgroundPattern);
+	if (m_backgroundSurface != NULL) cairo_surface_destroy(m_backgroundSurface);
+	clearLights();
 }
 
-bool Animation::load(std::string jsonFile)
+// A preview load of a scene with lazypreview set only simulates; frames are
+// drawn as the preview reaches them.
+bool Animation::load(std::string jsonFile, bool preview)
 {
-	m_frames.clear();
+	{
+		boost::lock_guard<boost::mutex> lock(m_framesMutex);
+		m_cancelled = false;
+	}
 
-	using boost::property_tree::ptree;
+	if (!loadScene(jsonFile)) return false;
 
-	try {
-		boost::property_tree::json_parser::read_json(jsonFile, m_animationProperties);
-	} catch (boost::property_tree::ptree_bad_data e) {
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "ptree_bad_data", e.what(), NULL);
-		return false;
-	} catch (boost::property_tree::ptree_bad_path e) {
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "ptree_bad_path", e.what(), NULL);
-		return false;
-	} catch (boost::property_tree::ptree_error e) {
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "ptree_error", e.what(), NULL);
+	if (preview && m_scene.lazyPreview) {
+		return renderLazily();
+	}
+
+	return render();
+}
+
+// Makes a load running on another thread stop after the frame it's on and return false.
+void Animation::cancel(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	m_cancelled = true;
+}
+
+bool Animation::cancelled(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	return m_cancelled;
+}
+
+// Reopens frames kept by a "mapped" frame store, for blending or saving them
+// again without the scene.
+bool Animation::open(std::string cacheFile)
+{
+	boost::shared_ptr<MappedFrameStore> frames(new MappedFrameStore(cacheFile));
+	if (!frames->open()) return false;
+
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	m_frames = frames;
+	{
+		boost::lock_guard<boost::mutex> sizeLock(m_sizeMutex);
+		m_frameWidth = frames->width();
+		m_frameHeight = frames->height();
+	}
+	m_framerate = frames->framerate();
+	m_frameSpan = frames->frameSpan();
+	m_frameIndex = 0;
+	return true;
+}
+
+bool Animation::loadScene(std::string jsonFile)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_framesMutex);
+		m_frames->clear();
+	}
+	m_frameSpan = 1;
+
+	SceneDescription scene;
+	std::string error;
+	if (!scene.read(jsonFile, m_options, error)) {
+		reportError("Could not load " + jsonFile, error);
 		return false;
 	}
+	m_scene = scene;
+	m_sceneFile = jsonFile;
+	Uint64 setupStart = SDL_GetPerformanceCounter();
 
-	m_frameWidth = m_animationProperties.get("width", 512);
-	m_frameHeight = m_animationProperties.get("height", 512);
-	m_framerate = m_animationProperties.get("framerate", 320.0);
+	{
+		boost::lock_guard<boost::mutex> lock(m_sizeMutex);
+		m_frameWidth = m_scene.width;
+		m_frameHeight = m_scene.height;
+	}
+	m_framerate = m_scene.framerate;
+	m_physicsRate = m_scene.physicsRate != 0.0 ? m_scene.physicsRate : m_framerate;
+	m_outputRate = m_scene.outputRate != 0.0 ? m_scene.outputRate : m_framerate;
+	if (m_physicsRate <= 0.0 || m_outputRate <= 0.0) {
+		g_console.print(boost::format("Ignoring physicsrate %g and outputrate %g, using framerate %g for both") % m_physicsRate % m_outputRate % m_framerate);
+		m_physicsRate = m_framerate;
+		m_outputRate = m_framerate;
+	}
+	m_framerate = m_outputRate;
 
-	b2Vec2 gravity(m_animationProperties.get("gravityx", 0.0f), m_animationProperties.get("gravityy", 0.0f));
+	b2Vec2 gravity(m_scene.gravityX, m_scene.gravityY);
 	if (m_world != NULL) delete m_world;
-	m_world = new b2World(gravity);
+	m_world = NULL;
 
  	// The b2World destructor frees b2Body objects automatically.
 	m_objects.clear();
-	m_light = NULL;
-
-	b2BodyDef groundBodyDef;
-	groundBodyDef.position.Set(0.0f, 10.0f);
-	b2Body* groundBody = m_world->CreateBody(&groundBodyDef);
-	b2PolygonShape groundBox;
-	groundBox.SetAsBox(50.0f, 10.0f);
-	groundBody->CreateFixture(&groundBox, 0.0f);
-
-	boost::property_tree::ptree objectsTree = m_animationProperties.get_child("objects");
-	boost::property_tree::ptree::const_iterator end = objectsTree.end();
-	for (boost::property_tree::ptree::const_iterator it = objectsTree.begin(); it != end; ++ it) {
-		boost::property_tree::ptree objectTree = it->second;
+	clearLights();
+	m_stepIndex = 0;
+	m_physicsSteps = 0;
+	m_stepStart.clear();
+
+	// A recorded run of the same physics is replayed instead of simulated, without building the world at all.
+	m_trajectory.reset(new Trajectory(m_scene.objects.size()));
+	m_trajectoryKey = Trajectory::key(m_scene, m_physicsRate, m_outputRate);
+	m_trajectoryFile = "";
+	m_replaying = false;
+	if (m_scene.trajectoryCache != "") {
+		m_trajectoryFile = Trajectory::filename(m_scene.trajectoryCache, m_trajectoryKey);
+		m_replaying = m_trajectory->load(m_trajectoryFile, m_trajectoryKey, frameCount());
+		if (m_replaying) {
+			g_console.print(boost::format("Replaying %i physics steps from %s") % m_trajectory->stepCount() % m_trajectoryFile);
+		}
+	}
+
+	if (!m_replaying) {
+		m_world = new b2World(gravity);
+
+		b2BodyDef groundBodyDef;
+		groundBodyDef.position.Set(0.0f, 10.0f);
+		b2Body* groundBody = m_world->CreateBody(&groundBodyDef);
+		b2PolygonShape groundBox;
+		groundBox.SetAsBox(50.0f, 10.0f);
+		groundBody->CreateFixture(&groundBox, 0.0f);
+	}
+
+	m_objects.reserve(m_scene.objects.size());
+	for (std::vector<ObjectDescription>::const_iterator it = m_scene.objects.begin(); it != m_scene.objects.end(); ++ it) {
+		const ObjectDescription &object = *it;
 		b2Body *body = NULL;
-		if (objectTree.get("type", "") == "box") {
-			body = spawnCrate(objectTree.get("x", 0.0), objectTree.get("y", 0.0), objectTree.get("density", 1.0));
-		}
-		else if (objectTree.get("type", "") == "circle") {
-			body = spawnBall(objectTree.get("x", 0.0), objectTree.get("y", 0.0), objectTree.get("density", 1.0));
-		}
-
-		if (body != NULL) {
-			body->ApplyLinearImpulse(b2Vec2(objectTree.get("vx", 0.0) *
-body->GetMass(), objectTree.get("vy", 0.0) * body->GetMass()), body->GetPosition(), true);
-
-			std::string imageFilename = objectTree.get("image", "");
-			if (m_imagePatterns.find(imageFilename) == m_imagePatterns.end()) {
-				cairo_surface_t *surface = g_imageCache.get(imageFilename);
-				cairo_pattern_t *pattern = cairo_pattern_create_for_surface(surface);
-				cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-				cairo_matrix_t matrix;
-				cairo_matrix_init_identity(&matrix);
-				cairo_matrix_translate(&matrix, cairo_image_surface_get_width(surface) / 2.0, cairo_image_surface_get_height(surface) / 2.0);
-				int pixelsPerUnit = 64;
-				double objectSize = 2.0;
-				cairo_matrix_scale(&matrix, 1.0 / objectSize, 1.0 / objectSize);
-				cairo_matrix_scale(&matrix, pixelsPerUnit, pixelsPerUnit);
-				cairo_pattern_set_matrix(pattern, &matrix);
-				m_imagePatterns[imageFilename] = pattern;
+		if (m_world != NULL) {
+			if (object.type == ObjectDescription::BOX) {
+				body = spawnCrate(object.x, object.y, object.density);
 			}
+			else {
+				body = spawnBall(object.x, object.y, object.density);
+			}
+			body->ApplyLinearImpulse(b2Vec2(object.vx * body->GetMass(), object.vy * body->GetMass()), body->GetPosition(), true);
+		}
 
-			m_objects.push_back(Object(body, imageFilename));
+		if (m_imagePatterns.find(object.image) == m_imagePatterns.end()) {
+			cairo_surface_t *surface = g_imageCache.get(object.image);
+			cairo_pattern_t *pattern = cairo_pattern_create_for_surface(surface);
+			cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+			cairo_matrix_t matrix;
+			cairo_matrix_init_identity(&matrix);
+			cairo_matrix_translate(&matrix, cairo_image_surface_get_width(surface) / 2.0, cairo_image_surface_get_height(surface) / 2.0);
+			int pixelsPerUnit = 64;
+			double objectSize = 2.0;
+			cairo_matrix_scale(&matrix, 1.0 / objectSize, 1.0 / objectSize);
+			cairo_matrix_scale(&matrix, pixelsPerUnit, pixelsPerUnit);
+			cairo_pattern_set_matrix(pattern, &matrix);
+			m_imagePatterns[object.image] = pattern;
+		}
 
-			if (objectTree.get("light", false) == true) {
-				m_light = &m_objects.back();
-			}
+		cairo_pattern_t *pattern = m_imagePatterns[object.image];
+		cairo_surface_t *surface = NULL;
+		cairo_pattern_get_surface(pattern, &surface);
+		m_objects.push_back(Object(body, object.image, pattern, (double)cairo_image_surface_get_width(surface) / 64));
+
+		if (object.light) {
+			Light light(m_objects.size() - 1, object.lightRadius);
+			light.tinted = object.tinted;
+			light.red = object.red;
+			light.green = object.green;
+			light.blue = object.blue;
+			m_lights.push_back(light);
 		}
 	}
 
-	render();
+	if (m_backgroundPattern != NULL) cairo_pattern_destroy(m_backgroundPattern);
+	m_backgroundPattern = NULL;
+	if (m_scene.background != "") {
+		cairo_surface_t *backgroundSurface = NULL;
+		backgroundSurface = g_imageCache.get(m_scene.background);
+		m_backgroundPattern = cairo_pattern_create_for_surface(backgroundSurface);
+		cairo_pattern_set_extend(m_backgroundPattern, CAIRO_EXTEND_REPEAT);
+	}
+	else if (m_scene.hasBackgroundColor) {
+		m_backgroundPattern = cairo_pattern_create_rgb(m_scene.backgroundColor[0] / 255.0, m_scene.backgroundColor[1] / 255.0, m_scene.backgroundColor[2] / 255.0);
+	}
+	else {
+		m_backgroundPattern = cairo_pattern_create_rgb(0.0, 0.3, 0.0);
+	}
+
+	// The background never moves, so composite it once and copy it into every frame.
+	if (m_backgroundSurface != NULL) cairo_surface_destroy(m_backgroundSurface);
+	m_backgroundSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_frameWidth, m_frameHeight);
+	cairo_t *backgroundContext = cairo_create(m_backgroundSurface);
+	cairo_set_source(backgroundContext, m_backgroundPattern);
+	cairo_paint(backgroundContext);
+	cairo_destroy(backgroundContext);
+
+	int pixelsPerUnit = 64;
+	cairo_matrix_init_identity(&m_view);
+	cairo_matrix_translate(&m_view, m_frameWidth / 2.0, m_frameHeight / 2.0);
+	cairo_matrix_scale(&m_view, pixelsPerUnit, pixelsPerUnit);
+	cairo_matrix_scale(&m_view, m_scene.zoom, m_scene.zoom);
+	cairo_matrix_translate(&m_view, m_scene.cameraX, m_scene.cameraY);
+
+	if (!blendSettings(m_scene.blendFrames, m_scene.blendCurve, m_scene.blendStep)) {
+		g_console.print(boost::format("Ignoring invalid blend settings, using 16 frames with a sine curve"));
+		blendSettings(16, "sine");
+	}
+
+	const std::string &frameStore = m_scene.frameStore;
+	FrameStorePtr frames;
+	if (frameStore == "compressed") {
+		frames.reset(new CompressedFrameStore());
+	}
+	else if (frameStore == "mapped") {
+		frames.reset(new MappedFrameStore(m_scene.frameCache));
+	}
+	else {
+		if (frameStore != "memory") {
+			g_console.print(boost::format("Ignoring framestore '%s', expected memory, compressed or mapped") % frameStore);
+		}
+		frames.reset(new MemoryFrameStore());
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(m_framesMutex);
+		m_frames = frames;
+	}
+
+	m_dirtyRects = m_scene.dirtyRects;
+	m_batchDraw = m_scene.batchDraw;
+	// Sprites drawn for another zoom, frame size or angle step would never be used again.
+	double spriteAngleStep = std::max(0.0, m_scene.spriteAngleStep) * M_PI / 180.0;
+	double viewScale = std::sqrt(m_view.xx * m_view.xx + m_view.yx * m_view.yx);
+	if (spriteAngleStep != m_spriteAngleStep || viewScale != m_spriteScale) {
+		m_spriteCache.clear();
+	}
+	m_spriteAngleStep = spriteAngleStep;
+	m_spriteScale = viewScale;
+	m_spriteCache.resetStatistics();
+
+	m_shadowScale = m_scene.shadowScale;
+	if (m_shadowScale != 1 && m_shadowScale != 2 && m_shadowScale != 4) {
+		g_console.print(boost::format("Ignoring shadowscale %i, expected 1, 2 or 4") % m_shadowScale);
+		m_shadowScale = 1;
+	}
+	for (std::vector<Light>::iterator it = m_lights.begin(); it != m_lights.end(); ++ it) {
+		createFalloff(*it);
+	}
+	m_tileCount = std::max(1, std::min(m_scene.tiles, m_frameHeight));
+	int tileThreads = m_scene.tileThreads > 0 ? m_scene.tileThreads : (int)boost::thread::hardware_concurrency();
+	if (m_tileCount > 1 && (m_tilePool.get() == NULL || m_tilePool->threadCount() != tileThreads)) {
+		m_tilePool.reset(new WorkerPool(tileThreads));
+	}
+
+	double setupMilliseconds = (SDL_GetPerformanceCounter() - setupStart) * 1000.0 / SDL_GetPerformanceFrequency();
+	g_console.print(boost::format("Loaded %s: %i objects in %.1f ms (read %.1f, compile %.1f, setup %.1f)")
+		% jsonFile % m_objects.size() % (m_scene.readMilliseconds + m_scene.compileMilliseconds + setupMilliseconds)
+		% m_scene.readMilliseconds % m_scene.compileMilliseconds % setupMilliseconds);
 
 	return true;
 }
 
-void Animation::save(void)
+void Animation::setOption(std::string key, std::string value)
 {
-	int frameIndex = 0;
-	if (!m_reversed) {
-		for (std::vector<FramePtr>::iterator it = m_frames.begin(); it != m_frames.end(); ++ it) {
-			SDL_SaveBMP((*it)->surface(), (boost::format("output/frame%04d.bmp") % frameIndex).str().c_str());
-			frameIndex ++;
-		}
+	m_options.put(key, value);
+}
+
+boost::property_tree::ptree &Animation::options(void)
+{
+	return m_options;
+}
+
+bool Animation::save(std::string directory)
+{
+	BmpFrameWriter bmpWriter(directory);
+	AsyncFrameWriter writer(bmpWriter);
+	return save(writer);
+}
+
+bool Animation::save(FrameWriter &writer)
+{
+	if (m_frames->failed()) {
+		g_console.print("Not saving, frames were lost while storing them");
+		return false;
 	}
-	else
-	{
-		for (std::vector<FramePtr>::reverse_iterator it = m_frames.rbegin(); it != m_frames.rend(); ++ it) {
-			SDL_SaveBMP((*it)->surface(), (boost::format("output/frame%04d.bmp") % frameIndex).str().c_str());
-			frameIndex ++;
-		}
+
+	int frameCount = m_frames->size();
+	bool reversed = m_reversed; // The preview may be reversed while this runs.
+	writer.prepare(*m_frames);
+	if (!writer.begin(m_frameWidth, m_frameHeight, frameCount, outputFramerate())) return false;
+
+	for (int i = 0; i < frameCount; i ++) {
+		FramePtr frame = m_frames->peek(reversed ? frameCount - 1 - i : i);
+		if (!writer.write(frame, i)) return false;
 	}
+
+	return writer.end();
 }
 
 void Animation::pause(void)
@@ -136,25 +362,39 @@ void Animation::reverse(void)
 	m_reversed = !m_reversed;
 }
 
+bool Animation::reversed(void)
+{
+	return m_reversed;
+}
+
 void Animation::frameStep(int steps)
 {
-	if (m_frames.size() == 0) {
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	advanceFrame(steps);
+}
+
+void Animation::advanceFrame(int steps)
+{
+	int frameCount = m_frames->size();
+	if (frameCount == 0) {
 		m_frameIndex = 0;
 		return;
 	}
 
 	m_frameIndex += steps;
-	while (m_frameIndex < 0) m_frameIndex += m_frames.size();
-	m_frameIndex %= m_frames.size();
+	while (m_frameIndex < 0) m_frameIndex += frameCount;
+	m_frameIndex %= frameCount;
 }
 
 int Animation::width(void)
 {
+	boost::lock_guard<boost::mutex> lock(m_sizeMutex);
 	return m_frameWidth;
 }
 
 int Animation::height(void)
 {
+	boost::lock_guard<boost::mutex> lock(m_sizeMutex);
 	return m_frameHeight;
 }
 
@@ -168,14 +408,39 @@ double Animation::framerate(void)
 	return m_framerate;
 }
 
-std::vector<FramePtr> &Animation::frames(void)
+// Frames per second of animation time in m_frames, which drops with every blend.
+double Animation::outputFramerate(void)
+{
+	return m_framerate / m_frameSpan;
+}
+
+// The scene's backgroundcolor as 0x00RRGGBB, used as a chroma key by formats with transparency.
+bool Animation::transparencyKey(Uint32 &rgb)
+{
+	if (!m_scene.hasBackgroundColor) return false;
+
+	rgb = 0;
+	for (int channel = 0; channel < 3; channel ++) {
+		rgb = (rgb << 8) | (Uint32)std::max(0, std::min(255, boost::math::iround(m_scene.backgroundColor[channel])));
+	}
+	return true;
+}
+
+SpriteCache &Animation::spriteCache(void)
+{
+	return m_spriteCache;
+}
+
+FrameStore &Animation::frames(void)
 {
-	return m_frames;
+	return *m_frames;
 }
 
+// Plays whatever frames there are, even while a load is still adding to them.
 FramePtr Animation::currentFrame(double currentTime)
 {
-	if (m_frames.empty()) return FramePtr();
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	if (m_frames->empty()) return FramePtr();
 
 	m_animationTimeStep = std::max(1, boost::math::iround(1000.0 / m_framerate));
 
@@ -189,235 +454,1009 @@ FramePtr Animation::currentFrame(double currentTime)
 			}
 
 			if (!m_reversed) {
-				frameStep(frameSteps);
+				advanceFrame(frameSteps);
 			}
 			else {
-				frameStep(-frameSteps);
+				advanceFrame(-frameSteps);
 			}
 		}
 	}
 
-	frameStep(0); // Make sure m_frameIndex is within range.
-	return m_frames[m_frameIndex];
+	advanceFrame(0); // Make sure m_frameIndex is within range.
+	return m_frames->get(m_frameIndex);
 }
 
 void Animation::blendFrames(void)
 {
-	if (m_frames.size() == 0) return;
+	if (m_frames->empty()) return;
 
-	int nrofFramesToBlend = 16;
-
-	// Repeat last frame until number of frames is divisible by nrofFramesToBlend.
-	int remainder = m_frames.size() % nrofFramesToBlend;
-	if (remainder > 0) {
-		int framesToAdd = nrofFramesToBlend - remainder;
-		FramePtr lastFrame = m_frames.back();
-		for (int i = 0; i < framesToAdd; i ++) {
-			m_frames.push_back(lastFrame);
-		}
+	if (m_blendStep != m_blendFrameCount) {
+		blendFramesSliding();
+		return;
 	}
 
-	SDL_assert(m_frames.size() % nrofFramesToBlend == 0);
+	int nrofFramesToBlend = m_blendFrameCount;
 
-	std::vector<double> frameWeights;
-	SDL_assert(nrofFramesToBlend == 16);
-	for (int i = 0; i < 16; i ++) {
-		frameWeights.push_back(std::max(0.0, sin(cml::constantsd::pi() / (double)(nrofFramesToBlend - 1) * (double)i)));
-	}
+	FrameBlender blender(blendWeights());
 
 	int threadCount = 4;
 	boost::thread_group threads;
-	std::vector<FramePtr> output(m_frames.size() / nrofFramesToBlend);
+	std::vector<FramePtr> output(blendOutputCount(m_frames->size()));
 	for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
-		threads.create_thread(boost::bind(&Animation::blendFramesStriped, this, threadIndex, threadCount, frameWeights, &output));
+		threads.create_thread(boost::bind(&Animation::blendFramesStriped, this, threadIndex, threadCount, &blender, &output));
 	}
 	threads.join_all();
 
 	SDL_assert(output[0].use_count() > 0);
-	m_frames = output;
+	m_frameSpan *= nrofFramesToBlend;
+	replaceFrames(output);
 }
 
-void Animation::blendFramesStriped(int threadIndex, int threadCount, std::vector<double> &frameWeights, std::vector<FramePtr> *output)
+// A step of 0 means the same as the window: back to back groups, as blend always did.
+bool Animation::blendSettings(int nrofFramesToBlend, std::string curve, int step)
 {
-	double weightTotal = 0.0;
-	for (std::vector<double>::iterator it = frameWeights.begin(); it != frameWeights.end(); ++ it) {
-		weightTotal += (*it);
-	}
+	if (nrofFramesToBlend < 1 || step < 0 || !FrameBlender::validCurve(curve)) return false;
+
+	m_blendFrameCount = nrofFramesToBlend;
+	m_blendCurve = curve;
+	m_blendStep = step > 0 ? step : nrofFramesToBlend;
+	return true;
+}
+
+int Animation::blendFrameCount(void)
+{
+	return m_blendFrameCount;
+}
+
+std::string Animation::blendCurve(void)
+{
+	return m_blendCurve;
+}
+
+int Animation::blendStep(void)
+{
+	return m_blendStep;
+}
+
+int Animation::blendOutputCount(int frameCount)
+{
+	if (frameCount <= 0) return 0;
+
+	// Grouped blending pads the last group, sliding windows only cover whole
+	// windows (or one short window when there aren't enough frames for one).
+	if (m_blendStep == m_blendFrameCount) return (frameCount + m_blendFrameCount - 1) / m_blendFrameCount;
+	if (frameCount < m_blendFrameCount) return 1;
+	return (frameCount - m_blendFrameCount) / m_blendStep + 1;
+}
 
-	int nrofFramesToBlend = frameWeights.size();
+std::vector<double> Animation::blendWeights(void)
+{
+	return FrameBlender::weights(m_blendFrameCount, m_blendCurve);
+}
+
+void Animation::blendFramesStriped(int threadIndex, int threadCount, FrameBlender *blender, std::vector<FramePtr> *output)
+{
+	int nrofFramesToBlend = blender->frameCount();
 
+	int lastFrame = m_frames->size() - 1;
+	std::vector<FramePtr> group(nrofFramesToBlend);
 	for (int i = threadIndex; i < (int)(*output).size(); i += threadCount) {
-		std::vector<FramePtr>::iterator first = m_frames.begin() + (i * nrofFramesToBlend);
-		std::vector<FramePtr>::iterator last = m_frames.begin() + (i * nrofFramesToBlend) + nrofFramesToBlend;
+		// The last group is padded by repeating the last frame.
+		for (int j = 0; j < nrofFramesToBlend; j ++) {
+			group[j] = m_frames->peek(std::min(i * nrofFramesToBlend + j, lastFrame));
+		}
 
-		FramePtr result(new Frame((*first)->surface()->w, (*first)->surface()->h));
-		(*output)[i] = result;
+		ProfileScope profile(Profiler::BLEND, i);
+		(*output)[i] = blender->blend(group.begin(), group.end());
 		SDL_assert((*output)[i].use_count() > 0);
-		SDL_Surface *surface = result->surface();
-
-		for (int j = 0; j < (surface->w * surface->h); ++j) {
-			double r = 0.0;
-			double g = 0.0;
-			double b = 0.0;
-			double a = 0.0;
-			int frameIndex = 0;
-			for (std::vector<FramePtr>::iterator it = first; it != last; ++ it) {
-				SDL_Surface *sdlFrame = (*it)->surface();
-				Uint32 pixel = ((Uint32*)sdlFrame->pixels)[j];
-				Uint8 pr,pg,pb;
-				SDL_GetRGB(pixel, surface->format, &pr, &pg, &pb);
-				r += (double)pr * frameWeights[frameIndex];
-				g += (double)pg * frameWeights[frameIndex];
-				b += (double)pb * frameWeights[frameIndex];
-				frameIndex ++;
+	}
+}
+
+// Overlapping (or gapped) shutter windows that advance by m_blendStep frames.
+void Animation::blendFramesSliding(void)
+{
+	int nrofFramesToBlend = std::min(m_blendFrameCount, m_frames->size());
+	std::vector<FramePtr> output(blendOutputCount(m_frames->size()));
+
+	// Windows share frames, and a compressed store decodes a frame on every
+	// get(), so each frame is got once here and shared by the threads.
+	int threadCount = 4;
+	WorkerPool pool(threadCount);
+	std::vector<WorkerPool::Task> tasks;
+	if (m_blendCurve == "box") {
+		for (std::vector<FramePtr>::iterator it = output.begin(); it != output.end(); ++ it) {
+			(*it).reset(new Frame(m_frameWidth, m_frameHeight));
+		}
+
+		// Box weights can use a running sum, kept in bands of rows that the threads carry through every window.
+		std::vector< boost::shared_ptr<RunningBlend> > bands;
+		int bandHeight = (m_frameHeight + threadCount - 1) / threadCount;
+		for (int y = 0; y < m_frameHeight; y += bandHeight) {
+			bands.push_back(boost::shared_ptr<RunningBlend>(new RunningBlend(m_frameWidth, y, std::min(bandHeight, m_frameHeight - y))));
+		}
+
+		// Window i covers [i * step, i * step + window); only the frames that
+		// differ from window i - 1 are subtracted or added.
+		std::deque<FramePtr> window;
+		int windowStart = 0;
+		std::vector<FramePtr> added;
+		std::vector<FramePtr> subtracted;
+		for (int i = 0; i < (int)output.size(); i ++) {
+			added.clear();
+			subtracted.clear();
+			int start = i * m_blendStep;
+			while (!window.empty() && windowStart < start) {
+				subtracted.push_back(window.front());
+				window.pop_front();
+				windowStart ++;
+			}
+			if (window.empty()) windowStart = start;
+			while (windowStart + (int)window.size() < start + nrofFramesToBlend) {
+				FramePtr frame = m_frames->peek(windowStart + (int)window.size());
+				window.push_back(frame);
+				added.push_back(frame);
 			}
 
-			r = r / weightTotal;
-			g = g / weightTotal;
-			b = b / weightTotal;
-			a = 255.0;
-			((Uint32*)surface->pixels)[j] = SDL_MapRGBA(surface->format, (Uint8)r, (Uint8)g, (Uint8)b, (Uint8)a);
+			tasks.clear();
+			for (std::vector< boost::shared_ptr<RunningBlend> >::iterator it = bands.begin(); it != bands.end(); ++ it) {
+				tasks.push_back(boost::bind(&Animation::blendFramesRunning, this, (*it).get(), boost::cref(added), boost::cref(subtracted), nrofFramesToBlend, i, output[i]));
+			}
+			pool.run(tasks);
 		}
 	}
+	else {
+		// Blends threadCount windows at a time from the frames they cover,
+		// keeping the ones the next windows still need.
+		FrameBlender blender(FrameBlender::weights(nrofFramesToBlend, m_blendCurve));
+		std::deque<FramePtr> frames;
+		int firstFrame = 0;
+		for (int first = 0; first < (int)output.size(); first += threadCount) {
+			int last = std::min(first + threadCount, (int)output.size());
+			int begin = first * m_blendStep;
+			int end = (last - 1) * m_blendStep + nrofFramesToBlend;
+			while (!frames.empty() && firstFrame < begin) {
+				frames.pop_front();
+				firstFrame ++;
+			}
+			if (frames.empty()) firstFrame = begin;
+			while (firstFrame + (int)frames.size() < end) {
+				frames.push_back(m_frames->peek(firstFrame + (int)frames.size()));
+			}
+
+			tasks.clear();
+			for (int i = first; i < last; i ++) {
+				tasks.push_back(boost::bind(&Animation::blendFramesSlidingWindow, this, &blender, boost::cref(frames), i * m_blendStep - firstFrame, i, &output));
+			}
+			pool.run(tasks);
+		}
+	}
+
+	m_frameSpan *= m_blendStep;
+	replaceFrames(output);
 }
 
+// Output frame outputIndex from the window starting at offset in frames.
+void Animation::blendFramesSlidingWindow(FrameBlender *blender, const std::deque<FramePtr> &frames, int offset, int outputIndex, std::vector<FramePtr> *output)
+{
+	std::vector<FramePtr> window(frames.begin() + offset, frames.begin() + offset + blender->frameCount());
+	ProfileScope profile(Profiler::BLEND, outputIndex);
+	(*output)[outputIndex] = blender->blend(window.begin(), window.end());
+}
 
-void Animation::render(void)
+// One band's step from the previous window to window outputIndex.
+void Animation::blendFramesRunning(RunningBlend *sums, const std::vector<FramePtr> &added, const std::vector<FramePtr> &subtracted, int frameCount, int outputIndex, FramePtr output)
 {
-	float32 physicsTimeStep = 1.0f / m_animationProperties.get("framerate", 320.0);
+	ProfileScope profile(Profiler::BLEND, outputIndex);
+	for (std::vector<FramePtr>::const_iterator it = subtracted.begin(); it != subtracted.end(); ++ it) {
+		sums->subtract(*it);
+	}
+	for (std::vector<FramePtr>::const_iterator it = added.begin(); it != added.end(); ++ it) {
+		sums->add(*it);
+	}
+	sums->average(frameCount, output);
+}
+
+// Stores blended frames in place of the ones they were made from, letting go
+// of each as soon as the store has it.
+void Animation::replaceFrames(std::vector<FramePtr> &frames)
+{
+	m_frames->clear();
+	if (m_frames->lazy()) {
+		m_frames.reset(new MemoryFrameStore());
+	}
+	for (std::vector<FramePtr>::iterator it = frames.begin(); it != frames.end(); ++ it) {
+		m_frames->add(*it);
+		(*it).reset();
+	}
+	m_frames->finish();
+	m_frames->setTiming(m_framerate, m_frameSpan);
+}
+
+bool Animation::render(void)
+{
+	int frameCount = this->frameCount();
+	FrameState previousState;
+	FramePtr previousFrame;
+	Uint32 lastReport = SDL_GetTicks();
+	for (int i = 0; i < frameCount; i++) {
+		if (cancelled()) return false;
+
+		Uint32 now = SDL_GetTicks();
+		if (now - lastReport >= 1000) {
+			g_console.print(boost::format("Rendering %s: %i of %i frames") % m_sceneFile % i % frameCount);
+			lastReport = now;
+		}
+
+		FrameState state;
+		simulate(state);
+
+		FramePtr frame(new Frame(m_frameWidth, m_frameHeight));
+		if (m_dirtyRects && previousFrame) {
+			rasterizeDirty(state, previousState, previousFrame, frame);
+		}
+		else {
+			rasterize(state, frame);
+		}
+		{
+			boost::lock_guard<boost::mutex> lock(m_framesMutex);
+			m_frames->add(frame);
+			if (m_frames->failed()) return false;
+		}
+
+		// Drawn in full before add(), so the preview's texture() uploads it as it is.
+		previousState = state;
+		previousFrame = frame;
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	m_frames->finish();
+	m_frames->setTiming(m_framerate, m_frameSpan);
+	return !m_frames->failed();
+}
+
+bool Animation::renderLazily(void)
+{
+	boost::shared_ptr<LazyFrameStore> frames(new LazyFrameStore(*this, m_scene.lazyWindow));
+	int frameCount = this->frameCount();
+	for (int i = 0; i < frameCount; i++) {
+		if (cancelled()) return false;
+
+		FrameState state;
+		simulate(state);
+		frames->addState(state);
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_framesMutex);
+	m_frames = frames;
+	return true;
+}
+
+int Animation::frameCount(void)
+{
+	return int(m_outputRate * m_scene.animationLength);
+}
+
+void Animation::simulate(FrameState &state)
+{
+	if (m_replaying) {
+		state.index = m_stepIndex ++;
+		m_trajectory->get(state.index, state);
+		return;
+	}
+
+	float32 physicsTimeStep = 1.0f / m_physicsRate;
 	int32 velocityIterations = 8;
 	int32 positionIterations = 3;
 
-	cairo_pattern_t *backgroundPattern = NULL;
-	std::string backgroundImage = m_animationProperties.get("background", "");
-	if (backgroundImage != "") {
-		cairo_surface_t *backgroundSurface = NULL;
-		backgroundSurface = g_imageCache.get(backgroundImage);
-		backgroundPattern = cairo_pattern_create_for_surface(backgroundSurface);
-		cairo_pattern_set_extend(backgroundPattern, CAIRO_EXTEND_REPEAT);
+	// Frame i shows the world (i + 1) / outputrate seconds in, which falls
+	// somewhere inside physics step stepsNeeded. Step up to it, keeping where
+	// the bodies were at the start of that step to interpolate from.
+	state.index = m_stepIndex ++;
+	double target = (state.index + 1) * m_physicsRate / m_outputRate;
+	int stepsNeeded = std::max(1, (int)ceil(target - 1e-6));
+	while (m_physicsSteps < stepsNeeded) {
+		if (m_physicsSteps == stepsNeeded - 1) {
+			bodyStates(m_stepStart);
+		}
+		{
+			ProfileScope profile(Profiler::STEP, state.index);
+			m_world->Step(physicsTimeStep, velocityIterations, positionIterations);
+		}
+		m_physicsSteps ++;
 	}
-	else {
-		try {
-			boost::property_tree::ptree colorValues = m_animationProperties.get_child("backgroundcolor");
-			boost::property_tree::ptree::const_iterator it = colorValues.begin();
-			double red = (it->second).get_value(0.0);
-			++it;
-			double green = (it->second).get_value(0.0);
-			++it;
-			double blue = (it->second).get_value(0.0);
-			backgroundPattern = cairo_pattern_create_rgb(red / 255.0, green / 255.0, blue / 255.0);
+
+	bodyStates(state.objects);
+	double fraction = target - (stepsNeeded - 1);
+	if (fraction < 1.0 - 1e-6) {
+		for (size_t i = 0; i < state.objects.size(); i ++) {
+			const ObjectState &from = m_stepStart[i];
+			ObjectState &to = state.objects[i];
+			to.x = from.x + (to.x - from.x) * fraction;
+			to.y = from.y + (to.y - from.y) * fraction;
+			to.angle = from.angle + (to.angle - from.angle) * fraction;
 		}
-		catch (...) {
-			backgroundPattern = cairo_pattern_create_rgb(0.0, 0.3, 0.0);
+	}
+
+	// Only recorded to be saved; once it is, or with the cache off, the states aren't kept.
+	if (m_trajectoryFile != "") {
+		m_trajectory->add(state);
+		if (m_trajectory->stepCount() == frameCount()) {
+			m_trajectory->save(m_trajectoryFile, m_trajectoryKey);
+			m_trajectory.reset();
+			m_trajectoryFile = "";
 		}
 	}
+}
 
-	int pixelsPerUnit = 64;
-	float32 time = 0.0f;
-	cairo_matrix_t view;
-	cairo_matrix_init_identity(&view);
-	cairo_matrix_translate(&view, m_frameWidth / 2.0, m_frameHeight / 2.0);
-	cairo_matrix_scale(&view, pixelsPerUnit, pixelsPerUnit);
-	cairo_matrix_scale(&view, m_animationProperties.get("zoom", 1.0), m_animationProperties.get("zoom", 1.0));
-	cairo_matrix_translate(&view, m_animationProperties.get("camerax", 0.0), m_animationProperties.get("cameray", 0.0));
-	int frameCount = int(m_animationProperties.get("framerate", 320.0) * m_animationProperties.get("animationlength", 320.0));
-	for (int i = 0; i < frameCount; i++) {
-		m_world->Step(physicsTimeStep, velocityIterations, positionIterations);
+void Animation::bodyStates(std::vector<ObjectState> &states)
+{
+	states.clear();
+	states.reserve(m_objects.size());
+	for (std::vector<Object>::iterator it = m_objects.begin(); it != m_objects.end(); ++ it) {
+		b2Body *body = (*it).body;
+		states.push_back(ObjectState(body->GetPosition().x, body->GetPosition().y, body->GetAngle()));
+	}
+}
 
-		m_frames.push_back(FramePtr(new Frame(m_frameWidth, m_frameHeight)));
-		FramePtr frame = m_frames.back();
-		cairo_t *cr = frame->cairoContext();
+// Objects are squares of half size imageSize, so nothing of one reaches
+// further from its centre than the half diagonal. Each object goes into the
+// cell its centre is in, with cells about one object each but no smaller
+// than the largest object, and a query looks that much further out.
+ObjectGrid::ObjectGrid(const FrameState &state, const std::vector<Object> &objects) :
+	m_state(state), m_maxExtent(0.0), m_left(HUGE_VAL), m_top(HUGE_VAL), m_cellSize(1.0), m_columns(0), m_rows(0)
+{
+	int count = (int)std::min(state.objects.size(), objects.size());
+	if (count == 0) return;
+
+	double right = -HUGE_VAL;
+	double bottom = -HUGE_VAL;
+	m_extents.resize(count);
+	for (int i = 0; i < count; i ++) {
+		const ObjectState &object = state.objects[i];
+		m_extents[i] = objects[i].imageSize * M_SQRT2;
+		m_maxExtent = std::max(m_maxExtent, m_extents[i]);
+		m_left = std::min(m_left, (double)object.x);
+		m_top = std::min(m_top, (double)object.y);
+		right = std::max(right, (double)object.x);
+		bottom = std::max(bottom, (double)object.y);
+	}
 
-		cairo_identity_matrix(cr);
-		cairo_set_source(cr, backgroundPattern);
-		cairo_paint(cr);
+	double width = right - m_left;
+	double height = bottom - m_top;
+	m_cellSize = std::max(std::sqrt(width * height / count), 2.0 * m_maxExtent);
+	m_cellSize = std::max(m_cellSize, std::max(width, height) / MAX_GRID_CELLS);
+	if (!(m_cellSize > 0.0)) m_cellSize = 1.0;
+	m_columns = std::min(MAX_GRID_CELLS, (int)(width / m_cellSize) + 1);
+	m_rows = std::min(MAX_GRID_CELLS, (int)(height / m_cellSize) + 1);
+
+	// Counting sort by cell, which keeps each cell's objects in scene order.
+	std::vector<int> cells(count);
+	m_cellStarts.assign(m_columns * m_rows + 1, 0);
+	for (int i = 0; i < count; i ++) {
+		cells[i] = row(state.objects[i].y) * m_columns + column(state.objects[i].x);
+		m_cellStarts[cells[i] + 1] ++;
+	}
+	for (size_t cell = 1; cell < m_cellStarts.size(); cell ++) {
+		m_cellStarts[cell] += m_cellStarts[cell - 1];
+	}
+	std::vector<int> next(m_cellStarts.begin(), m_cellStarts.end() - 1);
+	m_cellObjects.resize(count);
+	for (int i = 0; i < count; i ++) {
+		m_cellObjects[next[cells[i]] ++] = i;
+	}
+}
 
-		std::vector< std::pair<cml::vector2d, cml::vector2d> > sides;
-		for (std::vector<Object>::iterator it = m_objects.begin(); it != m_objects.end(); ++ it) {
-			Object &object = *it;
-			b2Body *body = (*it).body;
-			b2Vec2 position = body->GetPosition();
-			float32 angle = body->GetAngle();
-			std::string imageFilename = (*it).image;
-			cairo_pattern_t *pattern = m_imagePatterns[imageFilename];
-			const double boxSize = 2.0;
+// The objects whose square touches rect, in scene order.
+void ObjectGrid::query(const WorldRect &rect, std::vector<int> &objectIndices) const
+{
+	objectIndices.clear();
+	if (m_cellObjects.empty()) return;
+
+	int lastColumn = column(rect.right + m_maxExtent);
+	int lastRow = row(rect.bottom + m_maxExtent);
+	for (int cellRow = row(rect.top - m_maxExtent); cellRow <= lastRow; cellRow ++) {
+		for (int cellColumn = column(rect.left - m_maxExtent); cellColumn <= lastColumn; cellColumn ++) {
+			int cell = cellRow * m_columns + cellColumn;
+			for (int i = m_cellStarts[cell]; i < m_cellStarts[cell + 1]; i ++) {
+				int objectIndex = m_cellObjects[i];
+				const ObjectState &object = m_state.objects[objectIndex];
+				if (rect.overlaps(object.x, object.y, m_extents[objectIndex])) objectIndices.push_back(objectIndex);
+			}
+		}
+	}
+	std::sort(objectIndices.begin(), objectIndices.end());
+}
+
+// Clamped in floating point first, so infinite rectangles stay in range.
+int ObjectGrid::column(double x) const
+{
+	return (int)std::max(0.0, std::min((double)(m_columns - 1), std::floor((x - m_left) / m_cellSize)));
+}
+
+int ObjectGrid::row(double y) const
+{
+	return (int)std::max(0.0, std::min((double)(m_rows - 1), std::floor((y - m_top) / m_cellSize)));
+}
 
-			cairo_set_matrix(cr, &view);
-			cairo_translate(cr, position.x, position.y);
-			cairo_rotate(cr, angle);
+void Animation::rasterize(const FrameState &state, FramePtr frame)
+{
+	ObjectGrid grid(state, m_objects);
+	if (m_tileCount <= 1 || m_tilePool.get() == NULL) {
+		SDL_Rect all = { 0, 0, m_frameWidth, m_frameHeight };
+		rasterizeRegion(state, grid, frame->cairoContext(), all);
+		return;
+	}
 
-			double imageSize = 1.0;
-			if (pattern != NULL) {
-				cairo_set_source(cr, pattern);
-				cairo_surface_t *surface = NULL;
-				cairo_pattern_get_surface(pattern, &surface);
-				imageSize = (double)cairo_image_surface_get_width(surface) / pixelsPerUnit;
+	// Split the frame into horizontal bands and draw them in parallel.
+	std::vector<WorkerPool::Task> tasks;
+	int bandHeight = (m_frameHeight + m_tileCount - 1) / m_tileCount;
+	for (int y = 0; y < m_frameHeight; y += bandHeight) {
+		SDL_Rect band = { 0, y, m_frameWidth, std::min(bandHeight, m_frameHeight - y) };
+		tasks.push_back(boost::bind(&Animation::rasterizeRect, this, boost::cref(state), boost::cref(grid), frame, band));
+	}
+	m_tilePool->run(tasks);
+}
+
+// Starts from a copy of the previous frame and only redraws the rectangles
+// where something moved, falling back to a full redraw when too much did.
+void Animation::rasterizeDirty(const FrameState &state, const FrameState &previous, FramePtr previousFrame, FramePtr frame)
+{
+	std::vector<SDL_Rect> rects;
+	if (!dirtyRects(state, previous, rects)) {
+		rasterize(state, frame);
+		return;
+	}
+
+	SDL_Surface *surface = frame->surface();
+	memcpy(surface->pixels, previousFrame->surface()->pixels, surface->pitch * surface->h);
+
+	ObjectGrid grid(state, m_objects);
+	if (m_tilePool.get() == NULL || rects.size() < 2) {
+		for (std::vector<SDL_Rect>::iterator it = rects.begin(); it != rects.end(); ++ it) {
+			rasterizeRect(state, grid, frame, *it);
+		}
+		return;
+	}
+
+	// The rectangles don't overlap, so they can be drawn at the same time like bands.
+	std::vector<WorkerPool::Task> tasks;
+	for (std::vector<SDL_Rect>::iterator it = rects.begin(); it != rects.end(); ++ it) {
+		tasks.push_back(boost::bind(&Animation::rasterizeRect, this, boost::cref(state), boost::cref(grid), frame, *it));
+	}
+	m_tilePool->run(tasks);
+}
+
+// Collects the areas that differ between the previous frame and this one:
+// where each moving object was and is, plus its shadow when there is a light.
+// Returns false if the whole frame should be redrawn instead.
+bool Animation::dirtyRects(const FrameState &state, const FrameState &previous, std::vector<SDL_Rect> &rects)
+{
+	rects.clear();
+	if (previous.objects.size() != state.objects.size()) return false;
+
+	// A moving light changes every shadow and the falloff around it.
+	for (std::vector<Light>::const_iterator it = m_lights.begin(); it != m_lights.end(); ++ it) {
+		if (state.objects[(*it).objectIndex] != previous.objects[(*it).objectIndex]) return false;
+	}
+
+	for (int objectIndex = 0; objectIndex < (int)state.objects.size(); objectIndex ++) {
+		const ObjectState &now = state.objects[objectIndex];
+		const ObjectState &before = previous.objects[objectIndex];
+		if (!(now != before)) continue; // Sleeping bodies drop out here.
+
+		rects.push_back(objectBounds(before, objectIndex));
+		rects.push_back(objectBounds(now, objectIndex));
+		if (isLight(objectIndex)) continue;
+		for (std::vector<Light>::const_iterator it = m_lights.begin(); it != m_lights.end(); ++ it) {
+			const ObjectState &lightState = state.objects[(*it).objectIndex];
+			SDL_Rect bounds = lightBounds(before, *it, lightState);
+			if (bounds.w > 0) rects.push_back(bounds);
+			bounds = lightBounds(now, *it, lightState);
+			if (bounds.w > 0) rects.push_back(bounds);
+		}
+	}
+
+	// Merge overlapping rectangles until none are left, so no pixel is drawn twice.
+	bool merged = true;
+	while (merged) {
+		merged = false;
+		for (size_t i = 0; i < rects.size() && !merged; i ++) {
+			if (rects[i].w <= 0 || rects[i].h <= 0) {
+				rects.erase(rects.begin() + i);
+				merged = true;
+				break;
 			}
+			for (size_t j = i + 1; j < rects.size(); j ++) {
+				SDL_Rect &a = rects[i];
+				const SDL_Rect &b = rects[j];
+				if (a.x >= b.x + b.w || b.x >= a.x + a.w || a.y >= b.y + b.h || b.y >= a.y + a.h) continue;
+
+				int right = std::max(a.x + a.w, b.x + b.w);
+				int bottom = std::max(a.y + a.h, b.y + b.h);
+				a.x = std::min(a.x, b.x);
+				a.y = std::min(a.y, b.y);
+				a.w = right - a.x;
+				a.h = bottom - a.y;
+				rects.erase(rects.begin() + j);
+				merged = true;
+				break;
+			}
+		}
+	}
 
-			cairo_rectangle(cr, -(boxSize / 2.0) * imageSize, -(boxSize / 2.0) * imageSize, boxSize * imageSize, boxSize * imageSize);
-			cairo_fill(cr);
+	int area = 0;
+	for (std::vector<SDL_Rect>::iterator it = rects.begin(); it != rects.end(); ++ it) {
+		area += (*it).w * (*it).h;
+	}
+	return area * 2 < m_frameWidth * m_frameHeight;
+}
 
-			// Information about box sides, for use with drawing shadows.
-			cml::vector2d pos(position.x, position.y);
-			cml::vector2d ex = cml::vector2d(std::cos(-angle), -std::sin(-angle));
-			cml::vector2d ey = cml::vector2d(std::sin(angle), -std::cos(angle));
+SDL_Rect Animation::objectBounds(const ObjectState &object, int objectIndex)
+{
+	double imageSize = m_objects[objectIndex].imageSize;
+
+	// Same square as rasterizeRegion fills, boxSize / 2 * imageSize from the centre.
+	cml::vector2d position(object.x, object.y);
+	cml::vector2d ex = cml::vector2d(std::cos(object.angle), std::sin(object.angle)) * imageSize;
+	cml::vector2d ey = cml::vector2d(-std::sin(object.angle), std::cos(object.angle)) * imageSize;
+	std::vector<cml::vector2d> corners;
+	corners.push_back(position - ex - ey);
+	corners.push_back(position + ex - ey);
+	corners.push_back(position + ex + ey);
+	corners.push_back(position - ex + ey);
+	return deviceBounds(corners);
+}
+
+// The part of the frame the object can shadow from this light: everything
+// the light reaches, or nothing (zero width) if the object is out of reach.
+SDL_Rect Animation::lightBounds(const ObjectState &object, const Light &light, const ObjectState &lightState)
+{
+	cml::vector2d lightPosition(lightState.x, lightState.y);
+	double reach = light.radius + std::sqrt(2.0); // Plus the half diagonal of the casting box.
+	if ((cml::vector2d(object.x, object.y) - lightPosition).length_squared() > reach * reach) {
+		SDL_Rect empty = { 0, 0, 0, 0 };
+		return empty;
+	}
+
+	std::vector<cml::vector2d> points;
+	points.push_back(lightPosition + cml::vector2d(-light.radius, -light.radius));
+	points.push_back(lightPosition + cml::vector2d(light.radius, light.radius));
+	return deviceBounds(points);
+}
+
+// Pixel rectangle covering world-space points, widened for antialiasing and clipped to the frame.
+SDL_Rect Animation::deviceBounds(const std::vector<cml::vector2d> &points)
+{
+	double left = m_frameWidth;
+	double top = m_frameHeight;
+	double right = 0.0;
+	double bottom = 0.0;
+	for (std::vector<cml::vector2d>::const_iterator it = points.begin(); it != points.end(); ++ it) {
+		double x = (*it)[0];
+		double y = (*it)[1];
+		cairo_matrix_transform_point(&m_view, &x, &y);
+		left = std::min(left, x);
+		top = std::min(top, y);
+		right = std::max(right, x);
+		bottom = std::max(bottom, y);
+	}
+
+	SDL_Rect rect;
+	rect.x = std::max(0, (int)std::floor(left) - 2);
+	rect.y = std::max(0, (int)std::floor(top) - 2);
+	rect.w = std::min(m_frameWidth, (int)std::ceil(right) + 2) - rect.x;
+	rect.h = std::min(m_frameHeight, (int)std::ceil(bottom) + 2) - rect.y;
+	return rect;
+}
 
-			if (&object != m_light) {
-				sides.push_back(std::pair<cml::vector2d, cml::vector2d>(pos - ex - ey, pos + ex - ey));
-				sides.push_back(std::pair<cml::vector2d, cml::vector2d>(pos - ex + ey, pos - ex - ey));
-				sides.push_back(std::pair<cml::vector2d, cml::vector2d>(pos + ex + ey, pos - ex + ey));
-				sides.push_back(std::pair<cml::vector2d, cml::vector2d>(pos + ex - ey, pos + ex + ey));
+void Animation::rasterizeRect(const FrameState &state, const ObjectGrid &grid, FramePtr frame, SDL_Rect rect)
+{
+	// A context of its own over just these rows. The device offset keeps user
+	// space in whole-frame coordinates, and cairo clips to the rows' extents.
+	SDL_Surface *surface = frame->surface();
+	cairo_surface_t *bandSurface = cairo_image_surface_create_for_data((unsigned char*)surface->pixels + rect.y * surface->pitch, CAIRO_FORMAT_ARGB32, surface->w, rect.h, surface->pitch);
+	SDL_assert(cairo_surface_status(bandSurface) == CAIRO_STATUS_SUCCESS);
+	cairo_surface_set_device_offset(bandSurface, 0.0, -rect.y);
+	cairo_t *cr = cairo_create(bandSurface);
+	cairo_surface_destroy(bandSurface);
+
+	if (rect.x > 0 || rect.w < surface->w) {
+		cairo_rectangle(cr, rect.x, rect.y, rect.w, rect.h);
+		cairo_clip(cr);
+	}
+
+	rasterizeRegion(state, grid, cr, rect);
+
+	cairo_destroy(cr);
+}
+
+// Draws the given objects grouped by what they look like, so each image or
+// sprite becomes the source once per group instead of once per object.
+// Within a group each object only moves the source and adds its quad.
+// Objects of different groups overlap in group order rather than scene
+// order. Returns how many objects it drew.
+int Animation::drawBatched(const FrameState &state, cairo_t *cr, const std::vector<int> &objectIndices)
+{
+	bool sprites = m_spriteAngleStep > 0.0;
+	std::vector<DrawItem> items;
+	items.reserve(objectIndices.size());
+	for (std::vector<int>::const_iterator it = objectIndices.begin(); it != objectIndices.end(); ++ it) {
+		int objectIndex = *it;
+		if (m_objects[objectIndex].pattern == NULL) continue;
+		long long angleKey = sprites ? SpriteCache::angleKey(state.objects[objectIndex].angle, m_spriteAngleStep) : 0;
+		items.push_back(DrawItem(m_objects[objectIndex].pattern, angleKey, objectIndex));
+	}
+	std::sort(items.begin(), items.end());
+
+	double scale = std::sqrt(m_view.xx * m_view.xx + m_view.yx * m_view.yx);
+	cairo_identity_matrix(cr);
+	for (size_t first = 0; first < items.size(); ) {
+		size_t end = first + 1;
+		while (end < items.size() && items[end].pattern == items[first].pattern && items[end].angleKey == items[first].angleKey) end ++;
+
+		const Object &firstObject = m_objects[items[first].objectIndex];
+		cairo_surface_t *surface = NULL;
+		cairo_matrix_t imageMatrix;
+		double originX = 0.0;
+		double originY = 0.0;
+		if (sprites) {
+			const Sprite *sprite = m_spriteCache.get(firstObject.image, firstObject.pattern, firstObject.imageSize, scale, state.objects[items[first].objectIndex].angle, m_spriteAngleStep);
+			surface = sprite->surface;
+			originX = sprite->originX;
+			originY = sprite->originY;
+		}
+		else {
+			cairo_pattern_get_surface(firstObject.pattern, &surface);
+			cairo_pattern_get_matrix(firstObject.pattern, &imageMatrix);
+		}
+
+		// A pattern of this group's own, since the shared ones are used by other threads.
+		cairo_pattern_t *source = cairo_pattern_create_for_surface(surface);
+		if (!sprites) cairo_pattern_set_extend(source, CAIRO_EXTEND_REPEAT);
+		cairo_set_source(cr, source);
+
+		double spriteWidth = cairo_image_surface_get_width(surface);
+		double spriteHeight = cairo_image_surface_get_height(surface);
+		for (size_t i = first; i < end; i ++) {
+			const ObjectState &objectState = state.objects[items[i].objectIndex];
+			double centerX = objectState.x;
+			double centerY = objectState.y;
+			cairo_matrix_transform_point(&m_view, &centerX, &centerY);
+
+			cairo_matrix_t matrix;
+			if (sprites) {
+				double spriteX = centerX - originX;
+				double spriteY = centerY - originY;
+				cairo_matrix_init_translate(&matrix, -spriteX, -spriteY);
+				cairo_pattern_set_matrix(source, &matrix);
+				cairo_rectangle(cr, spriteX, spriteY, spriteWidth, spriteHeight);
+			}
+			else {
+				// The object's own user space, composed by hand since the source is locked to device space.
+				cairo_matrix_t objectMatrix = m_view;
+				cairo_matrix_translate(&objectMatrix, objectState.x, objectState.y);
+				cairo_matrix_rotate(&objectMatrix, objectState.angle);
+				cairo_matrix_t inverse = objectMatrix;
+				cairo_matrix_invert(&inverse);
+				cairo_matrix_multiply(&matrix, &inverse, &imageMatrix);
+				cairo_pattern_set_matrix(source, &matrix);
+
+				double half = m_objects[items[i].objectIndex].imageSize;
+				static const double corners[4][2] = { { -1.0, -1.0 }, { 1.0, -1.0 }, { 1.0, 1.0 }, { -1.0, 1.0 } };
+				for (int corner = 0; corner < 4; corner ++) {
+					double x = corners[corner][0] * half;
+					double y = corners[corner][1] * half;
+					cairo_matrix_transform_point(&objectMatrix, &x, &y);
+					if (corner == 0) cairo_move_to(cr, x, y);
+					else cairo_line_to(cr, x, y);
+				}
+				cairo_close_path(cr);
 			}
+			cairo_fill(cr);
 		}
 
-		if (m_light != NULL) {
-			cairo_surface_t *shadowSurface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_frameWidth, m_frameHeight);
-			cairo_t *shadows = cairo_create(shadowSurface);
-			cairo_set_matrix(shadows, &view);
-			cairo_set_matrix(cr, &view);
-			SDL_assert(m_light->body != NULL);
-			cml::vector2d lightPosition(m_light->body->GetPosition().x, m_light->body->GetPosition().y);
-			for (int i = 0; i < (int)sides.size(); i ++) {
-				cml::vector2d objectVertexA = sides[i].first;
-				cml::vector2d objectVertexB = sides[i].second;
+		cairo_pattern_destroy(source);
+		first = end;
+	}
+	return (int)items.size();
+}
 
-				cml::vector2d line(objectVertexA - objectVertexB);
-				cml::vector2d normal(line[1], -line[0]);
+// The part of the world drawn into region, with a margin of a few pixels
+// for antialiased edges and the bilinear stretch of small shadow masks.
+WorldRect Animation::visibleRect(const SDL_Rect &region)
+{
+	cairo_matrix_t inverse = m_view;
+	if (cairo_matrix_invert(&inverse) != CAIRO_STATUS_SUCCESS) {
+		return WorldRect(-HUGE_VAL, -HUGE_VAL, HUGE_VAL, HUGE_VAL);
+	}
+
+	double margin = 2.0 + m_shadowScale;
+	double corners[4][2] = {
+		{ region.x - margin, region.y - margin },
+		{ region.x + region.w + margin, region.y - margin },
+		{ region.x + region.w + margin, region.y + region.h + margin },
+		{ region.x - margin, region.y + region.h + margin }
+	};
+	WorldRect rect(HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+	for (int i = 0; i < 4; i ++) {
+		cairo_matrix_transform_point(&inverse, &corners[i][0], &corners[i][1]);
+		rect.left = std::min(rect.left, corners[i][0]);
+		rect.top = std::min(rect.top, corners[i][1]);
+		rect.right = std::max(rect.right, corners[i][0]);
+		rect.bottom = std::max(rect.bottom, corners[i][1]);
+	}
+	return rect;
+}
+
+void Animation::rasterizeRegion(const FrameState &state, const ObjectGrid &grid, cairo_t *cr, const SDL_Rect &region)
+{
+	// Sprites are only evicted while no region holds on to one.
+	SpriteCache::Use spriteUse(m_spriteCache);
+	{
+		ProfileScope profile(Profiler::BACKGROUND, state.index);
+		cairo_identity_matrix(cr);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, m_backgroundSurface, 0.0, 0.0);
+		cairo_paint(cr);
+		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	}
 
-				// Discard sides facing away from the light.
-				if (dot(normal, objectVertexA - lightPosition) >= 0) continue;
+	WorldRect visible = visibleRect(region);
+	ProfileScope objectsProfile(Profiler::OBJECTS, state.index);
+	std::vector<int> visibleObjects;
+	grid.query(visible, visibleObjects);
+	int drawn = 0;
+	if (m_batchDraw) {
+		drawn = drawBatched(state, cr, visibleObjects);
+	}
+	else {
+		for (std::vector<int>::const_iterator it = visibleObjects.begin(); it != visibleObjects.end(); ++ it) {
+			int objectIndex = *it;
+			const ObjectState &objectState = state.objects[objectIndex];
+			double imageSize = m_objects[objectIndex].imageSize;
+			drawn ++;
+
+			b2Vec2 position(objectState.x, objectState.y);
+			float32 angle = objectState.angle;
+			cairo_pattern_t *pattern = m_objects[objectIndex].pattern;
+			const double boxSize = 2.0;
 
-				double shadowLength = 128.0; // Sufficiently large to go off the screen.
-				cml::vector2d shadowVertexA = objectVertexA + (objectVertexA - lightPosition).normalize() * shadowLength;
-				cml::vector2d shadowVertexB = objectVertexB + (objectVertexB - lightPosition).normalize() * shadowLength;
+			if (pattern != NULL && m_spriteAngleStep > 0.0) {
+				// Blit a pre-rotated, pre-scaled copy, positioned to the sub-pixel.
+				double scale = std::sqrt(m_view.xx * m_view.xx + m_view.yx * m_view.yx);
+				double centerX = position.x;
+				double centerY = position.y;
+				cairo_matrix_transform_point(&m_view, &centerX, &centerY);
+				const Sprite *sprite = m_spriteCache.get(m_objects[objectIndex].image, pattern, imageSize, scale, angle, m_spriteAngleStep);
+
+				double spriteX = centerX - sprite->originX;
+				double spriteY = centerY - sprite->originY;
+				cairo_identity_matrix(cr);
+				cairo_set_source_surface(cr, sprite->surface, spriteX, spriteY);
+				cairo_rectangle(cr, spriteX, spriteY, cairo_image_surface_get_width(sprite->surface), cairo_image_surface_get_height(sprite->surface));
+				cairo_fill(cr);
+			}
+			else {
+				cairo_set_matrix(cr, &m_view);
+				cairo_translate(cr, position.x, position.y);
+				cairo_rotate(cr, angle);
+				if (pattern != NULL) cairo_set_source(cr, pattern);
 
-				cairo_move_to(shadows, objectVertexA[0], objectVertexA[1]);
-				cairo_line_to(shadows, shadowVertexA[0], shadowVertexA[1]);
-				cairo_line_to(shadows, shadowVertexB[0], shadowVertexB[1]);
-				cairo_line_to(shadows, objectVertexB[0], objectVertexB[1]);
+				cairo_rectangle(cr, -(boxSize / 2.0) * imageSize, -(boxSize / 2.0) * imageSize, boxSize * imageSize, boxSize * imageSize);
+				cairo_fill(cr);
 			}
+		}
+	}
+	objectsProfile.end();
+	g_profiler.count(Profiler::OBJECTS_DRAWN, state.index, drawn);
+
+	if (!m_lights.empty()) {
+		ProfileScope shadowsProfile(Profiler::SHADOWS, state.index);
+
+		// A light only sees as far as the square of half size radius around
+		// it, so only lights whose square touches the region light any of it,
+		// and only sides inside one of those squares can shade it.
+		std::vector<const Light *> lights;
+		for (std::vector<Light>::const_iterator it = m_lights.begin(); it != m_lights.end(); ++ it) {
+			const ObjectState &lightState = state.objects[(*it).objectIndex];
+			if (visible.overlaps(lightState.x, lightState.y, (*it).radius)) lights.push_back(&*it);
+		}
+
+		// The objects inside the squares of those lights, once each.
+		std::vector<int> casters;
+		std::vector<int> nearLight;
+		for (std::vector<const Light *>::const_iterator it = lights.begin(); it != lights.end(); ++ it) {
+			const ObjectState &lightState = state.objects[(*it)->objectIndex];
+			double radius = (*it)->radius;
+			grid.query(WorldRect(lightState.x - radius, lightState.y - radius, lightState.x + radius, lightState.y + radius), nearLight);
+			casters.insert(casters.end(), nearLight.begin(), nearLight.end());
+		}
+		if (lights.size() > 1) {
+			std::sort(casters.begin(), casters.end());
+			casters.erase(std::unique(casters.begin(), casters.end()), casters.end());
+		}
 
-			cairo_set_source_rgba(shadows, 0.0, 0.0, 0.0, 1.0);
+		// Information about box sides, for use with drawing shadows.
+		std::vector<VisibilityPolygon::Segment> sides;
+		for (std::vector<int>::const_iterator it = casters.begin(); it != casters.end(); ++ it) {
+			int objectIndex = *it;
+			if (isLight(objectIndex)) continue;
+
+			const ObjectState &objectState = state.objects[objectIndex];
+			float32 angle = objectState.angle;
+			cml::vector2d pos(objectState.x, objectState.y);
+			cml::vector2d ex = cml::vector2d(std::cos(-angle), -std::sin(-angle));
+			cml::vector2d ey = cml::vector2d(std::sin(angle), -std::cos(angle));
+			sides.push_back(VisibilityPolygon::Segment(pos - ex - ey, pos + ex - ey));
+			sides.push_back(VisibilityPolygon::Segment(pos - ex + ey, pos - ex - ey));
+			sides.push_back(VisibilityPolygon::Segment(pos + ex + ey, pos - ex + ey));
+			sides.push_back(VisibilityPolygon::Segment(pos + ex - ey, pos + ex + ey));
+		}
+
+		// Each region draws into a mask buffer of its own while it lasts,
+		// m_shadowScale times smaller than the region, with user space still
+		// in world units.
+		ShadowBufferPool::Lease shadowBuffer(m_shadowBuffers);
+		int scale = m_shadowScale;
+		cairo_t *shadows = shadowBuffer->begin((region.w + scale - 1) / scale, (region.h + scale - 1) / scale);
+		cairo_surface_t *shadowSurface = shadowBuffer->surface();
+		cairo_surface_set_device_offset(shadowSurface, -(double)region.x / scale, -(double)region.y / scale);
+		cairo_matrix_t shadowMatrix;
+		cairo_matrix_t downscale;
+		cairo_matrix_init_scale(&downscale, 1.0 / scale, 1.0 / scale);
+		cairo_matrix_multiply(&shadowMatrix, &m_view, &downscale);
+
+		// Start fully in shadow, then let each light take away darkness where it
+		// can see, by its falloff. Where lights overlap their brightness adds up.
+		cairo_identity_matrix(shadows);
+		cairo_set_source_rgba(shadows, 0.0, 0.0, 0.0, 1.0);
+		cairo_paint(shadows);
+		cairo_set_operator(shadows, CAIRO_OPERATOR_DEST_OUT);
+
+		VisibilityPolygon visibility;
+		std::vector<VisibilityPolygon::Segment> facing;
+		std::vector<const Light *> tintedLights;
+		std::vector< std::vector<cml::vector2d> > tintedAreas;
+		for (std::vector<const Light *>::const_iterator it = lights.begin(); it != lights.end(); ++ it) {
+			const Light &light = **it;
+			const ObjectState &lightState = state.objects[light.objectIndex];
+			cml::vector2d lightPosition(lightState.x, lightState.y);
+
+			// Only sides facing the light can hide anything from it.
+			facing.clear();
+			for (std::vector<VisibilityPolygon::Segment>::const_iterator it = sides.begin(); it != sides.end(); ++ it) {
+				cml::vector2d line((*it).first - (*it).second);
+				cml::vector2d normal(line[1], -line[0]);
+				if (dot(normal, (*it).first - lightPosition) < 0) facing.push_back(*it);
+			}
+			visibility.compute(lightPosition, light.radius, facing);
+			const std::vector<cml::vector2d> &points = visibility.points();
+			if (points.empty()) continue;
+
+			double lightX = lightPosition[0];
+			double lightY = lightPosition[1];
+			cairo_matrix_transform_point(&m_view, &lightX, &lightY);
+			cairo_identity_matrix(shadows);
+			cairo_set_source_surface(shadows, light.falloff, lightX / scale - light.falloffRadius, lightY / scale - light.falloffRadius);
+
+			cairo_set_matrix(shadows, &shadowMatrix);
+			cairo_move_to(shadows, points[0][0], points[0][1]);
+			for (int i = 1; i < (int)points.size(); i ++) {
+				cairo_line_to(shadows, points[i][0], points[i][1]);
+			}
+			cairo_close_path(shadows);
 			cairo_fill(shadows);
-			cairo_pattern_t *radialPattern = cairo_pattern_create_radial(lightPosition[0], lightPosition[1], 0.0, lightPosition[0], lightPosition[1], 16.0);
-			cairo_pattern_add_color_stop_rgba(radialPattern, 0.0, 0.0, 0.0, 0.0, 0.0);
-			cairo_pattern_add_color_stop_rgba(radialPattern, 1.0, 0.0, 0.0, 0.0, 1.0);
-			cairo_set_source(shadows, radialPattern);
-			cairo_paint(shadows);
-			cairo_pattern_destroy(radialPattern);
-			cairo_destroy(shadows);
 
-			cairo_identity_matrix(cr);
-			cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.5);
+			if (light.tinted) {
+				tintedLights.push_back(&light);
+				tintedAreas.push_back(points);
+			}
+		}
+		cairo_set_operator(shadows, CAIRO_OPERATOR_OVER);
+		shadowsProfile.end();
+		g_profiler.count(Profiler::SHADOW_SIDES, state.index, (int)sides.size());
+
+		ProfileScope maskProfile(Profiler::MASK, state.index);
+		cairo_identity_matrix(cr);
+		cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.5);
+		if (scale == 1) {
 			cairo_mask_surface(cr, shadowSurface, 0.0, 0.0);
-			cairo_surface_destroy(shadowSurface);
 		}
+		else {
+			// Stretch the small mask back over the region, interpolating between its pixels.
+			cairo_pattern_t *maskPattern = cairo_pattern_create_for_surface(shadowSurface);
+			cairo_matrix_t maskMatrix;
+			cairo_matrix_init_scale(&maskMatrix, 1.0 / scale, 1.0 / scale);
+			cairo_pattern_set_matrix(maskPattern, &maskMatrix);
+			cairo_pattern_set_filter(maskPattern, CAIRO_FILTER_BILINEAR);
+			cairo_pattern_set_extend(maskPattern, CAIRO_EXTEND_PAD);
+			cairo_mask(cr, maskPattern);
+			cairo_pattern_destroy(maskPattern);
+		}
+		maskProfile.end();
+
+		// Coloured lights add their colour to what they light, fading out with
+		// the same falloff stretched back to full resolution.
+		for (int i = 0; i < (int)tintedLights.size(); i ++) {
+			const Light &light = *tintedLights[i];
+			const std::vector<cml::vector2d> &points = tintedAreas[i];
+			const ObjectState &lightState = state.objects[light.objectIndex];
+			double lightX = lightState.x;
+			double lightY = lightState.y;
+			cairo_matrix_transform_point(&m_view, &lightX, &lightY);
+
+			cairo_save(cr);
+			cairo_set_matrix(cr, &m_view);
+			cairo_move_to(cr, points[0][0], points[0][1]);
+			for (int j = 1; j < (int)points.size(); j ++) {
+				cairo_line_to(cr, points[j][0], points[j][1]);
+			}
+			cairo_close_path(cr);
+			cairo_clip(cr);
 
-		frame->updateTexture();
-		time += physicsTimeStep;
+			cairo_identity_matrix(cr);
+			cairo_pattern_t *glow = cairo_pattern_create_for_surface(light.falloff);
+			cairo_matrix_t glowMatrix;
+			cairo_matrix_init_scale(&glowMatrix, 1.0 / scale, 1.0 / scale);
+			cairo_matrix_translate(&glowMatrix, light.falloffRadius * scale - lightX, light.falloffRadius * scale - lightY);
+			cairo_pattern_set_matrix(glow, &glowMatrix);
+			cairo_pattern_set_filter(glow, CAIRO_FILTER_BILINEAR);
+			cairo_set_operator(cr, CAIRO_OPERATOR_ADD);
+			cairo_set_source_rgba(cr, light.red, light.green, light.blue, 0.5);
+			cairo_mask(cr, glow);
+			cairo_pattern_destroy(glow);
+			cairo_restore(cr);
+		}
 	}
+}
+
+bool Animation::isLight(int objectIndex)
+{
+	for (std::vector<Light>::const_iterator it = m_lights.begin(); it != m_lights.end(); ++ it) {
+		if ((*it).objectIndex == objectIndex) return true;
+	}
+	return false;
+}
 
-	cairo_pattern_destroy(backgroundPattern);
+// The light's radial falloff, opaque at the centre and transparent at its
+// radius, rendered once per load instead of as a gradient every frame.
+void Animation::createFalloff(Light &light)
+{
+	if (light.falloff != NULL) cairo_surface_destroy(light.falloff);
+
+	double viewScale = std::sqrt(m_view.xx * m_view.xx + m_view.yx * m_view.yx);
+	double radius = light.radius * viewScale / m_shadowScale;
+	light.falloffRadius = std::ceil(radius) + 1.0;
+	int size = (int)(light.falloffRadius * 2.0);
+	light.falloff = cairo_image_surface_create(CAIRO_FORMAT_A8, size, size);
+	SDL_assert(cairo_surface_status(light.falloff) == CAIRO_STATUS_SUCCESS);
+
+	cairo_t *cr = cairo_create(light.falloff);
+	cairo_pattern_t *radialPattern = cairo_pattern_create_radial(light.falloffRadius, light.falloffRadius, 0.0, light.falloffRadius, light.falloffRadius, radius);
+	cairo_pattern_add_color_stop_rgba(radialPattern, 0.0, 0.0, 0.0, 0.0, 1.0);
+	cairo_pattern_add_color_stop_rgba(radialPattern, 1.0, 0.0, 0.0, 0.0, 0.0);
+	cairo_set_source(cr, radialPattern);
+	cairo_paint(cr);
+	cairo_pattern_destroy(radialPattern);
+	cairo_destroy(cr);
+}
+
+void Animation::clearLights(void)
+{
+	for (std::vector<Light>::iterator it = m_lights.begin(); it != m_lights.end(); ++ it) {
+		if ((*it).falloff != NULL) cairo_surface_destroy((*it).falloff);
+	}
+	m_lights.clear();
+}
+
+void Animation::reportError(std::string title, std::string message)
+{
+	g_console.print(boost::format("%s: %s") % title % message);
+
+	// Only pop up a message box when there is a window for it to belong to.
+	if (SDL_WasInit(SDL_INIT_VIDEO) != 0) {
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title.c_str(), message.c_str(), NULL);
+	}
 }
 
 b2Body *Animation::spawnCrate(float x, float y, float density)
@@ -1,11 +1,14 @@
 #ifndef ANIMATION_HPP
 #define ANIMATION_HPP
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/math/special_functions/round.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -14,12 +17,15 @@
 #include <cairo/cairo.h>
 #include <Box2D/Box2D.h>
 #include "ImageCache.hpp"
+#include "SpriteCache.hpp"
 #include "Console.hpp"
+#include "SceneDescription.hpp"
+#include "WorkerPool.hpp"
 
 class Object {
 public:
-	Object(b2Body *body = NULL, std::string image = "") :
-		body(body), image(image)
+	Object(b2Body *body = NULL, std::string image = "", cairo_pattern_t *pattern = NULL, double imageSize = 1.0) :
+		body(body), image(image), pattern(pattern), imageSize(imageSize)
 	{
 	}
 
@@ -28,6 +34,27 @@ public:
 
 	b2Body *body;
 	std::string image;
+	cairo_pattern_t *pattern; // image's entry in m_imagePatterns, looked up once at load.
+	double imageSize; // Width of image in world units.
+};
+
+// An object that gives off light. Whatever it can't see within radius world
+// units is in its shadow.
+class Light {
+public:
+	Light(int objectIndex = -1, double radius = 16.0) :
+		objectIndex(objectIndex), radius(radius), tinted(false), red(1.0), green(1.0), blue(1.0), falloff(NULL), falloffRadius(0.0)
+	{
+	}
+
+	int objectIndex;
+	double radius;
+	bool tinted; // Whether lit areas also take on the light's colour.
+	double red;
+	double green;
+	double blue;
+	cairo_surface_t *falloff; // Brightness around the light at shadow mask resolution, owned by Animation.
+	double falloffRadius; // Half of falloff's size, in mask pixels.
 };
 
 class Frame
@@ -40,30 +67,33 @@ public:
 			0x000000ff,
 			0xff000000
 		);
+		createContext();
+	}
 
-		cairo_surface_t *cairoSurface = cairo_image_surface_create_for_data((unsigned char*)m_sdlSurface->pixels, CAIRO_FORMAT_ARGB32, width, height, m_sdlSurface->pitch);
-		SDL_assert(cairoSurface != NULL);
-		SDL_assert(cairo_surface_status(cairoSurface) != CAIRO_STATUS_INVALID_STRIDE);
-		m_cairoContext = cairo_create(cairoSurface);
-		SDL_assert(cairo_status(m_cairoContext) == CAIRO_STATUS_SUCCESS);
-		cairo_surface_destroy(cairoSurface);
-
-		m_texture = NULL;
+	// A frame over pixels that belong to something else, e.g. a file mapping,
+	// which owner keeps alive for as long as the frame is.
+	Frame(int width, int height, void *pixels, int pitch, boost::shared_ptr<void> owner) :
+		m_owner(owner)
+	{
+		m_sdlSurface = SDL_CreateRGBSurfaceFrom(pixels, width, height, 32, pitch,
+			0x00ff0000,
+			0x0000ff00,
+			0x000000ff,
+			0xff000000
+		);
+		createContext();
 	}
 
 	~Frame() {
+		// Frames are let go of on load threads too, but only the UI thread may destroy a texture.
 		if (m_texture != NULL) {
-			SDL_DestroyTexture(m_texture);
+			releaseTexture(m_texture);
 		}
 
 		SDL_FreeSurface(m_sdlSurface);
 		cairo_destroy(m_cairoContext);
 	}
 
-	void updateTexture(void) {
-		SDL_UpdateTexture(m_texture, NULL, m_sdlSurface->pixels, m_sdlSurface->pitch);
-	}
-
 	SDL_Surface *surface(void) {
 		return m_sdlSurface;
 	}
@@ -80,22 +110,253 @@ public:
 		return m_cairoContext;
 	}
 
+	// Destroys the textures of the frames let go of since the last call. Only
+	// for the thread that creates them with texture().
+	static void destroyReleasedTextures(void);
+
 protected:
 	SDL_Surface *m_sdlSurface;
 	SDL_Texture *m_texture;
 	cairo_t *m_cairoContext;
+	boost::shared_ptr<void> m_owner;
+
+	void createContext(void) {
+		cairo_surface_t *cairoSurface = cairo_image_surface_create_for_data((unsigned char*)m_sdlSurface->pixels, CAIRO_FORMAT_ARGB32, m_sdlSurface->w, m_sdlSurface->h, m_sdlSurface->pitch);
+		SDL_assert(cairoSurface != NULL);
+		SDL_assert(cairo_surface_status(cairoSurface) != CAIRO_STATUS_INVALID_STRIDE);
+		m_cairoContext = cairo_create(cairoSurface);
+		SDL_assert(cairo_status(m_cairoContext) == CAIRO_STATUS_SUCCESS);
+		cairo_surface_destroy(cairoSurface);
+
+		m_texture = NULL;
+	}
+
+	static void releaseTexture(SDL_Texture *texture);
 };
 
 typedef boost::shared_ptr<Frame> FramePtr;
 
+// An A8 surface and context for drawing shadow masks into, reused from one
+// region to the next so the light pass doesn't allocate per frame. The pixel
+// buffer only ever grows; the surface is recreated over it when the size
+// changes.
+class ShadowBuffer
+{
+public:
+	ShadowBuffer() :
+		m_surface(NULL), m_context(NULL), m_width(0), m_height(0), m_stride(0)
+	{
+	}
+
+	~ShadowBuffer() {
+		release();
+	}
+
+	// Cleared context for a width x height mask.
+	cairo_t *begin(int width, int height) {
+		if (width != m_width || height != m_height) {
+			release();
+			m_stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, width);
+			if (m_pixels.size() < (size_t)(m_stride * height)) {
+				m_pixels.resize(m_stride * height);
+			}
+			m_surface = cairo_image_surface_create_for_data(&m_pixels[0], CAIRO_FORMAT_A8, width, height, m_stride);
+			SDL_assert(cairo_surface_status(m_surface) == CAIRO_STATUS_SUCCESS);
+			m_context = cairo_create(m_surface);
+			m_width = width;
+			m_height = height;
+		}
+
+		cairo_surface_flush(m_surface);
+		memset(&m_pixels[0], 0, m_stride * m_height);
+		cairo_surface_mark_dirty(m_surface);
+		cairo_new_path(m_context);
+		return m_context;
+	}
+
+	cairo_surface_t *surface(void) {
+		return m_surface;
+	}
+private:
+	std::vector<unsigned char> m_pixels;
+	cairo_surface_t *m_surface;
+	cairo_t *m_context;
+	int m_width;
+	int m_height;
+	int m_stride;
+
+	void release(void) {
+		if (m_context != NULL) cairo_destroy(m_context);
+		if (m_surface != NULL) cairo_surface_destroy(m_surface);
+		m_context = NULL;
+		m_surface = NULL;
+	}
+};
+
+// The shadow buffers of one Animation, each lent to one region at a time.
+// There are as many as regions have been drawn at once, and they go with the
+// Animation rather than staying with the threads that drew.
+class ShadowBufferPool
+{
+public:
+	// Borrows a buffer for as long as it exists.
+	class Lease
+	{
+	public:
+		Lease(ShadowBufferPool &pool) :
+			m_pool(pool), m_buffer(pool.acquire())
+		{
+		}
+
+		~Lease() {
+			m_pool.release(m_buffer);
+		}
+
+		ShadowBuffer *operator->(void) {
+			return m_buffer;
+		}
+	private:
+		ShadowBufferPool &m_pool;
+		ShadowBuffer *m_buffer;
+	};
+
+private:
+	boost::mutex m_mutex;
+	std::vector< boost::shared_ptr<ShadowBuffer> > m_buffers;
+	std::vector<ShadowBuffer *> m_free;
+
+	ShadowBuffer *acquire(void) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (m_free.empty()) {
+			m_buffers.push_back(boost::shared_ptr<ShadowBuffer>(new ShadowBuffer()));
+			return m_buffers.back().get();
+		}
+		ShadowBuffer *buffer = m_free.back();
+		m_free.pop_back();
+		return buffer;
+	}
+
+	void release(ShadowBuffer *buffer) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_free.push_back(buffer);
+	}
+};
+
+// Where a body was at one instant, as recorded by the simulation.
+class ObjectState {
+public:
+	ObjectState(float32 x = 0.0f, float32 y = 0.0f, float32 angle = 0.0f) :
+		x(x), y(y), angle(angle)
+	{
+	}
+
+	bool operator!=(const ObjectState &other) const {
+		return x != other.x || y != other.y || angle != other.angle;
+	}
+
+	float32 x;
+	float32 y;
+	float32 angle;
+};
+
+// Snapshot of every object for one frame, in the same order as the scene's
+// objects. Rasterizing only needs this, not the live b2World, so frames can be
+// drawn on other threads while the simulation moves on.
+class FrameState {
+public:
+	FrameState() :
+		index(0)
+	{
+	}
+
+	int index;
+	std::vector<ObjectState> objects;
+};
+
+// One object to draw in a batch, ordered so objects that share a source are
+// next to each other and otherwise keep their scene order.
+class DrawItem {
+public:
+	DrawItem(cairo_pattern_t *pattern, long long angleKey, int objectIndex) :
+		pattern(pattern), angleKey(angleKey), objectIndex(objectIndex)
+	{
+	}
+
+	bool operator<(const DrawItem &other) const {
+		if (pattern != other.pattern) return pattern < other.pattern;
+		if (angleKey != other.angleKey) return angleKey < other.angleKey;
+		return objectIndex < other.objectIndex;
+	}
+
+	cairo_pattern_t *pattern;
+	long long angleKey; // Which pre-rotated sprite; 0 without sprites.
+	int objectIndex;
+};
+
+// An axis aligned rectangle in world units, for culling what can't be seen.
+class WorldRect {
+public:
+	WorldRect(double left = 0.0, double top = 0.0, double right = 0.0, double bottom = 0.0) :
+		left(left), top(top), right(right), bottom(bottom)
+	{
+	}
+
+	// Whether the square of half size halfSize around x, y touches the rectangle.
+	bool overlaps(double x, double y, double halfSize) const {
+		return x + halfSize >= left && x - halfSize <= right && y + halfSize >= top && y - halfSize <= bottom;
+	}
+
+	double left;
+	double top;
+	double right;
+	double bottom;
+};
+
+// The objects of one frame bucketed into square cells by where they are, so
+// drawing a region only looks at the objects near it rather than all of
+// them. Built once per frame and shared by the threads drawing its regions.
+class ObjectGrid {
+public:
+	ObjectGrid(const FrameState &state, const std::vector<Object> &objects);
+
+	void query(const WorldRect &rect, std::vector<int> &objectIndices) const;
+private:
+	const FrameState &m_state;
+	std::vector<double> m_extents; // Half size of the square each object stays within.
+	double m_maxExtent;
+	double m_left;
+	double m_top;
+	double m_cellSize;
+	int m_columns;
+	int m_rows;
+	std::vector<int> m_cellStarts; // Where each cell's objects start in m_cellObjects, then the end.
+	std::vector<int> m_cellObjects;
+
+	int column(double x) const;
+	int row(double y) const;
+};
+
+class FrameWriter;
+class FrameBlender;
+class RunningBlend;
+class FrameStore;
+class Trajectory;
+
 class Animation
 {
 	public:
 		Animation();
 		virtual ~Animation();
 
-		bool load(std::string jsonFile);
-		void save(void);
+		bool load(std::string jsonFile, bool preview = false);
+		void cancel(void);
+		bool cancelled(void);
+		bool loadScene(std::string jsonFile);
+		bool open(std::string cacheFile);
+		void setOption(std::string key, std::string value);
+		boost::property_tree::ptree &options(void);
+		bool save(std::string directory = "output");
+		bool save(FrameWriter &writer);
 		void pause(void);
 		void resume(void);
 		void reverse(void);
@@ -104,29 +365,92 @@ class Animation
 		int height(void);
 		void framerate(double framerate);
 		double framerate(void);
-		std::vector<FramePtr> &frames(void);
+		double outputFramerate(void);
+		bool transparencyKey(Uint32 &rgb);
+		SpriteCache &spriteCache(void);
+		FrameStore &frames(void);
 		FramePtr currentFrame(double currentTime);
 		void blendFrames(void);
+		bool blendSettings(int nrofFramesToBlend, std::string curve, int step = 0);
+		int blendFrameCount(void);
+		std::string blendCurve(void);
+		int blendStep(void);
+		int blendOutputCount(int frameCount);
+		std::vector<double> blendWeights(void);
+		bool reversed(void);
+		int frameCount(void);
+		void simulate(FrameState &state);
+		void rasterize(const FrameState &state, FramePtr frame);
 	protected:
 	private:
 		bool m_paused;
 		bool m_reversed;
 		int m_frameWidth;
 		int m_frameHeight;
+		boost::mutex m_sizeMutex; // Guards the frame size, which a load sets while the preview reads it.
 		double m_framerate;
-		std::vector<FramePtr> m_frames;
+		boost::shared_ptr<FrameStore> m_frames;
+		boost::mutex m_framesMutex; // A load on another thread adds frames while the preview plays them.
+		bool m_cancelled;
 		int m_frameIndex;
 		Uint32 m_animationTimeStep;
 		Uint32 m_nextAnimationFrame;
-		b2World *m_world;
+		b2World *m_world; // NULL while replaying a trajectory.
+		boost::shared_ptr<Trajectory> m_trajectory;
+		Uint64 m_trajectoryKey;
+		std::string m_trajectoryFile; // Empty when the cache is off.
+		std::string m_sceneFile; // Names the scene in progress messages.
+		bool m_replaying;
 		std::vector<Object> m_objects;
-		Object *m_light;
+		std::vector<Light> m_lights;
+		int m_stepIndex; // Frames simulated so far.
+		double m_physicsRate; // Box2D steps per second of animation.
+		double m_outputRate; // Frames rasterized per second of animation.
+		int m_physicsSteps;
+		std::vector<ObjectState> m_stepStart; // Bodies before the last physics step.
 		std::map<std::string, cairo_pattern_t *> m_imagePatterns;
+		cairo_pattern_t *m_backgroundPattern;
+		cairo_surface_t *m_backgroundSurface; // m_backgroundPattern composited once at frame size.
+		cairo_matrix_t m_view;
+		int m_tileCount;
+		bool m_dirtyRects;
+		bool m_batchDraw;
+		double m_spriteAngleStep; // Radians; 0 draws straight from m_imagePatterns.
+		double m_spriteScale; // View scale the cached sprites were drawn at.
+		int m_shadowScale; // Shadow masks are drawn at 1 / m_shadowScale resolution.
+		ShadowBufferPool m_shadowBuffers;
+		SpriteCache m_spriteCache;
+		int m_blendFrameCount;
+		std::string m_blendCurve;
+		int m_blendStep;
+		int m_frameSpan; // Simulation frames covered by each frame in m_frames.
+		boost::shared_ptr<WorkerPool> m_tilePool;
 
-		boost::property_tree::ptree m_animationProperties;
+		SceneDescription m_scene;
+		boost::property_tree::ptree m_options; // Overrides applied on top of the scene file.
 
-		void blendFramesStriped(int threadIndex, int threadCount, std::vector<double> &frameWeights, std::vector<FramePtr> *output);
-		void render(void);
+		void blendFramesStriped(int threadIndex, int threadCount, FrameBlender *blender, std::vector<FramePtr> *output);
+		void blendFramesSliding(void);
+		void blendFramesSlidingWindow(FrameBlender *blender, const std::deque<FramePtr> &frames, int offset, int outputIndex, std::vector<FramePtr> *output);
+		void blendFramesRunning(RunningBlend *sums, const std::vector<FramePtr> &added, const std::vector<FramePtr> &subtracted, int frameCount, int outputIndex, FramePtr output);
+		void replaceFrames(std::vector<FramePtr> &frames);
+		bool render(void);
+		bool renderLazily(void);
+		void advanceFrame(int steps);
+		void bodyStates(std::vector<ObjectState> &states);
+		void rasterizeDirty(const FrameState &state, const FrameState &previous, FramePtr previousFrame, FramePtr frame);
+		bool dirtyRects(const FrameState &state, const FrameState &previous, std::vector<SDL_Rect> &rects);
+		SDL_Rect objectBounds(const ObjectState &object, int objectIndex);
+		SDL_Rect lightBounds(const ObjectState &object, const Light &light, const ObjectState &lightState);
+		SDL_Rect deviceBounds(const std::vector<cml::vector2d> &points);
+		void rasterizeRect(const FrameState &state, const ObjectGrid &grid, FramePtr frame, SDL_Rect rect);
+		void rasterizeRegion(const FrameState &state, const ObjectGrid &grid, cairo_t *cr, const SDL_Rect &region);
+		int drawBatched(const FrameState &state, cairo_t *cr, const std::vector<int> &objectIndices);
+		WorldRect visibleRect(const SDL_Rect &region);
+		bool isLight(int objectIndex);
+		void createFalloff(Light &light);
+		void clearLights(void);
+		void reportError(std::string title, std::string message);
 		b2Body *spawnCrate(float x, float y, float density = 1.0f);
 		b2Body *spawnBall(float x, float y, float density = 1.0f);
 };
@@ -1,7 +1,7 @@
 #include "Application.hpp"
 
 Application::Application() :
-	m_wantsToExit(false), m_window(NULL), m_renderer(NULL)
+	m_wantsToExit(false), m_window(NULL), m_renderer(NULL), m_saving(false), m_loading(false), m_queueing(false)
 {
 	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "SDL_Init error", SDL_GetError(), NULL);
@@ -15,6 +15,17 @@ Application::Application() :
 
 Application::~Application()
 {
+	if (m_saveThread.joinable()) m_saveThread.join();
+	if (m_loadThread.joinable()) {
+		m_animation.cancel();
+		m_loadThread.join();
+	}
+	if (m_queueThread.joinable()) {
+		m_queue->cancel();
+		m_queueThread.join();
+	}
+
+	Frame::destroyReleasedTextures();
 	SDL_DestroyRenderer(m_renderer);
 	SDL_DestroyWindow(m_window);
 	SDL_Quit();
@@ -34,9 +45,43 @@ void Application::update(void)
 		do {
 			cmd = g_console.getNextCommand();
 
-			if (cmd == "blend") {
-				m_animation.blendFrames();
-				g_console.print("Done.");
+			// Frames mustn't change under a save that is still running.
+			if (saving() && (cmd.find("blend") == 0 || cmd.find("load") == 0 || cmd.find("open") == 0 || cmd.find("save") == 0)) {
+				g_console.print("Still saving, try again when it's done");
+				continue;
+			}
+
+			// A new load cancels the one in progress; anything else that needs all the frames, or
+			// changes the options it is reading, waits for it.
+			if (loading() && (cmd.find("blend") == 0 || cmd == "memory" || cmd.find("open") == 0 || cmd.find("save") == 0 || cmd.find("set") == 0)) {
+				g_console.print("Still loading, try again when it's done");
+				continue;
+			}
+
+			if (cmd.find("blend") == 0) {
+				std::istringstream arguments(cmd.substr(5));
+				std::string frameArgument;
+				std::string curve;
+				std::string stepArgument;
+				arguments >> frameArgument >> curve >> stepArgument;
+				int nrofFramesToBlend = m_animation.blendFrameCount();
+				int step = 0;
+				try {
+					if (frameArgument.length() > 0) nrofFramesToBlend = boost::lexical_cast<int>(frameArgument);
+					if (stepArgument.length() > 0) step = boost::lexical_cast<int>(stepArgument);
+				}
+				catch (boost::bad_lexical_cast) {
+					nrofFramesToBlend = -1;
+				}
+				if (curve.length() == 0) curve = m_animation.blendCurve();
+
+				if (m_animation.blendSettings(nrofFramesToBlend, curve, step)) {
+					m_animation.blendFrames();
+					g_console.print(boost::format("Done. Blended %i frame windows every %i frames with a %s curve (%s kernel).") % nrofFramesToBlend % m_animation.blendStep() % curve % FrameBlender::kernelName());
+				}
+				else {
+					g_console.print("Usage: blend [frames] [sine|box|triangle|gaussian] [step]");
+				}
 			}
 
 			if (cmd.find("framerate") == 0) {
@@ -63,18 +108,27 @@ void Application::update(void)
 
 			if (cmd.find("help") == 0) {
 				g_console.print("Available commands:");
-				g_console.print("blend framerate load pause resume reverse save quit");
+				g_console.print("blend framerate load memory open pause resume reverse save [bmp|png [level]|raw|y4m [path]|gif [global|local]] set sprites stats [on|off|reset|trace [file]] queue [-j n] <scenes> quit");
 			}
 
 			if (cmd.find("load") == 0) {
 				std::string argument;
 				if (cmd.length() > 9) argument = cmd.substr(5);
-				std::string filename = argument;
-				if (m_animation.load(filename)) {
-					g_console.print(boost::format("Successfully loaded %s") % filename);
+				load(argument);
+			}
+
+			if (cmd == "memory") {
+				g_console.print(m_animation.frames().summary());
+			}
+
+			if (cmd.find("open") == 0) {
+				std::string filename;
+				if (cmd.length() > 5) filename = cmd.substr(5);
+				if (m_animation.open(filename)) {
+					g_console.print(boost::format("Opened %i frames from %s") % m_animation.frames().size() % filename);
 				}
 				else {
-					g_console.print(boost::format("Error loading %s") % filename);
+					g_console.print(boost::format("Error opening %s") % filename);
 				}
 			}
 
@@ -90,9 +144,131 @@ void Application::update(void)
 				m_animation.reverse();
 			}
 
-			if (cmd == "save") {
-				m_animation.save();
-				g_console.print("Saved.");
+			if (cmd.find("save") == 0) {
+				std::istringstream arguments(cmd.substr(4));
+				std::string format;
+				std::string setting;
+				arguments >> format >> setting;
+				boost::shared_ptr<FrameWriter> writer;
+				std::string target = "output";
+				if (format == "" || format == "bmp") {
+					writer.reset(new BmpFrameWriter(target));
+				}
+				else if (format == "png") {
+					int level = 6;
+					try {
+						if (setting.length() > 0) level = boost::lexical_cast<int>(setting);
+					}
+					catch (boost::bad_lexical_cast) {
+						level = -1;
+					}
+					if (level >= 0 && level <= 9) writer.reset(new PngFrameWriter(target, level));
+				}
+				else if (format == "raw") {
+					target = "output/animation.raw";
+					writer.reset(new RawFrameWriter(target));
+				}
+				else if (format == "y4m") {
+					// Any path, e.g. a FIFO an encoder is reading from.
+					target = setting.length() > 0 ? setting : "output/animation.y4m";
+					writer.reset(new VideoStreamWriter(target));
+				}
+				else if (format == "gif" && (setting == "" || setting == "global" || setting == "local")) {
+					target = "output/animation.gif";
+					GifWriter *gifWriter = new GifWriter(target, setting != "local");
+					Uint32 key;
+					if (m_animation.transparencyKey(key)) {
+						gifWriter->transparencyKey(key);
+					}
+					writer.reset(gifWriter);
+				}
+
+				if (writer) {
+					save(writer, target);
+				}
+				else {
+					g_console.print("Usage: save [bmp | png [0-9] | raw | y4m [path] | gif [global|local]]");
+				}
+			}
+
+			if (cmd.find("set") == 0) {
+				std::istringstream arguments(cmd.substr(3));
+				std::string key;
+				std::string value;
+				arguments >> key >> value;
+				if (key.empty() || value.empty()) {
+					g_console.print("Usage: set <option> <value>, e.g. set tiles 4");
+					for (boost::property_tree::ptree::const_iterator it = m_animation.options().begin(); it != m_animation.options().end(); ++ it) {
+						g_console.print(boost::format("%s = %s") % it->first % it->second.data());
+					}
+				}
+				else {
+					m_animation.setOption(key, value);
+					g_console.print(boost::format("Set %s to %s, takes effect on the next load") % key % value);
+				}
+			}
+
+			if (cmd.find("queue") == 0) {
+				std::istringstream arguments(cmd.substr(5));
+				std::vector<std::string> sceneFiles;
+				std::string argument;
+				int concurrency = 0;
+				bool valid = true;
+				while (arguments >> argument) {
+					if (argument == "-j") {
+						valid = (bool)(arguments >> concurrency) && concurrency > 0;
+					}
+					else {
+						sceneFiles.push_back(argument);
+					}
+				}
+
+				if (queueing()) {
+					g_console.print("Still rendering the last queue, try again when it's done");
+				}
+				else if (!valid || sceneFiles.empty()) {
+					g_console.print("Usage: queue [-j <scenes at once>] <scene.json> [...]");
+				}
+				else {
+					queue(sceneFiles, concurrency);
+				}
+			}
+
+			if (cmd == "sprites") {
+				g_console.print(m_animation.spriteCache().summary());
+			}
+
+			if (cmd.find("stats") == 0) {
+				std::istringstream arguments(cmd.substr(5));
+				std::string action;
+				std::string filename;
+				arguments >> action >> filename;
+				if (action == "on" || action == "off") {
+					g_profiler.enable(action == "on");
+					g_console.print(boost::format("Timing the render hot paths is %s") % action);
+				}
+				else if (action == "reset") {
+					g_profiler.reset();
+					g_console.print("Cleared the recorded timings");
+				}
+				else if (action == "trace") {
+					if (filename.empty()) filename = "output/trace.json";
+					if (g_profiler.writeTrace(filename)) {
+						g_console.print(boost::format("Wrote a trace to %s") % filename);
+					}
+					else {
+						g_console.print(boost::format("Error writing %s") % filename);
+					}
+				}
+				else if (action.empty()) {
+					std::vector<std::string> lines = g_profiler.stats();
+					for (std::vector<std::string>::iterator it = lines.begin(); it != lines.end(); ++ it) {
+						g_console.print(*it);
+					}
+				}
+				else {
+					g_console.print("Usage: stats [on | off | reset | trace [file]]");
+				}
 			}
 
 			if (cmd == "quit") {
@@ -110,6 +286,8 @@ void Application::update(void)
 	SDL_SetRenderDrawColor(m_renderer, 0, 77, 0, 255);
 	SDL_RenderClear(m_renderer);
 
+	Frame::destroyReleasedTextures();
+
 	FramePtr frame = m_animation.currentFrame((double)SDL_GetTicks());
 	if (frame.use_count() > 0) {
 		SDL_Texture *frameTexture = frame->texture(m_renderer);
@@ -121,3 +299,109 @@ void Application::update(void)
 	g_console.render(m_renderer);
 	SDL_RenderPresent(m_renderer);
 }
+
+// Loads and renders on a thread of its own, so the preview plays frames as
+// they are finished and commands keep working. Cancels any load in progress.
+void Application::load(std::string filename)
+{
+	if (m_loadThread.joinable()) {
+		m_animation.cancel();
+		m_loadThread.join();
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	m_loading = true;
+	m_loadThread = boost::thread(boost::bind(&Application::loadFrames, this, filename));
+}
+
+void Application::loadFrames(std::string filename)
+{
+	Uint32 start = SDL_GetTicks();
+	if (m_animation.load(filename, true)) {
+		g_console.print(boost::format("Successfully loaded %s in %.1fs") % filename % ((SDL_GetTicks() - start) / 1000.0));
+	}
+	else if (m_animation.cancelled()) {
+		g_console.print(boost::format("Stopped loading %s") % filename);
+	}
+	else {
+		g_console.print(boost::format("Error loading %s") % filename);
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	m_loading = false;
+}
+
+bool Application::loading(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	return m_loading;
+}
+
+// Writes the frames on a thread of its own, so the preview keeps running.
+void Application::save(boost::shared_ptr<FrameWriter> writer, std::string target)
+{
+	if (m_saveThread.joinable()) m_saveThread.join();
+
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	m_saving = true;
+	m_saveThread = boost::thread(boost::bind(&Application::saveFrames, this, writer, target));
+}
+
+void Application::saveFrames(boost::shared_ptr<FrameWriter> writer, std::string target)
+{
+	Uint32 start = SDL_GetTicks();
+	AsyncFrameWriter asyncWriter(*writer);
+	if (m_animation.save(asyncWriter)) {
+		g_console.print(boost::format("Saved %i frames to %s in %.1fs.") % m_animation.frames().size() % target % ((SDL_GetTicks() - start) / 1000.0));
+	}
+	else {
+		g_console.print(boost::format("Error saving to %s") % target);
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	m_saving = false;
+}
+
+bool Application::saving(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	return m_saving;
+}
+
+// Renders the scenes into output/<scene name> on a thread of their own, with
+// the current set overrides, leaving the preview's animation alone.
+void Application::queue(std::vector<std::string> sceneFiles, int concurrency)
+{
+	if (m_queueThread.joinable()) m_queueThread.join();
+
+	m_queue.reset(new RenderQueue(&Application::createQueueWriter, "output", concurrency));
+	m_queue->options(m_animation.options());
+	for (std::vector<std::string>::iterator it = sceneFiles.begin(); it != sceneFiles.end(); ++ it) {
+		m_queue->add(*it);
+	}
+	g_console.print(boost::format("Queued %i scenes, rendering %i at a time") % m_queue->jobCount() % std::min(m_queue->concurrency(), m_queue->jobCount()));
+
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	m_queueing = true;
+	m_queueThread = boost::thread(boost::bind(&Application::runQueue, this));
+}
+
+void Application::runQueue(void)
+{
+	m_queue->run();
+	g_console.print(m_queue->summary());
+
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	m_queueing = false;
+}
+
+bool Application::queueing(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_saveMutex);
+	return m_queueing;
+}
+
+FrameWriter *Application::createQueueWriter(Animation &animation, std::string outputDirectory)
+{
+	return new BmpFrameWriter(outputDirectory);
+}
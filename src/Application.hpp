@@ -1,11 +1,19 @@
 #ifndef APPLICATION_HPP
 #define APPLICATION_HPP
 
+#include <sstream>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <SDL2/SDL.h>
 #include "Animation.hpp"
 #include "Console.hpp"
+#include "FrameBlender.hpp"
+#include "GifWriter.hpp"
+#include "Profiler.hpp"
+#include "RenderQueue.hpp"
+#include "VideoStreamWriter.hpp"
 
 class Application
 {
@@ -24,6 +32,25 @@ private:
 	int m_windowWidth;
 	int m_windowHeight;
 	Animation m_animation;
+	boost::thread m_saveThread;
+	bool m_saving;
+	boost::mutex m_saveMutex; // Guards m_saving, m_loading and m_queueing.
+	boost::thread m_loadThread;
+	bool m_loading;
+	boost::shared_ptr<RenderQueue> m_queue;
+	boost::thread m_queueThread;
+	bool m_queueing;
+
+	void load(std::string filename);
+	void loadFrames(std::string filename);
+	bool loading(void);
+	void save(boost::shared_ptr<FrameWriter> writer, std::string target);
+	void saveFrames(boost::shared_ptr<FrameWriter> writer, std::string target);
+	bool saving(void);
+	void queue(std::vector<std::string> sceneFiles, int concurrency);
+	void runQueue(void);
+	bool queueing(void);
+	static FrameWriter *createQueueWriter(Animation &animation, std::string outputDirectory);
 };
 
 #endif // APPLICATION_HPP
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <SDL2/SDL.h>
+#include "Animation.hpp"
+#include "FrameStore.hpp"
+#include "FrameWriter.hpp"
+
+// Times each stage of a batch render on generated scenes and writes the
+// results as JSON, so runs before and after a change can be compared.
+//
+// Every combination of the box counts and light settings given is one case.
+// Each case is loaded fresh for every iteration, simulated, rasterized,
+// saved and blended, and each stage is timed on its own. The shadow pass
+// can't be timed from outside the rasterizer, so for cases with a light
+// the same frames are also rasterized with the light turned off and the
+// difference is reported as "shadows".
+
+namespace {
+	class BenchCase
+	{
+	public:
+		int boxCount;
+		bool light;
+		bool backgroundImage;
+		int width;
+		int height;
+		int frameCount;
+	};
+
+	// Milliseconds spent in one stage, one entry per iteration.
+	typedef std::vector<double> Timings;
+
+	class CaseResult
+	{
+	public:
+		BenchCase benchCase;
+		Timings simulate;
+		Timings rasterize;
+		Timings shadows;
+		Timings blend;
+		Timings save;
+	};
+
+	double millisecondsSince(Uint64 start)
+	{
+		return (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	}
+
+	// A square stack of boxes on the ground, framed by the camera, with a
+	// ball flying in from the left that is the light when there is one.
+	std::string writeScene(const BenchCase &benchCase, bool light, std::string directory)
+	{
+		using boost::property_tree::ptree;
+
+		int columns = std::max(1, std::min(24, (int)std::ceil(std::sqrt((double)benchCase.boxCount))));
+		int rows = (benchCase.boxCount + columns - 1) / columns;
+		double worldWidth = 2.0 * columns + 24.0;
+		double worldHeight = 2.0 * rows + 4.0;
+		double zoom = std::min(benchCase.width / (64.0 * worldWidth), benchCase.height / (64.0 * worldHeight));
+
+		ptree scene;
+		scene.put("width", benchCase.width);
+		scene.put("height", benchCase.height);
+		scene.put("framerate", 320);
+		scene.put("animationlength", (benchCase.frameCount + 0.5) / 320.0);
+		scene.put("gravityy", 50);
+		scene.put("camerax", 0);
+		scene.put("cameray", rows);
+		scene.put("zoom", zoom);
+		scene.put("trajectorycache", "");
+		if (benchCase.backgroundImage) {
+			scene.put("background", "background_space.png");
+		}
+		else {
+			ptree color;
+			for (int channel = 0; channel < 3; channel ++) {
+				ptree value;
+				value.put_value(channel == 1 ? 77 : 0);
+				color.push_back(std::make_pair("", value));
+			}
+			scene.add_child("backgroundcolor", color);
+		}
+
+		ptree objects;
+		for (int i = 0; i < benchCase.boxCount; i ++) {
+			ptree box;
+			box.put("type", "box");
+			box.put("image", "box.png");
+			box.put("x", 2.0 * (i % columns) - (columns - 1));
+			box.put("y", -1.0 - 2.0 * (i / columns));
+			objects.push_back(std::make_pair("", box));
+		}
+		ptree ball;
+		ball.put("type", "circle");
+		ball.put("image", "light.png");
+		ball.put("x", -(columns + 10.0));
+		ball.put("y", -5.0);
+		ball.put("density", 10);
+		ball.put("vx", 50);
+		ball.put("vy", -10);
+		ball.put("light", light);
+		objects.push_back(std::make_pair("", ball));
+		scene.add_child("objects", objects);
+
+		std::string filename = directory + (light ? "/lit.json" : "/unlit.json");
+		boost::property_tree::json_parser::write_json(filename, scene);
+		return filename;
+	}
+
+	// Simulates every frame first and then rasterizes them, so the two are timed apart.
+	bool render(Animation &animation, std::string sceneFile, double &simulateMilliseconds, double &rasterizeMilliseconds)
+	{
+		if (!animation.loadScene(sceneFile)) return false;
+
+		int frameCount = animation.frameCount();
+		std::vector<FrameState> states(frameCount);
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < frameCount; i ++) {
+			animation.simulate(states[i]);
+		}
+		simulateMilliseconds = millisecondsSince(start);
+
+		start = SDL_GetPerformanceCounter();
+		for (int i = 0; i < frameCount; i ++) {
+			FramePtr frame(new Frame(animation.width(), animation.height()));
+			animation.rasterize(states[i], frame);
+			animation.frames().add(frame);
+		}
+		rasterizeMilliseconds = millisecondsSince(start);
+		return true;
+	}
+
+	bool runCase(CaseResult &result, int iterations, std::string format, std::string directory)
+	{
+		const BenchCase &benchCase = result.benchCase;
+		std::string litScene = writeScene(benchCase, benchCase.light, directory);
+		std::string unlitScene = benchCase.light ? writeScene(benchCase, false, directory) : "";
+
+		for (int iteration = 0; iteration < iterations; iteration ++) {
+			double simulate = 0.0;
+			double rasterize = 0.0;
+			Animation animation;
+			if (!render(animation, litScene, simulate, rasterize)) return false;
+			result.simulate.push_back(simulate);
+			result.rasterize.push_back(rasterize);
+
+			double shadows = 0.0;
+			if (benchCase.light) {
+				Animation unlit;
+				double unlitSimulate = 0.0;
+				double unlitRasterize = 0.0;
+				if (!render(unlit, unlitScene, unlitSimulate, unlitRasterize)) return false;
+				shadows = std::max(0.0, rasterize - unlitRasterize);
+			}
+			result.shadows.push_back(shadows);
+
+			boost::scoped_ptr<FrameWriter> writer;
+			if (format == "png") writer.reset(new PngFrameWriter(directory + "/frames"));
+			else if (format == "raw") writer.reset(new RawFrameWriter(directory + "/frames/animation.raw"));
+			else writer.reset(new BmpFrameWriter(directory + "/frames"));
+			Uint64 start = SDL_GetPerformanceCounter();
+			{
+				AsyncFrameWriter asyncWriter(*writer);
+				if (!animation.save(asyncWriter)) return false;
+			}
+			result.save.push_back(millisecondsSince(start));
+
+			start = SDL_GetPerformanceCounter();
+			animation.blendFrames();
+			result.blend.push_back(millisecondsSince(start));
+
+			g_console.print(boost::format("%i boxes%s, iteration %i of %i: simulate %.1f ms, rasterize %.1f ms, shadows %.1f ms, save %.1f ms, blend %.1f ms")
+				% benchCase.boxCount % (benchCase.light ? " with a light" : "") % (iteration + 1) % iterations
+				% result.simulate.back() % result.rasterize.back() % result.shadows.back() % result.save.back() % result.blend.back());
+		}
+
+		return true;
+	}
+
+	void writeTimings(std::ostream &out, std::string name, const Timings &timings, bool last)
+	{
+		double sum = 0.0;
+		for (Timings::const_iterator it = timings.begin(); it != timings.end(); ++ it) {
+			sum += *it;
+		}
+		double minimum = timings.empty() ? 0.0 : *std::min_element(timings.begin(), timings.end());
+		double maximum = timings.empty() ? 0.0 : *std::max_element(timings.begin(), timings.end());
+		double mean = timings.empty() ? 0.0 : sum / timings.size();
+		out << boost::format("\t\t\t\t\"%s\": {\"min\": %.3f, \"mean\": %.3f, \"max\": %.3f}%s\n") % name % minimum % mean % maximum % (last ? "" : ",");
+	}
+
+	void writeResults(std::ostream &out, const std::vector<CaseResult> &results, int iterations, std::string format)
+	{
+		out << "{\n";
+		out << boost::format("\t\"box2d\": \"%i.%i.%i\",\n") % b2_version.major % b2_version.minor % b2_version.revision;
+		out << boost::format("\t\"iterations\": %i,\n") % iterations;
+		out << boost::format("\t\"format\": \"%s\",\n") % format;
+		out << "\t\"cases\": [\n";
+		for (size_t i = 0; i < results.size(); i ++) {
+			const CaseResult &result = results[i];
+			const BenchCase &benchCase = result.benchCase;
+			out << "\t\t{\n";
+			out << boost::format("\t\t\t\"boxes\": %i,\n") % benchCase.boxCount;
+			out << boost::format("\t\t\t\"light\": %s,\n") % (benchCase.light ? "true" : "false");
+			out << boost::format("\t\t\t\"background\": \"%s\",\n") % (benchCase.backgroundImage ? "image" : "color");
+			out << boost::format("\t\t\t\"width\": %i,\n") % benchCase.width;
+			out << boost::format("\t\t\t\"height\": %i,\n") % benchCase.height;
+			out << boost::format("\t\t\t\"frames\": %i,\n") % benchCase.frameCount;
+			out << "\t\t\t\"milliseconds\": {\n";
+			writeTimings(out, "simulate", result.simulate, false);
+			writeTimings(out, "rasterize", result.rasterize, false);
+			writeTimings(out, "shadows", result.shadows, false);
+			writeTimings(out, "save", result.save, false);
+			writeTimings(out, "blend", result.blend, true);
+			out << "\t\t\t}\n";
+			out << (i + 1 < results.size() ? "\t\t},\n" : "\t\t}\n");
+		}
+		out << "\t]\n";
+		out << "}\n";
+	}
+
+	void printUsage(void)
+	{
+		std::cerr << "Usage: bench [options]" << std::endl;
+		std::cerr << "Times simulation, rasterization, the shadow pass, save and blend on generated scenes." << std::endl;
+		std::cerr << "Options:" << std::endl;
+		std::cerr << "\t--boxes <n,...>      Box counts to run, one case each (default: 100,1000)." << std::endl;
+		std::cerr << "\t--light <l>          on, off or both (default)." << std::endl;
+		std::cerr << "\t--background <b>     color (default) or image." << std::endl;
+		std::cerr << "\t--size <w>x<h>       Frame size (default: 512x512)." << std::endl;
+		std::cerr << "\t--frames <n>         Frames per case (default: 64)." << std::endl;
+		std::cerr << "\t--iterations <n>     Runs of each case (default: 3)." << std::endl;
+		std::cerr << "\t--format <f>         Saved as bmp (default), png or raw." << std::endl;
+		std::cerr << "\t--json <file>        Where to write the results (default: stdout)." << std::endl;
+		std::cerr << "\t--help               Show this message." << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<int> boxCounts;
+	boxCounts.push_back(100);
+	boxCounts.push_back(1000);
+	std::string light = "both";
+	std::string background = "color";
+	int width = 512;
+	int height = 512;
+	int frameCount = 64;
+	int iterations = 3;
+	std::string format = "bmp";
+	std::string jsonFile;
+
+	try {
+		for (int i = 1; i < argc; i ++) {
+			std::string argument = argv[i];
+			if (argument == "--boxes" && i + 1 < argc) {
+				std::vector<std::string> counts;
+				std::string list = argv[++ i];
+				boost::split(counts, list, boost::is_any_of(","));
+				boxCounts.clear();
+				for (std::vector<std::string>::iterator it = counts.begin(); it != counts.end(); ++ it) {
+					boxCounts.push_back(boost::lexical_cast<int>(*it));
+				}
+			}
+			else if (argument == "--light" && i + 1 < argc) {
+				light = argv[++ i];
+			}
+			else if (argument == "--background" && i + 1 < argc) {
+				background = argv[++ i];
+			}
+			else if (argument == "--size" && i + 1 < argc) {
+				std::string size = argv[++ i];
+				size_t separator = size.find('x');
+				if (separator == std::string::npos) throw boost::bad_lexical_cast();
+				width = boost::lexical_cast<int>(size.substr(0, separator));
+				height = boost::lexical_cast<int>(size.substr(separator + 1));
+			}
+			else if (argument == "--frames" && i + 1 < argc) {
+				frameCount = boost::lexical_cast<int>(argv[++ i]);
+			}
+			else if (argument == "--iterations" && i + 1 < argc) {
+				iterations = boost::lexical_cast<int>(argv[++ i]);
+			}
+			else if (argument == "--format" && i + 1 < argc) {
+				format = argv[++ i];
+			}
+			else if (argument == "--json" && i + 1 < argc) {
+				jsonFile = argv[++ i];
+			}
+			else if (argument == "--help") {
+				printUsage();
+				return EXIT_SUCCESS;
+			}
+			else {
+				std::cerr << "Unexpected argument '" << argument << "'" << std::endl;
+				printUsage();
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	catch (boost::bad_lexical_cast &) {
+		std::cerr << "Expected a number" << std::endl;
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	if ((light != "on" && light != "off" && light != "both") || (background != "color" && background != "image")
+		|| (format != "bmp" && format != "png" && format != "raw") || width <= 0 || height <= 0 || frameCount <= 0 || iterations <= 0) {
+		std::cerr << "Unknown --light, --background or --format, or a size, frame count or iteration count below 1" << std::endl;
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	// Progress goes to stderr, so the JSON on stdout can be redirected on its own.
+	g_console.echoTo(&std::cerr);
+
+	std::string directory = "output/bench";
+	boost::system::error_code error;
+	boost::filesystem::create_directories(directory + "/frames", error);
+	if (error) {
+		std::cerr << "Could not create " << directory << ": " << error.message() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<CaseResult> results;
+	for (std::vector<int>::iterator it = boxCounts.begin(); it != boxCounts.end(); ++ it) {
+		for (int lit = 0; lit < 2; lit ++) {
+			if ((lit == 1 && light == "off") || (lit == 0 && light == "on")) continue;
+
+			CaseResult result;
+			result.benchCase.boxCount = *it;
+			result.benchCase.light = lit == 1;
+			result.benchCase.backgroundImage = background == "image";
+			result.benchCase.width = width;
+			result.benchCase.height = height;
+			result.benchCase.frameCount = frameCount;
+			if (!runCase(result, iterations, format, directory)) {
+				std::cerr << "Benchmark of " << *it << " boxes failed" << std::endl;
+				return EXIT_FAILURE;
+			}
+			results.push_back(result);
+		}
+	}
+
+	if (jsonFile.empty()) {
+		writeResults(std::cout, results, iterations, format);
+	}
+	else {
+		std::ofstream out(jsonFile.c_str());
+		writeResults(out, results, iterations, format);
+		if (!out) {
+			std::cerr << "Could not write " << jsonFile << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
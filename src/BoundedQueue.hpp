@@ -0,0 +1,75 @@
+#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP
+
+#include <algorithm>
+#include <deque>
+#include <boost/thread.hpp>
+
+// Blocking FIFO with a fixed capacity, used to hand work between pipeline stages.
+// push() waits while the queue is full, which is what throttles a fast producer
+// to the pace of its consumer. close() marks the end of the stream: after it,
+// push() fails and pop() drains what is left before failing too. abort() also
+// throws away whatever is still queued.
+template <typename T>
+class BoundedQueue
+{
+public:
+	BoundedQueue(size_t capacity) :
+		m_capacity(std::max((size_t)1, capacity)), m_closed(false)
+	{
+	}
+
+	bool push(const T &item) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while (m_items.size() >= m_capacity && !m_closed) {
+			m_notFull.wait(lock);
+		}
+		if (m_closed) return false;
+
+		m_items.push_back(item);
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	bool pop(T &item) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while (m_items.empty() && !m_closed) {
+			m_notEmpty.wait(lock);
+		}
+		if (m_items.empty()) return false;
+
+		item = m_items.front();
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	void close(void) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+	void abort(void) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_closed = true;
+		m_items.clear();
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+	size_t capacity(void) const {
+		return m_capacity;
+	}
+
+private:
+	size_t m_capacity;
+	bool m_closed;
+	std::deque<T> m_items;
+	boost::mutex m_mutex;
+	boost::condition_variable m_notEmpty;
+	boost::condition_variable m_notFull;
+};
+
+#endif // BOUNDEDQUEUE_HPP
@@ -3,6 +3,7 @@
 Console g_console;
 
 Console::Console() :
+	m_echo(&std::cout),
 	m_showing(false),
 	m_textSurface(NULL),
 	m_textTexture(NULL),
@@ -18,7 +19,9 @@ Console::Console() :
 	);
 
 	SDL_assert(m_textSurface != NULL);
-	print("~");
+	// Not echoed: this runs before main() can move the echo off stdout.
+	m_lines.push_back("~");
+	m_logfile << "~" << std::endl;
 }
 
 Console::~Console()
@@ -35,9 +38,16 @@ void Console::print(boost::format message)
 
 void Console::print(std::string message)
 {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
 	m_lines.push_back(message);
 	m_logfile << message << std::endl;
-	std::cout << message << std::endl;
+	*m_echo << message << std::endl;
+}
+
+void Console::echoTo(std::ostream *stream)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_echo = stream;
 }
 
 void Console::run(std::string command)
@@ -86,7 +96,11 @@ void Console::processEvent(SDL_Event &event)
 	else if (event.type == SDL_KEYDOWN) {
 		if (event.key.keysym.sym == SDLK_RETURN) {
 			if (m_inputBuffer.length() > 0) {
-				m_lines.push_back(std::string("> ") + std::string(m_inputBuffer));
+				{
+					boost::lock_guard<boost::mutex> lock(m_mutex);
+					m_lines.push_back(std::string("> ") + std::string(m_inputBuffer));
+				}
+				// Unlocked, since run() may print().
 				run(m_inputBuffer);
 				m_commandQueue.push(m_inputBuffer);
 				m_inputBuffer = "";
@@ -112,6 +126,7 @@ void Console::processEvent(SDL_Event &event)
 	cairo_set_font_size(cr, 16);
 
 	double lineSpacing = 16.0;
+	boost::unique_lock<boost::mutex> lock(m_mutex);
 	int startlineIndex = std::max(0, int(m_lines.size()) - int((double)m_textSurface->h / lineSpacing - 2.0));
 	for (int i = startlineIndex; i < m_lines.size(); i ++) {
 		int lineNumber = i - startlineIndex;
@@ -119,6 +134,7 @@ void Console::processEvent(SDL_Event &event)
 		cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
 		cairo_show_text(cr, m_lines[i].c_str());
 	}
+	lock.unlock();
 
 	cairo_identity_matrix(cr);
 	cairo_move_to(cr, (double)m_boundary.x, (double)m_boundary.y + (double)m_boundary.h - lineSpacing);
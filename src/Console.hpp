@@ -7,6 +7,7 @@
 #include <iostream>
 #include <fstream>
 #include <boost/format.hpp>
+#include <boost/thread.hpp>
 #include <SDL2/SDL.h>
 #include <cairo/cairo.h>
 
@@ -18,6 +19,8 @@ public:
 
 	void print(boost::format message);
 	void print(std::string message);
+	// Where printed lines are echoed, std::cout unless stdout carries a video stream.
+	void echoTo(std::ostream *stream);
 	void run(std::string command);
 	std::string getNextCommand(void);
 	void show(void);
@@ -27,7 +30,9 @@ public:
 	void render(SDL_Renderer *renderer);
 protected:
 private:
+	boost::mutex m_mutex; // print() is called from render and writer threads.
 	std::ofstream m_logfile;
+	std::ostream *m_echo;
 	bool m_showing;
 	SDL_Rect m_boundary;
 	std::string m_inputBuffer;
@@ -0,0 +1,260 @@
+#include "FrameBlender.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAMEBLENDER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+	const int WEIGHT_BITS = 14;
+	const int WEIGHT_TOTAL = 1 << WEIGHT_BITS;
+	const Uint32 OPAQUE = 0xff000000;
+
+	typedef void (*BlendRowKernel)(const Uint32 * const *rows, const Uint16 *weights, int rowCount, int first, int pixelCount, Uint32 *output);
+
+	void blendRowScalar(const Uint32 * const *rows, const Uint16 *weights, int rowCount, int first, int pixelCount, Uint32 *output)
+	{
+		for (int x = first; x < pixelCount; x ++) {
+			Uint32 c0 = 0, c1 = 0, c2 = 0;
+			for (int f = 0; f < rowCount; f ++) {
+				Uint32 pixel = rows[f][x];
+				c0 += (pixel & 0xff) * weights[f];
+				c1 += ((pixel >> 8) & 0xff) * weights[f];
+				c2 += ((pixel >> 16) & 0xff) * weights[f];
+			}
+			output[x] = OPAQUE | ((c2 >> WEIGHT_BITS) << 16) | ((c1 >> WEIGHT_BITS) << 8) | (c0 >> WEIGHT_BITS);
+		}
+	}
+
+#ifdef FRAMEBLENDER_X86
+	// Frames are taken in pairs: interleaving the 16-bit channels of two frames
+	// lets one pmaddwd multiply both by their weights and add them into 32 bits.
+	__attribute__((target("sse2")))
+	void blendRowSse2(const Uint32 * const *rows, const Uint16 *weights, int rowCount, int first, int pixelCount, Uint32 *output)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i opaque = _mm_set1_epi32(OPAQUE);
+		int x = first;
+		for (; x + 4 <= pixelCount; x += 4) {
+			__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+			for (int f = 0; f < rowCount; f += 2) {
+				__m128i weightPair = _mm_set1_epi32(((Uint32)weights[f + 1] << 16) | weights[f]);
+				__m128i a = _mm_loadu_si128((const __m128i *)(rows[f] + x));
+				__m128i b = _mm_loadu_si128((const __m128i *)(rows[f + 1] + x));
+				__m128i aLow = _mm_unpacklo_epi8(a, zero);
+				__m128i bLow = _mm_unpacklo_epi8(b, zero);
+				__m128i aHigh = _mm_unpackhi_epi8(a, zero);
+				__m128i bHigh = _mm_unpackhi_epi8(b, zero);
+				acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), weightPair));
+				acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), weightPair));
+				acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), weightPair));
+				acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), weightPair));
+			}
+			__m128i low = _mm_packs_epi32(_mm_srli_epi32(acc0, WEIGHT_BITS), _mm_srli_epi32(acc1, WEIGHT_BITS));
+			__m128i high = _mm_packs_epi32(_mm_srli_epi32(acc2, WEIGHT_BITS), _mm_srli_epi32(acc3, WEIGHT_BITS));
+			_mm_storeu_si128((__m128i *)(output + x), _mm_or_si128(_mm_packus_epi16(low, high), opaque));
+		}
+
+		blendRowScalar(rows, weights, rowCount, x, pixelCount, output);
+	}
+
+	// Same as the SSE2 kernel on 8 pixels at a time. The unpacks and packs work
+	// within each 128-bit lane, so pixel order comes out unchanged.
+	__attribute__((target("avx2")))
+	void blendRowAvx2(const Uint32 * const *rows, const Uint16 *weights, int rowCount, int first, int pixelCount, Uint32 *output)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i opaque = _mm256_set1_epi32(OPAQUE);
+		int x = first;
+		for (; x + 8 <= pixelCount; x += 8) {
+			__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+			for (int f = 0; f < rowCount; f += 2) {
+				__m256i weightPair = _mm256_set1_epi32(((Uint32)weights[f + 1] << 16) | weights[f]);
+				__m256i a = _mm256_loadu_si256((const __m256i *)(rows[f] + x));
+				__m256i b = _mm256_loadu_si256((const __m256i *)(rows[f + 1] + x));
+				__m256i aLow = _mm256_unpacklo_epi8(a, zero);
+				__m256i bLow = _mm256_unpacklo_epi8(b, zero);
+				__m256i aHigh = _mm256_unpackhi_epi8(a, zero);
+				__m256i bHigh = _mm256_unpackhi_epi8(b, zero);
+				acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(aLow, bLow), weightPair));
+				acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(aLow, bLow), weightPair));
+				acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(aHigh, bHigh), weightPair));
+				acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(aHigh, bHigh), weightPair));
+			}
+			__m256i low = _mm256_packs_epi32(_mm256_srli_epi32(acc0, WEIGHT_BITS), _mm256_srli_epi32(acc1, WEIGHT_BITS));
+			__m256i high = _mm256_packs_epi32(_mm256_srli_epi32(acc2, WEIGHT_BITS), _mm256_srli_epi32(acc3, WEIGHT_BITS));
+			_mm256_storeu_si256((__m256i *)(output + x), _mm256_or_si256(_mm256_packus_epi16(low, high), opaque));
+		}
+
+		blendRowSse2(rows, weights, rowCount, x, pixelCount, output);
+	}
+#endif
+
+	BlendRowKernel selectKernel(std::string &name)
+	{
+#ifdef FRAMEBLENDER_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			name = "avx2";
+			return blendRowAvx2;
+		}
+		if (__builtin_cpu_supports("sse2")) {
+			name = "sse2";
+			return blendRowSse2;
+		}
+#endif
+		name = "scalar";
+		return blendRowScalar;
+	}
+
+	std::string g_kernelName;
+	BlendRowKernel g_kernel = selectKernel(g_kernelName);
+}
+
+FrameBlender::FrameBlender(const std::vector<double> &frameWeights) :
+	m_frameCount(frameWeights.size())
+{
+	double weightTotal = 0.0;
+	for (std::vector<double>::const_iterator it = frameWeights.begin(); it != frameWeights.end(); ++ it) {
+		weightTotal += (*it);
+	}
+
+	// Round each weight to fixed point, then give the rounding error to the
+	// largest one so the total is exact and a flat image stays flat.
+	int fixedTotal = 0;
+	int largest = 0;
+	for (int i = 0; i < m_frameCount; i ++) {
+		int weight = weightTotal > 0.0 ? (int)(frameWeights[i] / weightTotal * WEIGHT_TOTAL + 0.5) : 0;
+		m_weights.push_back(weight);
+		fixedTotal += weight;
+		if (frameWeights[i] > frameWeights[largest]) largest = i;
+	}
+	if (m_frameCount > 0) {
+		m_weights[largest] += WEIGHT_TOTAL - fixedTotal;
+	}
+
+	if (m_weights.size() % 2 != 0) {
+		m_weights.push_back(0);
+	}
+}
+
+FramePtr FrameBlender::blend(std::vector<FramePtr>::const_iterator first, std::vector<FramePtr>::const_iterator last)
+{
+	SDL_assert(last - first == m_frameCount);
+
+	FramePtr result(new Frame((*first)->surface()->w, (*first)->surface()->h));
+	SDL_Surface *surface = result->surface();
+
+	std::vector<const Uint32 *> rows(m_weights.size());
+	for (int y = 0; y < surface->h; y ++) {
+		int frameIndex = 0;
+		for (std::vector<FramePtr>::const_iterator it = first; it != last; ++ it) {
+			SDL_Surface *sdlFrame = (*it)->surface();
+			rows[frameIndex ++] = (const Uint32 *)((const Uint8 *)sdlFrame->pixels + y * sdlFrame->pitch);
+		}
+		// The zero weight that pads an odd count still needs a row to read.
+		if (frameIndex < (int)rows.size()) rows[frameIndex] = rows[0];
+
+		blendRow(&rows[0], surface->w, (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch));
+	}
+
+	return result;
+}
+
+void FrameBlender::blendRow(const Uint32 * const *rows, int pixelCount, Uint32 *output)
+{
+	g_kernel(rows, &m_weights[0], m_weights.size(), 0, pixelCount, output);
+}
+
+int FrameBlender::frameCount(void)
+{
+	return m_frameCount;
+}
+
+std::vector<double> FrameBlender::weights(int frameCount, std::string curve)
+{
+	std::vector<double> frameWeights;
+	for (int i = 0; i < frameCount; i ++) {
+		// Position of the frame within the shutter window, 0 to 1.
+		double t = frameCount > 1 ? (double)i / (double)(frameCount - 1) : 0.5;
+		double weight = 1.0;
+		if (curve == "sine") {
+			weight = std::max(0.0, sin(cml::constantsd::pi() * t));
+		}
+		else if (curve == "triangle") {
+			weight = 1.0 - fabs(2.0 * t - 1.0);
+		}
+		else if (curve == "gaussian") {
+			double x = (t - 0.5) / 0.2;
+			weight = exp(-0.5 * x * x);
+		}
+		frameWeights.push_back(weight);
+	}
+
+	// Curves that are zero at both ends would give a two frame window no weight at all.
+	double weightTotal = 0.0;
+	for (std::vector<double>::iterator it = frameWeights.begin(); it != frameWeights.end(); ++ it) {
+		weightTotal += (*it);
+	}
+	if (weightTotal <= 0.0) {
+		frameWeights.assign(frameCount, 1.0);
+	}
+
+	return frameWeights;
+}
+
+bool FrameBlender::validCurve(std::string curve)
+{
+	return curve == "sine" || curve == "box" || curve == "triangle" || curve == "gaussian";
+}
+
+std::string FrameBlender::kernelName(void)
+{
+	return g_kernelName;
+}
+
+RunningBlend::RunningBlend(int width, int y, int height) :
+	m_width(width), m_y(y), m_height(height), m_sums(width * height * 4, 0)
+{
+}
+
+void RunningBlend::add(FramePtr frame)
+{
+	SDL_Surface *surface = frame->surface();
+	for (int y = 0; y < m_height; y ++) {
+		const Uint8 *row = (const Uint8 *)surface->pixels + (m_y + y) * surface->pitch;
+		Uint32 *sums = &m_sums[y * m_width * 4];
+		for (int i = 0; i < m_width * 4; i ++) {
+			sums[i] += row[i];
+		}
+	}
+}
+
+void RunningBlend::subtract(FramePtr frame)
+{
+	SDL_Surface *surface = frame->surface();
+	for (int y = 0; y < m_height; y ++) {
+		const Uint8 *row = (const Uint8 *)surface->pixels + (m_y + y) * surface->pitch;
+		Uint32 *sums = &m_sums[y * m_width * 4];
+		for (int i = 0; i < m_width * 4; i ++) {
+			sums[i] -= row[i];
+		}
+	}
+}
+
+void RunningBlend::average(int frameCount, FramePtr output)
+{
+	// Divide by multiplying with a 32.32 reciprocal, rounded up so exact multiples don't come out one short.
+	Uint64 reciprocal = (((Uint64)1 << 32) + frameCount - 1) / frameCount;
+	SDL_Surface *surface = output->surface();
+	for (int y = 0; y < m_height; y ++) {
+		Uint32 *row = (Uint32 *)((Uint8 *)surface->pixels + (m_y + y) * surface->pitch);
+		const Uint32 *sums = &m_sums[y * m_width * 4];
+		for (int x = 0; x < m_width; x ++) {
+			Uint32 c0 = (Uint32)((sums[x * 4] * reciprocal) >> 32);
+			Uint32 c1 = (Uint32)((sums[x * 4 + 1] * reciprocal) >> 32);
+			Uint32 c2 = (Uint32)((sums[x * 4 + 2] * reciprocal) >> 32);
+			row[x] = OPAQUE | (c2 << 16) | (c1 << 8) | c0;
+		}
+	}
+}
@@ -0,0 +1,566 @@
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/interprocess/exceptions.hpp>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "FrameStore.hpp"
+#include "LzCodec.hpp"
+
+bool FrameStore::empty(void)
+{
+	return size() == 0;
+}
+
+std::string FrameStore::summary(void)
+{
+	return (boost::format("Frames: %i in memory, %.1f MiB") % size() % (memoryUsage() / 1048576.0)).str();
+}
+
+MemoryFrameStore::MemoryFrameStore() :
+	m_memoryUsage(0)
+{
+}
+
+void MemoryFrameStore::add(FramePtr frame)
+{
+	m_frames.push_back(frame);
+	m_memoryUsage += frame->surface()->pitch * frame->surface()->h;
+}
+
+FramePtr MemoryFrameStore::get(int index)
+{
+	return m_frames[index];
+}
+
+int MemoryFrameStore::size(void)
+{
+	return m_frames.size();
+}
+
+void MemoryFrameStore::clear(void)
+{
+	m_frames.clear();
+	m_memoryUsage = 0;
+}
+
+size_t MemoryFrameStore::memoryUsage(void)
+{
+	return m_memoryUsage;
+}
+
+CompressedFrameStore::CompressedFrameStore() :
+	m_width(0), m_height(0), m_compressedSize(0)
+{
+}
+
+void CompressedFrameStore::add(FramePtr frame)
+{
+	SDL_Surface *surface = frame->surface();
+	if (m_compressed.empty()) {
+		m_width = surface->w;
+		m_height = surface->h;
+		m_previous.assign(m_width * m_height, 0);
+		m_delta.resize(m_width * m_height);
+	}
+	SDL_assert(surface->w == m_width && surface->h == m_height);
+
+	bool key = m_compressed.size() % KEY_INTERVAL == 0;
+	for (int y = 0; y < m_height; y ++) {
+		const Uint32 *row = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+		Uint32 *delta = &m_delta[y * m_width];
+		if (key && y == 0) {
+			memcpy(delta, row, m_width * sizeof(Uint32));
+		}
+		else {
+			const Uint32 *reference = key ? (const Uint32 *)((const Uint8 *)row - surface->pitch) : &m_previous[y * m_width];
+			for (int x = 0; x < m_width; x ++) delta[x] = row[x] ^ reference[x];
+		}
+	}
+	for (int y = 0; y < m_height; y ++) {
+		memcpy(&m_previous[y * m_width], (const Uint8 *)surface->pixels + y * surface->pitch, m_width * sizeof(Uint32));
+	}
+
+	LzCodec::compress((const Uint8 *)&m_delta[0], m_delta.size() * sizeof(Uint32), m_buffer);
+	m_compressed.push_back(std::vector<Uint8>(m_buffer.begin(), m_buffer.end()));
+	m_compressedSize += m_buffer.size();
+
+	// The frame as drawn is the most likely one to be asked for next, e.g. by dirty rendering.
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_decoded.push_front(std::make_pair((int)m_compressed.size() - 1, frame));
+	if ((int)m_decoded.size() > CACHE_SIZE) m_decoded.pop_back();
+}
+
+FramePtr CompressedFrameStore::get(int index)
+{
+	// Decode forward from the nearest frame at hand: a cached one in the same
+	// key frame interval, or else the key frame itself.
+	int base = index - index % KEY_INTERVAL - 1;
+	FramePtr baseFrame;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		for (std::list< std::pair<int, FramePtr> >::iterator it = m_decoded.begin(); it != m_decoded.end(); ++ it) {
+			if ((*it).first == index) {
+				FramePtr frame = (*it).second;
+				m_decoded.splice(m_decoded.begin(), m_decoded, it);
+				return frame;
+			}
+			if ((*it).first > base && (*it).first < index) {
+				base = (*it).first;
+				baseFrame = (*it).second;
+			}
+		}
+	}
+
+	FramePtr frame(new Frame(m_width, m_height));
+	SDL_Surface *surface = frame->surface();
+	if (baseFrame) {
+		SDL_Surface *baseSurface = baseFrame->surface();
+		for (int y = 0; y < m_height; y ++) {
+			memcpy((Uint8 *)surface->pixels + y * surface->pitch, (const Uint8 *)baseSurface->pixels + y * baseSurface->pitch, m_width * sizeof(Uint32));
+		}
+	}
+
+	std::vector<Uint32> delta(m_width * m_height);
+	for (int i = base + 1; i <= index; i ++) {
+		if (!decodeInto(i, frame, delta)) {
+			SDL_assert(!"Corrupt compressed frame");
+			break;
+		}
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_decoded.push_front(std::make_pair(index, frame));
+	if ((int)m_decoded.size() > CACHE_SIZE) m_decoded.pop_back();
+	return frame;
+}
+
+int CompressedFrameStore::size(void)
+{
+	return m_compressed.size();
+}
+
+void CompressedFrameStore::clear(void)
+{
+	m_compressed.clear();
+	m_compressedSize = 0;
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_decoded.clear();
+}
+
+size_t CompressedFrameStore::memoryUsage(void)
+{
+	size_t frameSize = m_width * m_height * sizeof(Uint32);
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_compressedSize + (m_decoded.size() + 2) * frameSize; // Plus m_previous and m_delta.
+}
+
+std::string CompressedFrameStore::summary(void)
+{
+	double rawSize = (double)size() * m_width * m_height * sizeof(Uint32);
+	double ratio = m_compressedSize > 0 ? rawSize / m_compressedSize : 0.0;
+	return (boost::format("Frames: %i compressed, %.1f MiB (%.1f MiB raw, %.1f:1)") % size() % (memoryUsage() / 1048576.0) % (rawSize / 1048576.0) % ratio).str();
+}
+
+// Applies frame index's delta on top of frame, which must hold frame index - 1
+// unless index is a key frame.
+bool CompressedFrameStore::decodeInto(int index, FramePtr frame, std::vector<Uint32> &delta)
+{
+	const std::vector<Uint8> &compressed = m_compressed[index];
+	if (!LzCodec::decompress(&compressed[0], compressed.size(), (Uint8 *)&delta[0], delta.size() * sizeof(Uint32))) return false;
+
+	bool key = index % KEY_INTERVAL == 0;
+	SDL_Surface *surface = frame->surface();
+	for (int y = 0; y < m_height; y ++) {
+		Uint32 *row = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch);
+		const Uint32 *rowDelta = &delta[y * m_width];
+		if (key && y == 0) {
+			memcpy(row, rowDelta, m_width * sizeof(Uint32));
+		}
+		else if (key) {
+			const Uint32 *above = (const Uint32 *)((const Uint8 *)row - surface->pitch);
+			for (int x = 0; x < m_width; x ++) row[x] = rowDelta[x] ^ above[x];
+		}
+		else {
+			for (int x = 0; x < m_width; x ++) row[x] ^= rowDelta[x];
+		}
+	}
+
+	return true;
+}
+
+MappedFrameStore::MappedFrameStore(std::string filename) :
+	m_filename(filename), m_capacity(0), m_lastIndex(-1), m_failed(false)
+{
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, "BOXFRAME", 8);
+	m_header.version = 1;
+	m_header.frameSpan = 1;
+}
+
+// Maps an existing file written by add(). Returns false if there is none or it isn't one.
+bool MappedFrameStore::open(void)
+{
+	std::ifstream file(m_filename.c_str(), std::ios::in | std::ios::binary);
+	Header header;
+	if (!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, "BOXFRAME", 8) != 0 || header.version != 1) {
+		g_console.print(boost::format("'%s' is not a frame cache") % m_filename);
+		return false;
+	}
+	file.close();
+
+	// get() trusts the layout, so a foreign or corrupt header mustn't send it outside a frame's slot.
+	Uint64 rowBytes = (Uint64)header.width * sizeof(Uint32);
+	if (header.width == 0 || header.height == 0 || header.width > MAX_DIMENSION || header.height > MAX_DIMENSION
+		|| header.pitch < rowBytes || (Uint64)header.pitch * header.height > header.frameSize
+		|| header.frameSize % HEADER_SIZE != 0 || header.frameCount > (Uint32)INT_MAX) {
+		g_console.print(boost::format("Frame cache '%s' has a bad header") % m_filename);
+		return false;
+	}
+
+	boost::system::error_code error;
+	boost::uintmax_t fileSize = boost::filesystem::file_size(m_filename, error);
+	if (error || fileSize < HEADER_SIZE + (boost::uintmax_t)header.frameCount * header.frameSize) {
+		g_console.print(boost::format("Frame cache '%s' is truncated") % m_filename);
+		return false;
+	}
+
+	m_header = header;
+	return map(header.frameCount);
+}
+
+void MappedFrameStore::add(FramePtr frame)
+{
+	if (m_failed) return;
+
+	SDL_Surface *surface = frame->surface();
+	if (m_header.frameCount == 0) {
+		m_header.width = surface->w;
+		m_header.height = surface->h;
+		m_header.pitch = surface->w * sizeof(Uint32);
+		// Page aligned, so read ahead hints cover whole frames.
+		m_header.frameSize = (m_header.pitch * m_header.height + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE;
+	}
+	SDL_assert((Uint32)surface->w == m_header.width && (Uint32)surface->h == m_header.height);
+
+	if ((int)m_header.frameCount >= m_capacity && !map(std::max(64, m_capacity * 2))) {
+		g_console.print(boost::format("Frame cache '%s' is full at %i frames, later frames are lost") % m_filename % m_header.frameCount);
+		m_failed = true;
+		return;
+	}
+
+	Uint8 *destination = pixels(m_header.frameCount);
+	for (Uint32 y = 0; y < m_header.height; y ++) {
+		memcpy(destination + y * m_header.pitch, (const Uint8 *)surface->pixels + y * surface->pitch, m_header.pitch);
+	}
+	m_header.frameCount ++;
+	memcpy(m_region->get_address(), &m_header, sizeof(m_header));
+}
+
+FramePtr MappedFrameStore::get(int index)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (index == m_lastIndex + 1 || index == m_lastIndex - 1) {
+			readAhead(index, index - m_lastIndex);
+		}
+		m_lastIndex = index;
+	}
+
+	return FramePtr(new Frame(m_header.width, m_header.height, pixels(index), m_header.pitch, m_region));
+}
+
+int MappedFrameStore::size(void)
+{
+	return m_header.frameCount;
+}
+
+// Keeps the file and mapping for the frames that replace these.
+void MappedFrameStore::clear(void)
+{
+	m_header.frameCount = 0;
+	m_failed = false;
+	if (m_region) memcpy(m_region->get_address(), &m_header, sizeof(m_header));
+}
+
+// Mapped pages belong to the OS page cache, not the heap; this is their total size.
+size_t MappedFrameStore::memoryUsage(void)
+{
+	return m_region ? m_region->get_size() : 0;
+}
+
+std::string MappedFrameStore::summary(void)
+{
+	return (boost::format("Frames: %i mapped from %s, %.1f MiB on disk") % size() % m_filename % (memoryUsage() / 1048576.0)).str();
+}
+
+void MappedFrameStore::setTiming(double framerate, int frameSpan)
+{
+	m_header.framerate = framerate;
+	m_header.frameSpan = frameSpan;
+	if (m_region) memcpy(m_region->get_address(), &m_header, sizeof(m_header));
+}
+
+bool MappedFrameStore::failed(void)
+{
+	return m_failed;
+}
+
+// The file grows in doubling steps; cut it back to the frames it holds.
+void MappedFrameStore::finish(void)
+{
+	if (m_failed || !m_region || m_capacity == (int)m_header.frameCount) return;
+
+	boost::system::error_code error;
+	boost::filesystem::resize_file(m_filename, HEADER_SIZE + (boost::uintmax_t)m_header.frameCount * m_header.frameSize, error);
+	if (error) {
+		g_console.print(boost::format("Could not trim frame cache '%s': %s") % m_filename % error.message());
+		return;
+	}
+	if (!map(m_header.frameCount)) m_failed = true;
+}
+
+int MappedFrameStore::width(void)
+{
+	return m_header.width;
+}
+
+int MappedFrameStore::height(void)
+{
+	return m_header.height;
+}
+
+double MappedFrameStore::framerate(void)
+{
+	return m_header.framerate;
+}
+
+int MappedFrameStore::frameSpan(void)
+{
+	return m_header.frameSpan;
+}
+
+// Grows the file to hold capacity frames and maps all of it. Frames handed out
+// earlier keep the previous mapping alive until they are released.
+bool MappedFrameStore::map(int capacity)
+{
+	using namespace boost::interprocess;
+
+	boost::uintmax_t fileSize = HEADER_SIZE + (boost::uintmax_t)capacity * m_header.frameSize;
+	boost::system::error_code error;
+	if (!boost::filesystem::exists(m_filename, error)) {
+		std::ofstream create(m_filename.c_str(), std::ios::out | std::ios::binary);
+	}
+	if (boost::filesystem::file_size(m_filename, error) < fileSize && !error) {
+		boost::filesystem::resize_file(m_filename, fileSize, error);
+	}
+	if (error) {
+		g_console.print(boost::format("Could not size frame cache '%s': %s") % m_filename % error.message());
+		return false;
+	}
+
+	try {
+		file_mapping file(m_filename.c_str(), read_write);
+		m_region.reset(new mapped_region(file, read_write));
+		m_region->advise(mapped_region::advice_sequential);
+	}
+	catch (interprocess_exception &e) {
+		g_console.print(boost::format("Could not map frame cache '%s': %s") % m_filename % e.what());
+		m_region.reset();
+		return false;
+	}
+
+	m_capacity = capacity;
+	return true;
+}
+
+Uint8 *MappedFrameStore::pixels(int index)
+{
+	return (Uint8 *)m_region->get_address() + HEADER_SIZE + (size_t)index * m_header.frameSize;
+}
+
+// Asks for the next READAHEAD frames in the direction of travel to be paged in.
+void MappedFrameStore::readAhead(int index, int direction)
+{
+#ifdef POSIX_MADV_WILLNEED
+	int first = direction > 0 ? index + 1 : index - READAHEAD;
+	int last = direction > 0 ? index + READAHEAD : index - 1;
+	first = std::max(first, 0);
+	last = std::min(last, (int)m_header.frameCount - 1);
+	if (first > last) return;
+
+	posix_madvise(pixels(first), (size_t)(last - first + 1) * m_header.frameSize, POSIX_MADV_WILLNEED);
+#endif
+}
+
+LazyFrameStore::LazyFrameStore(Animation &animation, int window) :
+	m_animation(animation), m_window(std::max(1, window)), m_playhead(0), m_direction(1), m_drawing(-1), m_stopping(false), m_drawCount(0)
+{
+}
+
+LazyFrameStore::~LazyFrameStore()
+{
+	stop();
+}
+
+void LazyFrameStore::addState(const FrameState &state)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_states.push_back(state);
+}
+
+// Only states can be added; finished frames belong in one of the other stores.
+void LazyFrameStore::add(FramePtr frame)
+{
+	SDL_assert(false);
+}
+
+FramePtr LazyFrameStore::get(int index)
+{
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	int frameCount = m_states.size();
+	if (index < 0 || index >= frameCount) return FramePtr();
+
+	int step = (index - m_playhead + frameCount) % frameCount;
+	if (step == 1) m_direction = 1;
+	else if (step == frameCount - 1) m_direction = -1;
+	m_playhead = index;
+
+	// Let go of frames that fell out of the window; their textures go with them.
+	for (std::map<int, FramePtr>::iterator it = m_drawn.begin(); it != m_drawn.end(); ) {
+		if (!wanted(it->first)) m_drawn.erase(it ++);
+		else ++ it;
+	}
+
+	while (m_drawing == index) {
+		m_changed.wait(lock);
+	}
+
+	FramePtr frame;
+	std::map<int, FramePtr>::iterator it = m_drawn.find(index);
+	if (it != m_drawn.end()) {
+		frame = it->second;
+	}
+	else {
+		lock.unlock();
+		frame = draw(index);
+		lock.lock();
+		if (wanted(index)) m_drawn[index] = frame;
+	}
+
+	if (!m_thread.joinable() && !m_stopping) {
+		m_thread = boost::thread(boost::bind(&LazyFrameStore::drawAhead, this));
+	}
+	m_changed.notify_all();
+	return frame;
+}
+
+// Uses a frame the preview's window already has, or else draws one that
+// isn't kept, leaving the playhead and the window as they are.
+FramePtr LazyFrameStore::peek(int index)
+{
+	{
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		if (index < 0 || index >= (int)m_states.size()) return FramePtr();
+
+		while (m_drawing == index) {
+			m_changed.wait(lock);
+		}
+		std::map<int, FramePtr>::iterator it = m_drawn.find(index);
+		if (it != m_drawn.end()) return it->second;
+	}
+	return draw(index);
+}
+
+int LazyFrameStore::size(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_states.size();
+}
+
+void LazyFrameStore::clear(void)
+{
+	stop();
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_states.clear();
+	m_drawn.clear();
+	m_playhead = 0;
+}
+
+size_t LazyFrameStore::memoryUsage(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	size_t frameSize = (size_t)m_animation.width() * m_animation.height() * sizeof(Uint32);
+	size_t stateSize = sizeof(FrameState) + (m_states.empty() ? 0 : m_states[0].objects.size() * sizeof(ObjectState));
+	return m_drawn.size() * frameSize + m_states.size() * stateSize;
+}
+
+std::string LazyFrameStore::summary(void)
+{
+	size_t memory = memoryUsage();
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return (boost::format("Frames: %i drawn on demand, %i held, %.1f MiB, %i drawn so far") % m_states.size() % m_drawn.size() % (memory / 1048576.0) % m_drawCount).str();
+}
+
+FramePtr LazyFrameStore::draw(int index)
+{
+	FramePtr frame(new Frame(m_animation.width(), m_animation.height()));
+	m_animation.rasterize(m_states[index], frame);
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_drawCount ++;
+	return frame;
+}
+
+// Whether index is the playhead, the frame just behind it, or up to m_window frames ahead.
+bool LazyFrameStore::wanted(int index)
+{
+	int frameCount = m_states.size();
+	int ahead = ((index - m_playhead) * m_direction % frameCount + frameCount) % frameCount;
+	return ahead <= m_window || ahead == frameCount - 1;
+}
+
+void LazyFrameStore::drawAhead(void)
+{
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	while (!m_stopping) {
+		int frameCount = m_states.size();
+		int next = -1;
+		for (int i = 1; i <= std::min(m_window, frameCount - 1); i ++) {
+			int index = ((m_playhead + i * m_direction) % frameCount + frameCount) % frameCount;
+			if (m_drawn.find(index) == m_drawn.end()) {
+				next = index;
+				break;
+			}
+		}
+
+		if (next == -1) {
+			m_changed.wait(lock);
+			continue;
+		}
+
+		m_drawing = next;
+		lock.unlock();
+		FramePtr frame = draw(next);
+		lock.lock();
+		m_drawing = -1;
+		if (wanted(next)) m_drawn[next] = frame;
+		m_changed.notify_all();
+	}
+}
+
+void LazyFrameStore::stop(void)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_stopping = true;
+		m_changed.notify_all();
+	}
+	if (m_thread.joinable()) m_thread.join();
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stopping = false;
+}
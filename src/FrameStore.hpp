@@ -0,0 +1,195 @@
+#ifndef FRAMESTORE_HPP
+#define FRAMESTORE_HPP
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "Animation.hpp"
+
+// Where an animation keeps its finished frames. Frames are added in order from
+// one thread; get() can be called from any number of threads at once, and the
+// frame it returns may be a fresh copy that must not be modified.
+class FrameStore
+{
+public:
+	FrameStore() {}
+	virtual ~FrameStore() {}
+
+	virtual void add(FramePtr frame) = 0;
+	virtual FramePtr get(int index) = 0;
+	// For saves and blends walking the frames: a get() that doesn't count as
+	// where the preview is, so a store following the preview isn't moved.
+	virtual FramePtr peek(int index) { return get(index); }
+	virtual int size(void) = 0;
+	virtual void clear(void) = 0;
+	virtual size_t memoryUsage(void) = 0;
+	virtual std::string summary(void);
+	// Simulation framerate and frames per stored frame, for stores that outlive the session.
+	virtual void setTiming(double framerate, int frameSpan) {}
+	// Whether frames are drawn when asked for rather than kept, so add() isn't supported.
+	virtual bool lazy(void) { return false; }
+	// Whether an add() was lost, e.g. to a full disk, so the store is missing frames.
+	virtual bool failed(void) { return false; }
+	// Called after the last add(), to give back room grown into along the way.
+	virtual void finish(void) {}
+
+	bool empty(void);
+};
+
+typedef boost::shared_ptr<FrameStore> FrameStorePtr;
+
+// Every frame kept as it was drawn.
+class MemoryFrameStore : public FrameStore
+{
+public:
+	MemoryFrameStore();
+
+	virtual void add(FramePtr frame);
+	virtual FramePtr get(int index);
+	virtual int size(void);
+	virtual void clear(void);
+	virtual size_t memoryUsage(void);
+private:
+	std::vector<FramePtr> m_frames;
+	size_t m_memoryUsage;
+};
+
+// Frames kept losslessly compressed. Each row is XORed with the same row of the
+// previous frame (or the row above it, in key frames), which leaves long runs of
+// zeros wherever nothing moved, and the result is LzCodec compressed. Every
+// KEY_INTERVAL-th frame is a key frame, so decoding one never has to replay
+// more than that many deltas. The last few decoded frames are kept, so walking
+// the animation in order only decodes each frame once.
+class CompressedFrameStore : public FrameStore
+{
+public:
+	CompressedFrameStore();
+
+	virtual void add(FramePtr frame);
+	virtual FramePtr get(int index);
+	virtual int size(void);
+	virtual void clear(void);
+	virtual size_t memoryUsage(void);
+	virtual std::string summary(void);
+private:
+	static const int KEY_INTERVAL = 16;
+	static const int CACHE_SIZE = 8;
+
+	int m_width;
+	int m_height;
+	std::vector< std::vector<Uint8> > m_compressed;
+	size_t m_compressedSize;
+	std::vector<Uint32> m_previous; // Pixels of the last frame added.
+	std::vector<Uint32> m_delta;
+	std::vector<Uint8> m_buffer;
+	std::list< std::pair<int, FramePtr> > m_decoded; // Most recently used first.
+	boost::mutex m_mutex;
+
+	bool decodeInto(int index, FramePtr frame, std::vector<Uint32> &delta);
+};
+
+// Frames in one memory-mapped file, e.g. output/animation.frames, so the OS
+// pages them in and out instead of them taking up heap. After a page sized
+// header, frame i's pixels start at a fixed offset of i times the page aligned
+// frame size. get() hands out frames pointing straight into the mapping, and
+// asks for the next few frames to be read ahead when it sees the animation
+// being walked in order, either way. A finished file can be reopened with
+// open() to blend or save it again without simulating.
+class MappedFrameStore : public FrameStore
+{
+public:
+	MappedFrameStore(std::string filename);
+
+	bool open(void);
+	virtual void add(FramePtr frame);
+	virtual FramePtr get(int index);
+	virtual int size(void);
+	virtual void clear(void);
+	virtual size_t memoryUsage(void);
+	virtual std::string summary(void);
+	virtual void setTiming(double framerate, int frameSpan);
+	virtual bool failed(void);
+	virtual void finish(void);
+	int width(void);
+	int height(void);
+	double framerate(void);
+	int frameSpan(void);
+private:
+	class Header
+	{
+	public:
+		char magic[8];
+		Uint32 version;
+		Uint32 width;
+		Uint32 height;
+		Uint32 pitch;
+		Uint32 frameSize;
+		Uint32 frameCount;
+		Uint32 frameSpan;
+		double framerate;
+	};
+
+	static const size_t HEADER_SIZE = 4096; // Also the page size frames are aligned to.
+	static const Uint32 MAX_DIMENSION = 1 << 15;
+	static const int READAHEAD = 4;
+
+	std::string m_filename;
+	boost::shared_ptr<boost::interprocess::mapped_region> m_region;
+	Header m_header;
+	int m_capacity;
+	int m_lastIndex;
+	bool m_failed;
+	boost::mutex m_mutex;
+
+	bool map(int capacity);
+	Uint8 *pixels(int index);
+	void readAhead(int index, int direction);
+};
+
+// Frames drawn from recorded simulation states only when they are asked for,
+// so a preview can start as soon as the simulation has run, and memory stays
+// flat however long the animation is. The frames within WINDOW of the last one
+// asked for, in the direction of travel and wrapping around like the preview
+// does, are drawn ahead on a thread of its own; frames further away are let go.
+// Saves and blends peek() instead, so they don't drag the window along.
+class LazyFrameStore : public FrameStore
+{
+public:
+	LazyFrameStore(Animation &animation, int window = 8);
+	virtual ~LazyFrameStore();
+
+	void addState(const FrameState &state);
+	virtual void add(FramePtr frame);
+	virtual FramePtr get(int index);
+	virtual FramePtr peek(int index);
+	virtual int size(void);
+	virtual void clear(void);
+	virtual size_t memoryUsage(void);
+	virtual std::string summary(void);
+	virtual bool lazy(void) { return true; }
+private:
+	Animation &m_animation;
+	int m_window;
+	std::vector<FrameState> m_states;
+	std::map<int, FramePtr> m_drawn;
+	int m_playhead;
+	int m_direction;
+	int m_drawing; // Frame the thread is drawing, or -1.
+	bool m_stopping;
+	size_t m_drawCount;
+	boost::thread m_thread;
+	boost::mutex m_mutex;
+	boost::condition_variable m_changed;
+
+	FramePtr draw(int index);
+	bool wanted(int index);
+	void drawAhead(void);
+	void stop(void);
+};
+
+#endif // FRAMESTORE_HPP
@@ -0,0 +1,294 @@
+#include <cstdio>
+#include <zlib.h>
+#include "FrameWriter.hpp"
+#include "Profiler.hpp"
+
+namespace {
+	bool createDirectory(std::string directory)
+	{
+		if (!boost::filesystem::is_directory(directory)) {
+			boost::system::error_code error;
+			boost::filesystem::create_directories(directory, error);
+			if (error) {
+				g_console.print(boost::format("Could not create '%s': %s") % directory % error.message());
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// <directory>/frame####.<extension>, without a boost::format per frame.
+	std::string frameFilename(const std::string &directory, int frameIndex, const char *extension)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/frame%04d.%s", frameIndex, extension);
+		return directory + name;
+	}
+
+	void putLong(std::vector<Uint8> &bytes, Uint32 value)
+	{
+		bytes.push_back(value >> 24);
+		bytes.push_back(value >> 16);
+		bytes.push_back(value >> 8);
+		bytes.push_back(value);
+	}
+
+	void putChunk(std::vector<Uint8> &bytes, const char *type, const Uint8 *data, size_t size)
+	{
+		putLong(bytes, size);
+		size_t start = bytes.size();
+		bytes.insert(bytes.end(), type, type + 4);
+		if (size > 0) bytes.insert(bytes.end(), data, data + size);
+		putLong(bytes, crc32(0, &bytes[start], bytes.size() - start));
+	}
+
+	// Runs deflate over input, appending whatever it produces to output.
+	bool deflateInto(z_stream &stream, const Uint8 *input, size_t size, int flush, std::vector<Uint8> &output)
+	{
+		stream.next_in = (Bytef *)input;
+		stream.avail_in = size;
+		do {
+			size_t used = output.size();
+			output.resize(used + 65536);
+			stream.next_out = &output[used];
+			stream.avail_out = 65536;
+			int result = deflate(&stream, flush);
+			output.resize(output.size() - stream.avail_out);
+			if (result == Z_STREAM_ERROR) return false;
+			if (result == Z_STREAM_END) return true;
+		}
+		while (stream.avail_in > 0 || stream.avail_out == 0);
+
+		return true;
+	}
+}
+
+BmpFrameWriter::BmpFrameWriter(std::string directory) :
+	m_directory(directory)
+{
+}
+
+bool BmpFrameWriter::begin(int width, int height, int frameCount, double framerate)
+{
+	return createDirectory(m_directory);
+}
+
+bool BmpFrameWriter::write(FramePtr frame, int frameIndex)
+{
+	std::string filename = frameFilename(m_directory, frameIndex, "bmp");
+	ProfileScope profile(Profiler::SAVE_BMP, frameIndex);
+	if (SDL_SaveBMP(frame->surface(), filename.c_str()) != 0) {
+		g_console.print(boost::format("Error saving '%s': %s") % filename % SDL_GetError());
+		return false;
+	}
+
+	return true;
+}
+
+PngFrameWriter::PngFrameWriter(std::string directory, int level) :
+	m_directory(directory), m_level(std::max(0, std::min(level, 9)))
+{
+}
+
+bool PngFrameWriter::begin(int width, int height, int frameCount, double framerate)
+{
+	return createDirectory(m_directory);
+}
+
+bool PngFrameWriter::write(FramePtr frame, int frameIndex)
+{
+	SDL_Surface *surface = frame->surface();
+	int width = surface->w;
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit(&stream, m_level) != Z_OK) return false;
+
+	// Each row is its filter type followed by RGB. The Sub filter (each byte
+	// minus the one a pixel to the left) makes gradients and flat areas
+	// compress better; stored output skips it.
+	Uint8 filter = m_level > 0 ? 1 : 0;
+	std::vector<Uint8> row(1 + width * 3);
+	std::vector<Uint8> compressed;
+	bool ok = true;
+	for (int y = 0; y < surface->h && ok; y ++) {
+		const Uint32 *pixels = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+		row[0] = filter;
+		Uint8 *out = &row[1];
+		Uint8 left[3] = { 0, 0, 0 };
+		for (int x = 0; x < width; x ++, out += 3) {
+			Uint8 rgb[3] = { (Uint8)(pixels[x] >> 16), (Uint8)(pixels[x] >> 8), (Uint8)pixels[x] };
+			for (int channel = 0; channel < 3; channel ++) {
+				out[channel] = filter ? rgb[channel] - left[channel] : rgb[channel];
+				left[channel] = rgb[channel];
+			}
+		}
+		ok = deflateInto(stream, &row[0], row.size(), Z_NO_FLUSH, compressed);
+	}
+	ok = ok && deflateInto(stream, NULL, 0, Z_FINISH, compressed);
+	deflateEnd(&stream);
+	if (!ok) {
+		g_console.print(boost::format("Error compressing frame %i") % frameIndex);
+		return false;
+	}
+
+	std::vector<Uint8> bytes;
+	const char *signature = "\x89PNG\r\n\x1a\n";
+	bytes.insert(bytes.end(), signature, signature + 8);
+	std::vector<Uint8> header;
+	putLong(header, width);
+	putLong(header, surface->h);
+	header.push_back(8); // Bits per channel.
+	header.push_back(2); // Truecolour.
+	header.push_back(0); // Deflate.
+	header.push_back(0); // Adaptive filtering.
+	header.push_back(0); // Not interlaced.
+	putChunk(bytes, "IHDR", &header[0], header.size());
+	putChunk(bytes, "IDAT", compressed.empty() ? NULL : &compressed[0], compressed.size());
+	putChunk(bytes, "IEND", NULL, 0);
+
+	std::string filename = frameFilename(m_directory, frameIndex, "png");
+	std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write((const char *)&bytes[0], bytes.size());
+	if (!file) {
+		g_console.print(boost::format("Error saving '%s'") % filename);
+		return false;
+	}
+
+	return true;
+}
+
+RawFrameWriter::RawFrameWriter(std::string filename) :
+	m_filename(filename), m_frameSize(0)
+{
+}
+
+bool RawFrameWriter::begin(int width, int height, int frameCount, double framerate)
+{
+	boost::filesystem::path directory = boost::filesystem::path(m_filename).parent_path();
+	if (!directory.empty() && !createDirectory(directory.string())) return false;
+
+	m_frameSize = (std::streamoff)width * height * sizeof(Uint32);
+	m_file.open(m_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!m_file) {
+		g_console.print(boost::format("Could not open '%s' for writing") % m_filename);
+		return false;
+	}
+
+	return true;
+}
+
+bool RawFrameWriter::write(FramePtr frame, int frameIndex)
+{
+	SDL_Surface *surface = frame->surface();
+	int rowSize = surface->w * sizeof(Uint32);
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_file.seekp(frameIndex * m_frameSize);
+	if (surface->pitch == rowSize) {
+		m_file.write((const char *)surface->pixels, (std::streamsize)rowSize * surface->h);
+	}
+	else {
+		for (int y = 0; y < surface->h; y ++) {
+			m_file.write((const char *)surface->pixels + y * surface->pitch, rowSize);
+		}
+	}
+
+	if (!m_file) {
+		g_console.print(boost::format("Error writing frame %i to '%s'") % frameIndex % m_filename);
+		return false;
+	}
+
+	return true;
+}
+
+bool RawFrameWriter::end(void)
+{
+	m_file.close();
+	if (m_file.fail()) {
+		g_console.print(boost::format("Error writing '%s'") % m_filename);
+		return false;
+	}
+
+	return true;
+}
+
+AsyncFrameWriter::AsyncFrameWriter(FrameWriter &writer, int threadCount) :
+	m_writer(writer), m_pool(threadCount), m_pending(0), m_written(0), m_frameCount(0), m_failed(false), m_lastReport(0)
+{
+	m_maxPending = m_pool.threadCount() * 2;
+}
+
+AsyncFrameWriter::~AsyncFrameWriter()
+{
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	while (m_pending > 0) {
+		m_done.wait(lock);
+	}
+}
+
+void AsyncFrameWriter::prepare(FrameStore &frames)
+{
+	m_writer.prepare(frames);
+}
+
+bool AsyncFrameWriter::begin(int width, int height, int frameCount, double framerate)
+{
+	m_frameCount = frameCount;
+	m_written = 0;
+	m_failed = false;
+	m_lastReport = SDL_GetTicks();
+	return m_writer.begin(width, height, frameCount, framerate);
+}
+
+bool AsyncFrameWriter::write(FramePtr frame, int frameIndex)
+{
+	if (m_writer.sequential()) return m_writer.write(frame, frameIndex);
+
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	while (m_pending >= m_maxPending) {
+		m_done.wait(lock);
+	}
+	if (m_failed) return false;
+
+	m_pending ++;
+	lock.unlock();
+	m_pool.post(boost::bind(&AsyncFrameWriter::writeFrame, this, frame, frameIndex));
+	return true;
+}
+
+bool AsyncFrameWriter::end(void)
+{
+	{
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while (m_pending > 0) {
+			m_done.wait(lock);
+		}
+		if (m_failed) return false;
+	}
+
+	return m_writer.end();
+}
+
+bool AsyncFrameWriter::sequential(void)
+{
+	return m_writer.sequential();
+}
+
+void AsyncFrameWriter::writeFrame(FramePtr frame, int frameIndex)
+{
+	bool ok = m_writer.write(frame, frameIndex);
+	frame.reset();
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (!ok) m_failed = true;
+	m_written ++;
+	Uint32 now = SDL_GetTicks();
+	if (now - m_lastReport >= 1000 && m_written < m_frameCount) {
+		g_console.print(boost::format("Saving: %i of %i frames written") % m_written % m_frameCount);
+		m_lastReport = now;
+	}
+	m_pending --;
+	m_done.notify_all();
+}
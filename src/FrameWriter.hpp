@@ -0,0 +1,106 @@
+#ifndef FRAMEWRITER_HPP
+#define FRAMEWRITER_HPP
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include "Animation.hpp"
+#include "FrameStore.hpp"
+#include "WorkerPool.hpp"
+
+// Destination for finished frames. Frames arrive with their position in the
+// output sequence, so writers that produce one file per frame can accept them
+// out of order; writers that report sequential() must be fed in order.
+// prepare() is only called when every frame is available up front.
+class FrameWriter
+{
+public:
+	FrameWriter() {}
+	virtual ~FrameWriter() {}
+
+	virtual void prepare(FrameStore &frames) {}
+	virtual bool begin(int width, int height, int frameCount, double framerate) { return true; }
+	virtual bool write(FramePtr frame, int frameIndex) = 0;
+	virtual bool end(void) { return true; }
+	virtual bool sequential(void) { return false; }
+};
+
+// Writes output/frame####.bmp, one uncompressed bitmap per frame.
+class BmpFrameWriter : public FrameWriter
+{
+public:
+	BmpFrameWriter(std::string directory = "output");
+
+	virtual bool begin(int width, int height, int frameCount, double framerate);
+	virtual bool write(FramePtr frame, int frameIndex);
+private:
+	std::string m_directory;
+};
+
+// Writes output/frame####.png as 8 bit RGB, deflated at a zlib level from 0
+// (stored) to 9 (smallest). Rows are converted and filtered one at a time
+// straight from the frame.
+class PngFrameWriter : public FrameWriter
+{
+public:
+	PngFrameWriter(std::string directory = "output", int level = 6);
+
+	virtual bool begin(int width, int height, int frameCount, double framerate);
+	virtual bool write(FramePtr frame, int frameIndex);
+private:
+	std::string m_directory;
+	int m_level;
+};
+
+// Writes every frame into one headerless file, frame after frame of top-down
+// rows of 32 bit little-endian BGRA (ffmpeg's -f rawvideo -pix_fmt bgra).
+// Frames are written at their own offset, so they can arrive in any order.
+class RawFrameWriter : public FrameWriter
+{
+public:
+	RawFrameWriter(std::string filename);
+
+	virtual bool begin(int width, int height, int frameCount, double framerate);
+	virtual bool write(FramePtr frame, int frameIndex);
+	virtual bool end(void);
+private:
+	std::string m_filename;
+	std::ofstream m_file;
+	std::streamoff m_frameSize;
+	boost::mutex m_mutex;
+};
+
+// Runs another writer's write() calls on a worker pool, so encoding and disk
+// I/O overlap with each other and with whatever produces the frames. write()
+// only blocks when too many frames are already waiting, which bounds how many
+// decoded frames a compressed or mapped FrameStore has out at once. Progress
+// goes to the console about once a second. Writers that must be fed in order
+// are called directly instead.
+class AsyncFrameWriter : public FrameWriter
+{
+public:
+	AsyncFrameWriter(FrameWriter &writer, int threadCount = 0);
+	virtual ~AsyncFrameWriter();
+
+	virtual void prepare(FrameStore &frames);
+	virtual bool begin(int width, int height, int frameCount, double framerate);
+	virtual bool write(FramePtr frame, int frameIndex);
+	virtual bool end(void);
+	virtual bool sequential(void);
+private:
+	FrameWriter &m_writer;
+	WorkerPool m_pool;
+	int m_maxPending;
+	int m_pending;
+	int m_written;
+	int m_frameCount;
+	bool m_failed;
+	Uint32 m_lastReport;
+	boost::mutex m_mutex;
+	boost::condition_variable m_done;
+
+	void writeFrame(FramePtr frame, int frameIndex);
+};
+
+#endif // FRAMEWRITER_HPP
@@ -0,0 +1,623 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "GifWriter.hpp"
+
+namespace {
+	const int LZW_MIN_CODE_SIZE = 8;
+	const int TABLE_SIZE = 256;
+	const int MAX_COLORS = TABLE_SIZE - 1; // The last entry is kept for transparency.
+
+	void putShort(std::vector<Uint8> &bytes, int value)
+	{
+		bytes.push_back(value & 0xff);
+		bytes.push_back((value >> 8) & 0xff);
+	}
+
+	// Packs variable width codes LSB first into 255 byte data sub-blocks.
+	class CodeWriter
+	{
+	public:
+		CodeWriter(std::vector<Uint8> &bytes) :
+			m_bytes(bytes), m_bits(0), m_bitCount(0), m_blockStart(0)
+		{
+			startBlock();
+		}
+
+		void write(int code, int codeSize) {
+			m_bits |= (Uint32)code << m_bitCount;
+			m_bitCount += codeSize;
+			while (m_bitCount >= 8) {
+				putByte(m_bits & 0xff);
+				m_bits >>= 8;
+				m_bitCount -= 8;
+			}
+		}
+
+		void finish(void) {
+			if (m_bitCount > 0) putByte(m_bits & 0xff);
+			if (m_bytes.size() - m_blockStart > 1) {
+				m_bytes[m_blockStart] = m_bytes.size() - m_blockStart - 1;
+			}
+			else {
+				m_bytes.pop_back();
+			}
+			m_bytes.push_back(0); // Block terminator.
+		}
+	private:
+		std::vector<Uint8> &m_bytes;
+		Uint32 m_bits;
+		int m_bitCount;
+		size_t m_blockStart;
+
+		void startBlock(void) {
+			m_blockStart = m_bytes.size();
+			m_bytes.push_back(0);
+		}
+
+		void putByte(Uint8 byte) {
+			m_bytes.push_back(byte);
+			if (m_bytes.size() - m_blockStart - 1 == 255) {
+				m_bytes[m_blockStart] = 255;
+				startBlock();
+			}
+		}
+	};
+
+	// GIF flavoured LZW with a hashed string table, reset when it reaches 4096 codes.
+	void lzwEncode(const std::vector<Uint8> &indices, std::vector<Uint8> &bytes)
+	{
+		const int HASH_SIZE = 8192;
+		const int clearCode = 1 << LZW_MIN_CODE_SIZE;
+		const int endCode = clearCode + 1;
+
+		bytes.push_back(LZW_MIN_CODE_SIZE);
+		CodeWriter writer(bytes);
+		if (indices.empty()) {
+			writer.write(clearCode, LZW_MIN_CODE_SIZE + 1);
+			writer.write(endCode, LZW_MIN_CODE_SIZE + 1);
+			writer.finish();
+			return;
+		}
+
+		std::vector<Sint32> keys(HASH_SIZE, -1);
+		std::vector<Uint16> codes(HASH_SIZE, 0);
+		int codeSize = LZW_MIN_CODE_SIZE + 1;
+		int maxCode = endCode;
+
+		writer.write(clearCode, codeSize);
+		int prefix = indices[0];
+		for (size_t i = 1; i < indices.size(); i ++) {
+			int key = (prefix << 8) | indices[i];
+			int slot = (key * 2654435761u) >> 19;
+			while (keys[slot] != -1 && keys[slot] != key) {
+				slot = (slot + 1) & (HASH_SIZE - 1);
+			}
+			if (keys[slot] == key) {
+				prefix = codes[slot];
+				continue;
+			}
+
+			writer.write(prefix, codeSize);
+			keys[slot] = key;
+			codes[slot] = ++ maxCode;
+			if (maxCode >= (1 << codeSize)) {
+				codeSize ++;
+			}
+			if (maxCode == 4095) {
+				writer.write(clearCode, codeSize);
+				std::fill(keys.begin(), keys.end(), -1);
+				codeSize = LZW_MIN_CODE_SIZE + 1;
+				maxCode = endCode;
+			}
+			prefix = indices[i];
+		}
+
+		writer.write(prefix, codeSize);
+		writer.write(endCode, codeSize);
+		writer.finish();
+	}
+
+	class ColorBox
+	{
+	public:
+		int begin;
+		int end;
+		int channel; // Widest channel, 0 red, 1 green, 2 blue.
+		int range;
+		Uint64 count;
+	};
+
+	class BinChannelLess
+	{
+	public:
+		BinChannelLess(const std::vector<Uint64> &histogram, int channel) :
+			m_histogram(histogram), m_channel(channel)
+		{
+		}
+
+		bool operator()(int a, int b) const {
+			return mean(a) < mean(b);
+		}
+	private:
+		// As a double: the cross products sa * cb of a whole animation's histogram overflow 64 bits.
+		double mean(int bin) const {
+			return (double)m_histogram[bin * 4 + 1 + m_channel] / m_histogram[bin * 4];
+		}
+
+		const std::vector<Uint64> &m_histogram;
+		int m_channel;
+	};
+}
+
+GifPalette::GifPalette() :
+	m_lookup(BINS, -1)
+{
+}
+
+void GifPalette::build(const std::vector<Uint64> &histogram, int maxColors)
+{
+	std::vector<int> bins;
+	for (int i = 0; i < BINS; i ++) {
+		if (histogram[i * 4] > 0) bins.push_back(i);
+	}
+
+	std::vector<ColorBox> boxes;
+	ColorBox all = { 0, (int)bins.size(), 0, 0, 0 };
+	boxes.push_back(all);
+
+	// Median cut: keep splitting the box with the most pixels times colour
+	// spread, at the pixel median of its widest channel.
+	while (!bins.empty() && (int)boxes.size() < maxColors) {
+		int best = -1;
+		double bestScore = 0.0;
+		for (int b = 0; b < (int)boxes.size(); b ++) {
+			ColorBox &box = boxes[b];
+			int low[3] = { 255, 255, 255 };
+			int high[3] = { 0, 0, 0 };
+			box.count = 0;
+			for (int i = box.begin; i < box.end; i ++) {
+				const Uint64 *entry = &histogram[bins[i] * 4];
+				box.count += entry[0];
+				for (int c = 0; c < 3; c ++) {
+					int mean = entry[1 + c] / entry[0];
+					low[c] = std::min(low[c], mean);
+					high[c] = std::max(high[c], mean);
+				}
+			}
+			box.channel = 0;
+			for (int c = 1; c < 3; c ++) {
+				if (high[c] - low[c] > high[box.channel] - low[box.channel]) box.channel = c;
+			}
+			box.range = high[box.channel] - low[box.channel];
+
+			double score = (double)box.count * box.range;
+			if (box.end - box.begin > 1 && box.range > 0 && score > bestScore) {
+				best = b;
+				bestScore = score;
+			}
+		}
+		if (best < 0) break;
+
+		ColorBox box = boxes[best];
+		std::sort(bins.begin() + box.begin, bins.begin() + box.end, BinChannelLess(histogram, box.channel));
+		Uint64 half = box.count / 2;
+		Uint64 count = 0;
+		int split = box.begin;
+		while (split < box.end - 1 && count + histogram[bins[split] * 4] <= half) {
+			count += histogram[bins[split] * 4];
+			split ++;
+		}
+		if (split == box.begin) split ++;
+
+		boxes[best].end = split;
+		ColorBox upper = { split, box.end, 0, 0, 0 };
+		boxes.push_back(upper);
+	}
+
+	m_colors.clear();
+	for (std::vector<ColorBox>::iterator it = boxes.begin(); it != boxes.end() && !bins.empty(); ++ it) {
+		Uint64 sums[4] = { 0, 0, 0, 0 };
+		for (int i = (*it).begin; i < (*it).end; i ++) {
+			for (int c = 0; c < 4; c ++) sums[c] += histogram[bins[i] * 4 + c];
+		}
+		for (int c = 1; c < 4; c ++) {
+			m_colors.push_back(sums[0] > 0 ? (Uint8)((sums[c] + sums[0] / 2) / sums[0]) : 0);
+		}
+	}
+	if (m_colors.empty()) {
+		m_colors.assign(3, 0);
+	}
+
+	std::fill(m_lookup.begin(), m_lookup.end(), -1);
+}
+
+int GifPalette::colorCount(void)
+{
+	return m_colors.size() / 3;
+}
+
+Uint8 GifPalette::nearest(Uint32 pixel)
+{
+	int b = bin(pixel);
+	if (m_lookup[b] < 0) {
+		m_lookup[b] = findNearest(b);
+	}
+	return m_lookup[b];
+}
+
+// Shared palettes are filled ahead of time, so threads only ever read the lookup.
+void GifPalette::fillLookup(int first, int last)
+{
+	for (int b = first; b < last; b ++) {
+		m_lookup[b] = findNearest(b);
+	}
+}
+
+void GifPalette::write(std::vector<Uint8> &bytes, int tableSize)
+{
+	bytes.insert(bytes.end(), m_colors.begin(), m_colors.end());
+	for (int i = colorCount(); i < tableSize; i ++) {
+		bytes.push_back(0);
+		bytes.push_back(0);
+		bytes.push_back(0);
+	}
+}
+
+int GifPalette::findNearest(int bin)
+{
+	int r = ((bin >> 10) & 0x1f) << 3 | 4;
+	int g = ((bin >> 5) & 0x1f) << 3 | 4;
+	int b = (bin & 0x1f) << 3 | 4;
+
+	int best = 0;
+	int bestDistance = 1 << 30;
+	for (int i = 0; i < colorCount(); i ++) {
+		int dr = r - m_colors[i * 3];
+		int dg = g - m_colors[i * 3 + 1];
+		int db = b - m_colors[i * 3 + 2];
+		int distance = dr * dr + dg * dg + db * db;
+		if (distance < bestDistance) {
+			best = i;
+			bestDistance = distance;
+		}
+	}
+
+	return best;
+}
+
+GifWriter::GifWriter(std::string filename, bool globalPalette) :
+	m_filename(filename), m_globalPalette(globalPalette), m_hasKey(false), m_key(0),
+	m_keyChecked(false), m_width(0), m_height(0), m_delay(5), m_frameStride(1), m_framesReceived(0), m_headerWritten(false)
+{
+	m_pool.reset(new WorkerPool());
+	m_batchSize = m_pool->threadCount() * 2;
+}
+
+GifWriter::~GifWriter()
+{
+}
+
+void GifWriter::transparencyKey(Uint32 rgb)
+{
+	m_hasKey = true;
+	m_key = rgb & 0x00ffffff;
+}
+
+void GifWriter::prepare(FrameStore &frames)
+{
+	if (frames.empty()) return;
+
+	checkKey(frames.peek(0));
+	if (m_globalPalette) {
+		m_palette = buildPalette(frames);
+	}
+}
+
+bool GifWriter::begin(int width, int height, int frameCount, double framerate)
+{
+	m_width = width;
+	m_height = height;
+	// GIF delays are in hundredths of a second, and most viewers treat anything
+	// below 2 as 10. Faster animations keep every n-th frame so they still play
+	// at about the right speed.
+	m_frameStride = std::max(1, (int)std::ceil(1.5 * framerate / 100.0));
+	m_delay = std::max(2, (int)(100.0 * m_frameStride / framerate + 0.5));
+	m_framesReceived = 0;
+	if (m_frameStride > 1) {
+		g_console.print(boost::format("GIF frames can't be shorter than 1/50 s; writing every %i%s frame of the %g fps animation, with a delay of %i/100 s")
+			% m_frameStride % (m_frameStride == 2 ? "nd" : m_frameStride == 3 ? "rd" : "th") % framerate % m_delay);
+	}
+
+	boost::filesystem::path directory = boost::filesystem::path(m_filename).parent_path();
+	if (!directory.empty() && !boost::filesystem::is_directory(directory)) {
+		boost::system::error_code error;
+		boost::filesystem::create_directories(directory, error);
+	}
+
+	m_file.open(m_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!m_file) {
+		g_console.print(boost::format("Could not open '%s' for writing") % m_filename);
+		return false;
+	}
+
+	return true;
+}
+
+bool GifWriter::write(FramePtr frame, int frameIndex)
+{
+	if (m_framesReceived ++ % m_frameStride != 0) return true;
+
+	checkKey(frame);
+
+	EncodedFrame encoded;
+	encoded.frame = frame;
+	if (!m_hasKey) encoded.previous = m_previous;
+	m_batch.push_back(encoded);
+	m_previous = frame;
+
+	if ((int)m_batch.size() >= m_batchSize) {
+		return flushBatch();
+	}
+
+	return true;
+}
+
+bool GifWriter::end(void)
+{
+	m_previous.reset();
+	if (!flushBatch()) return false;
+	if (!m_headerWritten && !writeHeader()) return false;
+
+	m_file.put(0x3b); // Trailer.
+	m_file.close();
+	if (m_file.fail()) {
+		g_console.print(boost::format("Error writing '%s'") % m_filename);
+		return false;
+	}
+
+	return true;
+}
+
+// Delta frames only work while transparency means "unchanged". If the first
+// frame actually uses the key colour, every frame is written whole instead and
+// cleared afterwards, so keyed areas stay see-through.
+void GifWriter::checkKey(FramePtr frame)
+{
+	if (m_keyChecked) return;
+	m_keyChecked = true;
+	if (!m_hasKey) return;
+
+	SDL_Surface *surface = frame->surface();
+	for (int y = 0; y < surface->h; y ++) {
+		const Uint32 *row = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+		for (int x = 0; x < surface->w; x ++) {
+			if ((row[x] & 0x00ffffff) == m_key) return;
+		}
+	}
+	m_hasKey = false;
+}
+
+void GifWriter::histogram(FrameStore *frames, int first, int stride, std::vector<Uint64> *histogram)
+{
+	histogram->assign(GifPalette::BINS * 4, 0);
+	for (int f = first; f < frames->size(); f += stride) {
+		FramePtr frame = frames->peek(f);
+		SDL_Surface *surface = frame->surface();
+		SDL_Rect all = { 0, 0, surface->w, surface->h };
+		addToHistogram(surface, NULL, all, *histogram);
+	}
+}
+
+// Counts the pixels in rect, leaving out keyed ones and those equal to previous.
+void GifWriter::addToHistogram(SDL_Surface *surface, SDL_Surface *previous, const SDL_Rect &rect, std::vector<Uint64> &histogram)
+{
+	for (int y = rect.y; y < rect.y + rect.h; y ++) {
+		const Uint32 *row = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+		const Uint32 *previousRow = previous ? (const Uint32 *)((const Uint8 *)previous->pixels + y * previous->pitch) : NULL;
+		for (int x = rect.x; x < rect.x + rect.w; x ++) {
+			Uint32 pixel = row[x] & 0x00ffffff;
+			if (m_hasKey && pixel == m_key) continue;
+			if (previousRow && pixel == (previousRow[x] & 0x00ffffff)) continue;
+
+			Uint64 *entry = &histogram[GifPalette::bin(pixel) * 4];
+			entry[0] ++;
+			entry[1] += (pixel >> 16) & 0xff;
+			entry[2] += (pixel >> 8) & 0xff;
+			entry[3] += pixel & 0xff;
+		}
+	}
+}
+
+// Bounding box of the pixels that differ from the previous frame; empty if none do.
+SDL_Rect GifWriter::changedRect(SDL_Surface *surface, SDL_Surface *previous)
+{
+	SDL_Rect rect = { 0, 0, surface->w, surface->h };
+	if (previous == NULL) return rect;
+
+	int top = surface->h;
+	int bottom = -1;
+	int left = surface->w;
+	int right = -1;
+	for (int y = 0; y < surface->h; y ++) {
+		const Uint32 *row = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+		const Uint32 *previousRow = (const Uint32 *)((const Uint8 *)previous->pixels + y * previous->pitch);
+		if (memcmp(row, previousRow, surface->w * sizeof(Uint32)) == 0) continue;
+
+		int x = 0;
+		while (x < left && ((row[x] ^ previousRow[x]) & 0x00ffffff) == 0) x ++;
+		left = std::min(left, x);
+		x = surface->w - 1;
+		while (x > right && ((row[x] ^ previousRow[x]) & 0x00ffffff) == 0) x --;
+		right = std::max(right, x);
+		if (right >= left) {
+			top = std::min(top, y);
+			bottom = y;
+		}
+	}
+
+	if (bottom < 0) {
+		rect.w = 0;
+		rect.h = 0;
+		return rect;
+	}
+
+	rect.x = left;
+	rect.y = top;
+	rect.w = right - left + 1;
+	rect.h = bottom - top + 1;
+	return rect;
+}
+
+GifPalettePtr GifWriter::buildPalette(FrameStore &frames)
+{
+	// Each thread takes every n-th frame into a histogram of its own; then merge.
+	int threadCount = std::min(m_pool->threadCount(), frames.size());
+	std::vector< std::vector<Uint64> > histograms(threadCount);
+	std::vector<WorkerPool::Task> tasks;
+	for (int i = 0; i < threadCount; i ++) {
+		tasks.push_back(boost::bind(&GifWriter::histogram, this, &frames, i, threadCount, &histograms[i]));
+	}
+	m_pool->run(tasks);
+
+	for (int i = 1; i < threadCount; i ++) {
+		for (size_t j = 0; j < histograms[0].size(); j ++) {
+			histograms[0][j] += histograms[i][j];
+		}
+	}
+
+	GifPalettePtr palette(new GifPalette());
+	palette->build(histograms[0], MAX_COLORS);
+
+	tasks.clear();
+	int binsPerTask = GifPalette::BINS / m_pool->threadCount() + 1;
+	for (int first = 0; first < GifPalette::BINS; first += binsPerTask) {
+		tasks.push_back(boost::bind(&GifPalette::fillLookup, palette.get(), first, std::min(first + binsPerTask, (int)GifPalette::BINS)));
+	}
+	m_pool->run(tasks);
+
+	return palette;
+}
+
+bool GifWriter::writeHeader(void)
+{
+	std::vector<Uint8> bytes;
+	const char *signature = "GIF89a";
+	bytes.insert(bytes.end(), signature, signature + 6);
+	putShort(bytes, m_width);
+	putShort(bytes, m_height);
+	bytes.push_back(m_globalPalette ? 0xf7 : 0x70); // Global table flag, 8 bit colour resolution, 256 entries.
+	bytes.push_back(0); // Background colour index.
+	bytes.push_back(0); // Pixel aspect ratio.
+	if (m_globalPalette) {
+		m_palette->write(bytes, TABLE_SIZE);
+	}
+
+	// Loop forever.
+	const char *netscape = "\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00";
+	bytes.insert(bytes.end(), netscape, netscape + 19);
+
+	m_file.write((const char *)&bytes[0], bytes.size());
+	m_headerWritten = true;
+	return m_file.good();
+}
+
+bool GifWriter::flushBatch(void)
+{
+	if (m_batch.empty()) return true;
+
+	if (m_globalPalette && !m_palette) {
+		// Streaming: nothing was prepared, so the first batch has to stand in for the whole animation.
+		MemoryFrameStore frames;
+		for (std::vector<EncodedFrame>::iterator it = m_batch.begin(); it != m_batch.end(); ++ it) {
+			frames.add((*it).frame);
+		}
+		m_palette = buildPalette(frames);
+	}
+
+	if (!m_headerWritten && !writeHeader()) return false;
+
+	std::vector<WorkerPool::Task> tasks;
+	for (std::vector<EncodedFrame>::iterator it = m_batch.begin(); it != m_batch.end(); ++ it) {
+		tasks.push_back(boost::bind(&GifWriter::encodeFrame, this, &(*it)));
+	}
+	m_pool->run(tasks);
+
+	for (std::vector<EncodedFrame>::iterator it = m_batch.begin(); it != m_batch.end(); ++ it) {
+		m_file.write((const char *)&(*it).bytes[0], (*it).bytes.size());
+	}
+	m_batch.clear();
+
+	if (!m_file.good()) {
+		g_console.print(boost::format("Error writing '%s'") % m_filename);
+		return false;
+	}
+
+	return true;
+}
+
+void GifWriter::encodeFrame(EncodedFrame *encoded)
+{
+	SDL_Surface *surface = encoded->frame->surface();
+	SDL_Surface *previous = encoded->previous ? encoded->previous->surface() : NULL;
+	SDL_Rect rect = changedRect(surface, previous);
+	if (rect.w == 0) {
+		// Nothing moved, but the frame still has to take up its time: one transparent pixel.
+		rect.w = 1;
+		rect.h = 1;
+	}
+
+	GifPalettePtr palette = m_palette;
+	if (!m_globalPalette) {
+		std::vector<Uint64> frameHistogram(GifPalette::BINS * 4, 0);
+		addToHistogram(surface, previous, rect, frameHistogram);
+		palette.reset(new GifPalette());
+		palette->build(frameHistogram, MAX_COLORS);
+	}
+
+	// Keyed pixels, and pixels that are the same as in the previous frame, are transparent.
+	int transparentIndex = TABLE_SIZE - 1;
+	std::vector<Uint8> indices(rect.w * rect.h);
+	for (int y = 0; y < rect.h; y ++) {
+		const Uint32 *row = (const Uint32 *)((const Uint8 *)surface->pixels + (rect.y + y) * surface->pitch) + rect.x;
+		const Uint32 *previousRow = previous ? (const Uint32 *)((const Uint8 *)previous->pixels + (rect.y + y) * previous->pitch) + rect.x : NULL;
+		Uint8 *out = &indices[y * rect.w];
+		for (int x = 0; x < rect.w; x ++) {
+			Uint32 pixel = row[x] & 0x00ffffff;
+			bool transparent = m_hasKey ? pixel == m_key : previousRow != NULL && pixel == (previousRow[x] & 0x00ffffff);
+			out[x] = transparent ? transparentIndex : palette->nearest(pixel);
+		}
+	}
+
+	std::vector<Uint8> &bytes = encoded->bytes;
+
+	// Graphic control extension. Delta frames are drawn over what was there;
+	// keyed frames are cleared afterwards so keyed pixels don't show the
+	// previous frame through.
+	bool hasTransparency = m_hasKey || previous != NULL;
+	int disposal = m_hasKey ? 2 : 1;
+	bytes.push_back(0x21);
+	bytes.push_back(0xf9);
+	bytes.push_back(4);
+	bytes.push_back((disposal << 2) | (hasTransparency ? 1 : 0));
+	putShort(bytes, m_delay);
+	bytes.push_back(hasTransparency ? transparentIndex : 0);
+	bytes.push_back(0);
+
+	// Image descriptor, with a local colour table when there is no global one.
+	bytes.push_back(0x2c);
+	putShort(bytes, rect.x);
+	putShort(bytes, rect.y);
+	putShort(bytes, rect.w);
+	putShort(bytes, rect.h);
+	bytes.push_back(m_globalPalette ? 0x00 : 0x87);
+	if (!m_globalPalette) {
+		palette->write(bytes, TABLE_SIZE);
+	}
+
+	lzwEncode(indices, bytes);
+
+	// The pixels are no longer needed; let the frames go before the batch is written.
+	encoded->frame.reset();
+	encoded->previous.reset();
+}
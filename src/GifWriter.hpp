@@ -0,0 +1,100 @@
+#ifndef GIFWRITER_HPP
+#define GIFWRITER_HPP
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "FrameWriter.hpp"
+#include "WorkerPool.hpp"
+
+// Up to 256 colours picked by median cut, plus a lookup from 15-bit RGB to the
+// nearest entry. Histograms hold a pixel count and red, green and blue sums for
+// each of the BINS 15-bit colours.
+class GifPalette
+{
+public:
+	GifPalette();
+
+	void build(const std::vector<Uint64> &histogram, int maxColors);
+	int colorCount(void);
+	Uint8 nearest(Uint32 pixel);
+	void fillLookup(int first, int last);
+	void write(std::vector<Uint8> &bytes, int tableSize);
+
+	static const int BINS = 1 << 15;
+	static int bin(Uint32 pixel) {
+		return ((pixel >> 9) & 0x7c00) | ((pixel >> 6) & 0x03e0) | ((pixel >> 3) & 0x001f);
+	}
+private:
+	std::vector<Uint8> m_colors; // RGB triplets.
+	std::vector<Sint32> m_lookup; // Palette index per bin, -1 until looked up.
+
+	int findNearest(int bin);
+};
+
+typedef boost::shared_ptr<GifPalette> GifPalettePtr;
+
+// Writes every frame into one animated GIF, without intermediate files.
+//
+// Frames are collected into batches that are quantized and LZW-compressed on a
+// worker pool, then appended to the file in order. The palette is either one
+// global table, built from all frames when saving from memory (prepare()) or
+// from the first batch when streaming, or a local table per frame.
+//
+// After the first frame, each frame only covers the rectangle that changed
+// since the one before it and is drawn on top of it, with unchanged pixels
+// inside the rectangle left transparent. If the first frame contains the
+// transparency key colour, frames are instead written whole with keyed pixels
+// transparent.
+class GifWriter : public FrameWriter
+{
+public:
+	GifWriter(std::string filename, bool globalPalette = true);
+	virtual ~GifWriter();
+
+	void transparencyKey(Uint32 rgb);
+
+	virtual void prepare(FrameStore &frames);
+	virtual bool begin(int width, int height, int frameCount, double framerate);
+	virtual bool write(FramePtr frame, int frameIndex);
+	virtual bool end(void);
+	virtual bool sequential(void) { return true; }
+private:
+	class EncodedFrame
+	{
+	public:
+		FramePtr frame;
+		FramePtr previous; // Set for delta frames.
+		std::vector<Uint8> bytes;
+	};
+
+	std::string m_filename;
+	std::ofstream m_file;
+	bool m_globalPalette;
+	bool m_hasKey;
+	Uint32 m_key;
+	bool m_keyChecked;
+	int m_width;
+	int m_height;
+	int m_delay;
+	int m_frameStride; // Every m_frameStride-th frame is written, when the framerate is too high for GIF delays.
+	int m_framesReceived;
+	int m_batchSize;
+	bool m_headerWritten;
+	GifPalettePtr m_palette;
+	FramePtr m_previous;
+	std::vector<EncodedFrame> m_batch;
+	boost::shared_ptr<WorkerPool> m_pool;
+
+	void checkKey(FramePtr frame);
+	void histogram(FrameStore *frames, int first, int stride, std::vector<Uint64> *histogram);
+	void addToHistogram(SDL_Surface *surface, SDL_Surface *previous, const SDL_Rect &rect, std::vector<Uint64> &histogram);
+	SDL_Rect changedRect(SDL_Surface *surface, SDL_Surface *previous);
+	GifPalettePtr buildPalette(FrameStore &frames);
+	bool writeHeader(void);
+	bool flushBatch(void);
+	void encodeFrame(EncodedFrame *encoded);
+};
+
+#endif // GIFWRITER_HPP
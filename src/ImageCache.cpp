@@ -17,6 +17,8 @@ ImageCache::~ImageCache()
 
 cairo_surface_t *ImageCache::get(std::string filename)
 {
+	// Held while decoding too, so two scenes wanting the same image don't both decode it.
+	boost::lock_guard<boost::mutex> lock(m_mutex);
 	if (m_images.find(filename) != m_images.end()) {
 		return m_images[filename];
 	}
@@ -3,10 +3,13 @@
 
 #include <string>
 #include <map>
+#include <boost/thread.hpp>
 #include <cairo/cairo.h>
 #include <SDL2/SDL.h>
 #include "Console.hpp"
 
+// Decoded images by file name, shared by every Animation. Safe to use from
+// several threads; each image is decoded once and kept until exit.
 class ImageCache
 {
 public:
@@ -17,6 +20,7 @@ public:
 protected:
 private:
 	std::map<std::string, cairo_surface_t *> m_images;
+	boost::mutex m_mutex; // Queued renders load scenes at the same time.
 };
 
 extern ImageCache g_imageCache;
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cstring>
+#include "LzCodec.hpp"
+
+namespace {
+	const int HASH_BITS = 14;
+	const size_t MIN_MATCH = 4;
+	const size_t MAX_OFFSET = 65535;
+
+	Uint32 read32(const Uint8 *p)
+	{
+		Uint32 value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	Uint32 hash(Uint32 sequence)
+	{
+		return (sequence * 2654435761U) >> (32 - HASH_BITS);
+	}
+
+	void putLength(std::vector<Uint8> &output, size_t length)
+	{
+		while (length >= 255) {
+			output.push_back(255);
+			length -= 255;
+		}
+		output.push_back((Uint8)length);
+	}
+
+	void putSequence(std::vector<Uint8> &output, const Uint8 *literals, size_t literalCount, size_t matchLength, size_t offset)
+	{
+		size_t extraMatch = matchLength >= MIN_MATCH ? matchLength - MIN_MATCH : 0;
+		Uint8 token = (Uint8)((literalCount < 15 ? literalCount : 15) << 4);
+		if (matchLength > 0) token |= extraMatch < 15 ? extraMatch : 15;
+		output.push_back(token);
+		if (literalCount >= 15) putLength(output, literalCount - 15);
+		output.insert(output.end(), literals, literals + literalCount);
+		if (matchLength == 0) return;
+
+		output.push_back(offset & 0xff);
+		output.push_back(offset >> 8);
+		if (extraMatch >= 15) putLength(output, extraMatch - 15);
+	}
+
+	bool getLength(const Uint8 *&in, const Uint8 *end, size_t &length)
+	{
+		Uint8 byte;
+		do {
+			if (in >= end) return false;
+			byte = *in ++;
+			length += byte;
+		}
+		while (byte == 255);
+		return true;
+	}
+}
+
+void LzCodec::compress(const Uint8 *input, size_t size, std::vector<Uint8> &output)
+{
+	output.clear();
+	output.reserve(size / 4 + 16);
+
+	std::vector<size_t> table(1 << HASH_BITS, (size_t)-1);
+	size_t anchor = 0; // Start of the pending literals.
+	size_t position = 0;
+	while (size >= MIN_MATCH && position <= size - MIN_MATCH) {
+		Uint32 sequence = read32(input + position);
+		Uint32 slot = hash(sequence);
+		size_t candidate = table[slot];
+		table[slot] = position;
+
+		if (candidate == (size_t)-1 || position - candidate > MAX_OFFSET || read32(input + candidate) != sequence) {
+			position ++;
+			continue;
+		}
+
+		size_t length = MIN_MATCH;
+		while (position + length < size && input[candidate + length] == input[position + length]) length ++;
+
+		putSequence(output, input + anchor, position - anchor, length, position - candidate);
+		position += length;
+		anchor = position;
+		if (position >= 2 && position <= size - MIN_MATCH) {
+			table[hash(read32(input + position - 2))] = position - 2;
+		}
+	}
+
+	putSequence(output, input + anchor, size - anchor, 0, 0);
+}
+
+// Returns false if the input is corrupt or doesn't fill exactly outputSize bytes.
+bool LzCodec::decompress(const Uint8 *input, size_t size, Uint8 *output, size_t outputSize)
+{
+	const Uint8 *in = input;
+	const Uint8 *inEnd = input + size;
+	Uint8 *out = output;
+	Uint8 *outEnd = output + outputSize;
+	while (in < inEnd) {
+		Uint8 token = *in ++;
+
+		size_t literalCount = token >> 4;
+		if (literalCount == 15 && !getLength(in, inEnd, literalCount)) return false;
+		if (literalCount > (size_t)(inEnd - in) || literalCount > (size_t)(outEnd - out)) return false;
+		memcpy(out, in, literalCount);
+		in += literalCount;
+		out += literalCount;
+		if (in == inEnd) break; // The last sequence has no match.
+
+		if (inEnd - in < 2) return false;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t length = token & 0x0f;
+		if (length == 15 && !getLength(in, inEnd, length)) return false;
+		length += MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(out - output) || length > (size_t)(outEnd - out)) return false;
+
+		// An overlapping match repeats a period of offset bytes; each copy
+		// doubles how much of the pattern is available to copy from.
+		const Uint8 *match = out - offset;
+		while (length > 0) {
+			size_t chunk = std::min(length, (size_t)(out - match));
+			memcpy(out, match, chunk);
+			out += chunk;
+			length -= chunk;
+		}
+	}
+
+	return out == outEnd;
+}
@@ -0,0 +1,20 @@
+#ifndef LZCODEC_HPP
+#define LZCODEC_HPP
+
+#include <vector>
+#include <SDL2/SDL.h>
+
+// Byte-oriented LZ77 in the style of an LZ4 block: each sequence is a token
+// (literal count in the high nibble, match length - 4 in the low nibble, 15
+// meaning more length bytes follow), the literals, and a 16 bit offset back to
+// the match. The last sequence has literals only. Matches are found through a
+// single-entry hash table of 4 byte prefixes, so compression is one pass and
+// decompression is little more than memcpy.
+class LzCodec
+{
+public:
+	static void compress(const Uint8 *input, size_t size, std::vector<Uint8> &output);
+	static bool decompress(const Uint8 *input, size_t size, Uint8 *output, size_t outputSize);
+};
+
+#endif // LZCODEC_HPP
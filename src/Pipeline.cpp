@@ -0,0 +1,247 @@
+#include "Pipeline.hpp"
+
+Pipeline::Pipeline(Animation &animation, FrameWriter &writer) :
+	m_animation(animation), m_writer(writer)
+{
+	m_rasterThreads = std::max(1, (int)boost::thread::hardware_concurrency() - 1);
+	m_queueDepth = 8;
+	m_blend = false;
+	m_frameCount = 0;
+	m_outputFrameCount = 0;
+	m_activeRasterThreads = 0;
+	m_failed = false;
+	m_nextInOrder = 0;
+}
+
+Pipeline::~Pipeline()
+{
+}
+
+void Pipeline::rasterThreads(int count)
+{
+	m_rasterThreads = std::max(1, count);
+}
+
+void Pipeline::queueDepth(int depth)
+{
+	m_queueDepth = std::max(1, depth);
+}
+
+void Pipeline::blend(bool enabled)
+{
+	m_blend = enabled;
+}
+
+bool Pipeline::run(void)
+{
+	m_frameCount = m_animation.frameCount();
+	m_outputFrameCount = m_blend ? m_animation.blendOutputCount(m_frameCount) : m_frameCount;
+	m_activeRasterThreads = m_rasterThreads;
+	m_failed = false;
+	m_nextInOrder = 0;
+
+	if (m_frameCount <= 0) return true;
+	if (m_animation.reversed() && m_writer.sequential()) {
+		// Frames are produced first to last; writing them backwards would mean holding all of them.
+		g_console.print("This output format can't be streamed in reverse");
+		return false;
+	}
+
+	double framerate = m_blend ? m_animation.framerate() / m_animation.blendStep() : m_animation.framerate();
+	if (!m_writer.begin(m_animation.width(), m_animation.height(), m_outputFrameCount, framerate)) return false;
+
+	m_states.reset(new BoundedQueue<FrameState>(m_queueDepth));
+	m_rasterized.reset(new BoundedQueue<IndexedFrame>(m_queueDepth));
+	m_blended.reset(new BoundedQueue<IndexedFrame>(m_queueDepth));
+
+	boost::thread_group threads;
+	threads.create_thread(boost::bind(&Pipeline::simulationStage, this));
+	for (int i = 0; i < m_rasterThreads; i ++) {
+		threads.create_thread(boost::bind(&Pipeline::rasterStage, this));
+	}
+	if (m_blend) {
+		threads.create_thread(boost::bind(&Pipeline::blendStage, this));
+	}
+	threads.create_thread(boost::bind(&Pipeline::writerStage, this));
+	threads.join_all();
+
+	if (failed()) return false;
+	return m_writer.end();
+}
+
+void Pipeline::simulationStage(void)
+{
+	for (int i = 0; i < m_frameCount; i ++) {
+		FrameState state;
+		m_animation.simulate(state);
+		if (!m_states->push(state)) return;
+	}
+
+	m_states->close();
+}
+
+void Pipeline::rasterStage(void)
+{
+	FrameState state;
+	while (m_states->pop(state)) {
+		if (!waitForTurn(state.index)) break;
+		FramePtr frame(new Frame(m_animation.width(), m_animation.height()));
+		m_animation.rasterize(state, frame);
+		if (!m_rasterized->push(IndexedFrame(state.index, frame))) break;
+	}
+
+	// The last rasterizer out ends the stream for the next stage.
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (-- m_activeRasterThreads == 0) {
+		m_rasterized->close();
+	}
+}
+
+void Pipeline::blendStage(void)
+{
+	FrameBlender blender(m_animation.blendWeights());
+	int nrofFramesToBlend = blender.frameCount();
+	int step = m_animation.blendStep();
+	bool grouped = step == nrofFramesToBlend;
+	boost::scoped_ptr<RunningBlend> sums;
+	if (!grouped && m_animation.blendCurve() == "box") {
+		sums.reset(new RunningBlend(m_animation.width(), 0, m_animation.height()));
+	}
+
+	// Rasterizers finish out of order; hold frames back until the next one in sequence arrives.
+	std::map<int, FramePtr> pending;
+	std::deque<FramePtr> window;
+	int nextFrame = 0;
+	int outputIndex = 0;
+	int framesToSkip = 0; // When the step is longer than the window some frames fall between windows.
+
+	IndexedFrame item;
+	while (m_rasterized->pop(item)) {
+		pending[item.first] = item.second;
+
+		std::map<int, FramePtr>::iterator it;
+		while ((it = pending.find(nextFrame)) != pending.end()) {
+			FramePtr frame = it->second;
+			pending.erase(it);
+			nextFrame ++;
+			advance(nextFrame);
+
+			if (framesToSkip > 0) {
+				framesToSkip --;
+				continue;
+			}
+
+			window.push_back(frame);
+			if (sums) sums->add(frame);
+			if ((int)window.size() < nrofFramesToBlend) continue;
+
+			if (!m_blended->push(IndexedFrame(outputIndex ++, blendWindow(blender, window, sums.get())))) return;
+
+			int framesToDrop = std::min(step, (int)window.size());
+			for (int i = 0; i < framesToDrop; i ++) {
+				if (sums) sums->subtract(window.front());
+				window.pop_front();
+			}
+			framesToSkip = step - framesToDrop;
+		}
+	}
+
+	if (!window.empty() && !failed()) {
+		if (grouped) {
+			// Repeat last frame until the final group is full, like Animation::blendFrames.
+			while ((int)window.size() < nrofFramesToBlend) {
+				window.push_back(window.back());
+			}
+			m_blended->push(IndexedFrame(outputIndex ++, blendWindow(blender, window, sums.get())));
+		}
+		else if (outputIndex == 0) {
+			// Fewer frames than one window: blend what there is.
+			FrameBlender shortBlender(FrameBlender::weights(window.size(), m_animation.blendCurve()));
+			m_blended->push(IndexedFrame(outputIndex ++, blendWindow(shortBlender, window, sums.get())));
+		}
+	}
+
+	m_blended->close();
+}
+
+FramePtr Pipeline::blendWindow(FrameBlender &blender, const std::deque<FramePtr> &window, RunningBlend *sums)
+{
+	if (sums != NULL) {
+		FramePtr result(new Frame(m_animation.width(), m_animation.height()));
+		sums->average(window.size(), result);
+		return result;
+	}
+
+	std::vector<FramePtr> frames(window.begin(), window.end());
+	return blender.blend(frames.begin(), frames.end());
+}
+
+void Pipeline::writerStage(void)
+{
+	boost::shared_ptr< BoundedQueue<IndexedFrame> > input = m_blend ? m_blended : m_rasterized;
+	bool reversed = m_animation.reversed();
+	int progressStep = std::max(1, m_outputFrameCount / 10);
+
+	std::map<int, FramePtr> pending;
+	int nextFrame = 0;
+
+	IndexedFrame item;
+	while (input->pop(item)) {
+		pending[item.first] = item.second;
+
+		std::map<int, FramePtr>::iterator it;
+		while ((it = pending.find(nextFrame)) != pending.end()) {
+			int frameIndex = reversed ? m_outputFrameCount - 1 - nextFrame : nextFrame;
+			if (!m_writer.write(it->second, frameIndex)) {
+				fail();
+				return;
+			}
+			pending.erase(it);
+			nextFrame ++;
+			if (!m_blend) advance(nextFrame);
+
+			if (nextFrame % progressStep == 0 || nextFrame == m_outputFrameCount) {
+				g_console.print(boost::format("Wrote %i/%i frames") % nextFrame % m_outputFrameCount);
+			}
+		}
+	}
+}
+
+// Rasterizers finish out of order, and the stage after them holds frames
+// back until the next one in sequence arrives. A rasterizer may only start a
+// frame within the queue depth of that one, so a slow frame can't leave an
+// ever growing backlog of finished frames waiting behind it.
+bool Pipeline::waitForTurn(int frameIndex)
+{
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	while (frameIndex >= m_nextInOrder + m_queueDepth && !m_failed) {
+		m_orderAdvanced.wait(lock);
+	}
+	return !m_failed;
+}
+
+void Pipeline::advance(int nextFrame)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_nextInOrder = nextFrame;
+	m_orderAdvanced.notify_all();
+}
+
+void Pipeline::fail(void)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_failed = true;
+		m_orderAdvanced.notify_all();
+	}
+
+	m_states->abort();
+	m_rasterized->abort();
+	m_blended->abort();
+}
+
+bool Pipeline::failed(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_failed;
+}
@@ -0,0 +1,64 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <deque>
+#include <map>
+#include <utility>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include "Animation.hpp"
+#include "BoundedQueue.hpp"
+#include "FrameBlender.hpp"
+#include "FrameWriter.hpp"
+
+// Streams a loaded scene straight to a FrameWriter instead of keeping every
+// frame in Animation::frames():
+//
+//   simulation -> rasterizer pool -> blend (optional) -> writer
+//
+// Each arrow is a BoundedQueue, so a slow stage blocks the ones before it and
+// peak memory is set by the queue depth rather than the animation length.
+// Every stage runs on its own thread.
+class Pipeline
+{
+public:
+	Pipeline(Animation &animation, FrameWriter &writer);
+	virtual ~Pipeline();
+
+	void rasterThreads(int count);
+	void queueDepth(int depth);
+	void blend(bool enabled);
+	bool run(void);
+private:
+	typedef std::pair<int, FramePtr> IndexedFrame;
+
+	Animation &m_animation;
+	FrameWriter &m_writer;
+	int m_rasterThreads;
+	int m_queueDepth;
+	bool m_blend;
+	int m_frameCount;
+	int m_outputFrameCount;
+	int m_activeRasterThreads;
+	bool m_failed;
+	int m_nextInOrder; // First frame the reordering stage hasn't taken yet.
+	boost::mutex m_mutex;
+	boost::condition_variable m_orderAdvanced;
+
+	boost::shared_ptr< BoundedQueue<FrameState> > m_states;
+	boost::shared_ptr< BoundedQueue<IndexedFrame> > m_rasterized;
+	boost::shared_ptr< BoundedQueue<IndexedFrame> > m_blended;
+
+	void simulationStage(void);
+	void rasterStage(void);
+	void blendStage(void);
+	FramePtr blendWindow(FrameBlender &blender, const std::deque<FramePtr> &window, RunningBlend *sums);
+	void writerStage(void);
+	bool waitForTurn(int frameIndex);
+	void advance(int nextFrame);
+	void fail(void);
+	bool failed(void);
+};
+
+#endif // PIPELINE_HPP
@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <set>
+#include <boost/format.hpp>
+#include "Profiler.hpp"
+
+Profiler g_profiler;
+
+namespace {
+	const char *PROBE_NAMES[Profiler::PROBE_COUNT] = {
+		"step", "background", "objects", "shadows", "mask", "blend", "savebmp",
+		"objects drawn", "shadow sides"
+	};
+
+	// Histogram buckets: the first holds everything under MIN_VALUE, then
+	// BUCKETS_PER_DOUBLING for each doubling above it.
+	const double MIN_VALUE = 0.001;
+	const int BUCKETS_PER_DOUBLING = 8;
+	const int BUCKET_COUNT = 320;
+
+	double toMilliseconds(Uint64 ticks)
+	{
+		return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+	}
+
+	// Nearest rank percentile of values sorted ascending.
+	double percentile(const std::vector<double> &sorted, double p)
+	{
+		if (sorted.empty()) return 0.0;
+		int rank = (int)std::ceil(p / 100.0 * sorted.size());
+		return sorted[std::max(0, std::min(rank - 1, (int)sorted.size() - 1))];
+	}
+}
+
+Profiler::Histogram::Histogram() :
+	count(0), total(0.0), max(0.0), m_buckets(BUCKET_COUNT, 0)
+{
+}
+
+void Profiler::Histogram::add(double value)
+{
+	int bucket = 0;
+	if (value >= MIN_VALUE) {
+		bucket = std::min(1 + (int)(BUCKETS_PER_DOUBLING * std::log(value / MIN_VALUE) / std::log(2.0)), BUCKET_COUNT - 1);
+	}
+	m_buckets[bucket] ++;
+	count ++;
+	total += value;
+	max = std::max(max, value);
+}
+
+void Profiler::Histogram::merge(const Histogram &other)
+{
+	for (int i = 0; i < BUCKET_COUNT; i ++) {
+		m_buckets[i] += other.m_buckets[i];
+	}
+	count += other.count;
+	total += other.total;
+	max = std::max(max, other.max);
+}
+
+// Nearest rank percentile, as the top of the bucket it falls in.
+double Profiler::Histogram::percentile(double p) const
+{
+	if (count == 0) return 0.0;
+	int rank = std::max(1, (int)std::ceil(p / 100.0 * count));
+	int seen = 0;
+	for (int i = 0; i < BUCKET_COUNT; i ++) {
+		seen += m_buckets[i];
+		if (seen >= rank) {
+			return i == 0 ? 0.0 : std::min(max, MIN_VALUE * std::pow(2.0, (double)i / BUCKETS_PER_DOUBLING));
+		}
+	}
+	return max;
+}
+
+void Profiler::ProbeTotals::merge(const ProbeTotals &other)
+{
+	calls.merge(other.calls);
+	for (std::map<int, double>::const_iterator it = other.frames.begin(); it != other.frames.end(); ++ it) {
+		frames[it->first] += it->second;
+	}
+}
+
+Profiler::TraceRing::TraceRing(int limit) :
+	m_next(0), m_limit(limit)
+{
+}
+
+void Profiler::TraceRing::add(const Event &event)
+{
+	if (m_events.size() < m_limit) {
+		m_events.push_back(event);
+	}
+	else {
+		m_events[m_next] = event;
+		m_next = (m_next + 1) % m_limit;
+	}
+}
+
+// Oldest first.
+void Profiler::TraceRing::appendTo(std::vector<Event> &events) const
+{
+	events.insert(events.end(), m_events.begin() + m_next, m_events.end());
+	events.insert(events.end(), m_events.begin(), m_events.begin() + m_next);
+}
+
+void Profiler::TraceRing::clear(void)
+{
+	m_events.clear();
+	m_next = 0;
+}
+
+Profiler::ThreadLog::ThreadLog(Profiler *profiler, int id, int traceLimit) :
+	profiler(profiler), id(id), probes(PROBE_COUNT), events(0), busy(0.0), first(0), last(0), trace(traceLimit)
+{
+}
+
+void Profiler::ThreadLog::clear(void)
+{
+	probes.assign(PROBE_COUNT, ProbeTotals());
+	events = 0;
+	busy = 0.0;
+	first = 0;
+	last = 0;
+	trace.clear();
+}
+
+Profiler::Profiler() :
+	m_enabled(false), m_origin(0), m_nextThreadId(0), m_retired(this, -1, RETIRED_TRACE_LIMIT), m_retiredThreads(0), m_threadLog(&Profiler::retireLog)
+{
+}
+
+Profiler::~Profiler()
+{
+	// The calling thread's log is retired by m_threadLog; any others belong to threads still running.
+	m_threadLog.reset();
+	for (std::vector<ThreadLog *>::iterator it = m_logs.begin(); it != m_logs.end(); ++ it) {
+		delete *it;
+	}
+}
+
+void Profiler::enable(bool enabled)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (enabled && m_origin == 0) m_origin = SDL_GetPerformanceCounter();
+	}
+	m_enabled.store(enabled, boost::memory_order_relaxed);
+}
+
+// Drops everything recorded so far. Threads keep their logs.
+void Profiler::reset(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	for (std::vector<ThreadLog *>::iterator it = m_logs.begin(); it != m_logs.end(); ++ it) {
+		boost::lock_guard<boost::mutex> logLock((*it)->mutex);
+		(*it)->clear();
+	}
+	m_retired.clear();
+	m_retiredThreads = 0;
+	m_origin = enabled() ? SDL_GetPerformanceCounter() : 0;
+}
+
+void Profiler::record(Probe probe, int frame, Uint64 start, Uint64 end)
+{
+	add(probe, frame, start, end, 0);
+}
+
+void Profiler::count(Probe probe, int frame, int value)
+{
+	if (!enabled()) return;
+
+	Uint64 now = SDL_GetPerformanceCounter();
+	add(probe, frame, now, now, value);
+}
+
+const char *Profiler::probeName(Probe probe)
+{
+	return PROBE_NAMES[probe];
+}
+
+// Called as a thread exits with the log it recorded into.
+void Profiler::retireLog(ThreadLog *log)
+{
+	log->profiler->retire(log);
+	delete log;
+}
+
+// Folds an exiting thread's log into m_retired, so pools that come and go
+// don't leave their logs behind.
+void Profiler::retire(ThreadLog *log)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_logs.erase(std::remove(m_logs.begin(), m_logs.end(), log), m_logs.end());
+
+	boost::lock_guard<boost::mutex> logLock(log->mutex);
+	if (log->events == 0) return;
+	for (int probe = 0; probe < PROBE_COUNT; probe ++) {
+		m_retired.probes[probe].merge(log->probes[probe]);
+	}
+	m_retired.events += log->events;
+	m_retired.busy += log->busy;
+	if (m_retired.first == 0 || log->first < m_retired.first) m_retired.first = log->first;
+	m_retired.last = std::max(m_retired.last, log->last);
+	std::vector<Event> events;
+	log->trace.appendTo(events);
+	for (std::vector<Event>::const_iterator it = events.begin(); it != events.end(); ++ it) {
+		m_retired.trace.add(*it);
+	}
+	m_retiredThreads ++;
+}
+
+Profiler::ThreadLog &Profiler::threadLog(void)
+{
+	ThreadLog *log = m_threadLog.get();
+	if (log == NULL) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		log = new ThreadLog(this, m_nextThreadId ++, THREAD_TRACE_LIMIT);
+		m_logs.push_back(log);
+		m_threadLog.reset(log);
+	}
+	return *log;
+}
+
+void Profiler::add(Probe probe, int frame, Uint64 start, Uint64 end, int value)
+{
+	ThreadLog &log = threadLog();
+	boost::lock_guard<boost::mutex> lock(log.mutex);
+	double amount = probe < TIMER_COUNT ? toMilliseconds(end - start) : value;
+	ProbeTotals &totals = log.probes[probe];
+	totals.calls.add(amount);
+	totals.frames[frame] += amount;
+	if (probe < TIMER_COUNT) log.busy += amount;
+	log.events ++;
+	if (log.first == 0 || start < log.first) log.first = start;
+	log.last = std::max(log.last, end);
+	log.trace.add(Event(probe, log.id, frame, start, end, value));
+}
+
+// One line per probe that recorded anything, with percentiles per call and
+// per frame, then how much of the recording each thread spent in probes.
+std::vector<std::string> Profiler::stats(void)
+{
+	std::vector<ProbeTotals> probes;
+	Uint64 first;
+	Uint64 last;
+	std::vector<int> threadIds;
+	std::vector<int> threadEvents;
+	std::vector<double> threadBusy;
+	int retiredThreads;
+	int retiredEvents;
+	double retiredBusy;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		probes = m_retired.probes;
+		first = m_retired.first;
+		last = m_retired.last;
+		retiredThreads = m_retiredThreads;
+		retiredEvents = m_retired.events;
+		retiredBusy = m_retired.busy;
+		for (std::vector<ThreadLog *>::iterator it = m_logs.begin(); it != m_logs.end(); ++ it) {
+			ThreadLog &log = **it;
+			boost::lock_guard<boost::mutex> logLock(log.mutex);
+			if (log.events == 0) continue;
+			for (int probe = 0; probe < PROBE_COUNT; probe ++) {
+				probes[probe].merge(log.probes[probe]);
+			}
+			if (first == 0 || log.first < first) first = log.first;
+			last = std::max(last, log.last);
+			threadIds.push_back(log.id);
+			threadEvents.push_back(log.events);
+			threadBusy.push_back(log.busy);
+		}
+	}
+
+	std::vector<std::string> lines;
+	if (first == 0) {
+		lines.push_back(enabled() ? "Nothing recorded yet" : "Nothing recorded, turn it on with stats on");
+		return lines;
+	}
+
+	lines.push_back("probe          calls   total ms | per call p50    p90    p99    max | per frame p50    p99");
+	for (int probe = 0; probe < PROBE_COUNT; probe ++) {
+		const Histogram &calls = probes[probe].calls;
+		if (calls.count == 0) continue;
+
+		std::vector<double> frames;
+		for (std::map<int, double>::const_iterator it = probes[probe].frames.begin(); it != probes[probe].frames.end(); ++ it) {
+			frames.push_back(it->second);
+		}
+		std::sort(frames.begin(), frames.end());
+		lines.push_back((boost::format("%-14s %6i %10.1f | %13.3f %6.3f %6.3f %6.3f | %13.3f %6.3f")
+			% PROBE_NAMES[probe] % calls.count % calls.total
+			% calls.percentile(50) % calls.percentile(90) % calls.percentile(99) % calls.max
+			% percentile(frames, 50) % percentile(frames, 99)).str());
+	}
+	lines.push_back("(counters are counts rather than ms, per call percentiles within 9%)");
+
+	double span = toMilliseconds(last - first);
+	for (size_t i = 0; i < threadIds.size(); i ++) {
+		lines.push_back((boost::format("thread %i: %i events, busy %.1f of %.1f ms (%.0f%% idle)")
+			% threadIds[i] % threadEvents[i] % threadBusy[i] % span % (span > 0.0 ? 100.0 * (1.0 - threadBusy[i] / span) : 0.0)).str());
+	}
+	if (retiredThreads > 0) {
+		double busy = retiredBusy / retiredThreads;
+		lines.push_back((boost::format("%i exited threads: %i events, busy %.1f of %.1f ms each on average (%.0f%% idle)")
+			% retiredThreads % retiredEvents % busy % span % (span > 0.0 ? 100.0 * (1.0 - busy / span) : 0.0)).str());
+	}
+	return lines;
+}
+
+// Chrome trace event format: a complete event per timer, a counter event per
+// count, and one row per thread. Holds the latest events of each thread.
+bool Profiler::writeTrace(std::string filename)
+{
+	Uint64 origin;
+	std::vector<Event> events;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		origin = m_origin;
+		m_retired.trace.appendTo(events);
+		for (std::vector<ThreadLog *>::iterator it = m_logs.begin(); it != m_logs.end(); ++ it) {
+			boost::lock_guard<boost::mutex> logLock((*it)->mutex);
+			(*it)->trace.appendTo(events);
+		}
+	}
+
+	std::set<int> threads;
+	for (std::vector<Event>::const_iterator it = events.begin(); it != events.end(); ++ it) {
+		threads.insert((*it).thread);
+	}
+
+	std::ofstream out(filename.c_str());
+	out << "{\"traceEvents\": [\n";
+	for (std::set<int>::const_iterator it = threads.begin(); it != threads.end(); ++ it) {
+		out << (it == threads.begin() ? "" : ",\n");
+		out << boost::format("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %i, \"args\": {\"name\": \"thread %i\"}}") % *it % *it;
+	}
+	for (std::vector<Event>::const_iterator it = events.begin(); it != events.end(); ++ it) {
+		const Event &event = *it;
+		double timestamp = event.start >= origin ? toMilliseconds(event.start - origin) * 1000.0 : 0.0;
+		if (event.probe < TIMER_COUNT) {
+			out << boost::format(",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %i}}")
+				% PROBE_NAMES[event.probe] % event.thread % timestamp % (toMilliseconds(event.end - event.start) * 1000.0) % event.frame;
+		}
+		else {
+			out << boost::format(",\n{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"args\": {\"value\": %i}}")
+				% PROBE_NAMES[event.probe] % event.thread % timestamp % event.value;
+		}
+	}
+	out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+	out.close();
+	return !out.fail();
+}
@@ -0,0 +1,173 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <SDL2/SDL.h>
+
+// Timings and counts from the render hot paths, kept per thread and tagged
+// with the frame they were for. Off by default; while off, a probe is one
+// relaxed load and a branch. Each probe keeps a histogram of its values and a
+// total per frame, so stats() costs the same however long it ran, and the
+// latest events go into a ring that writeTrace() exports as Chrome trace
+// events (chrome://tracing, Perfetto).
+class Profiler
+{
+public:
+	// What a probe measures. Timers record a duration, counters a value.
+	enum Probe {
+		STEP,            // One m_world->Step.
+		BACKGROUND,      // Painting the background into a region.
+		OBJECTS,         // Drawing the objects of a region.
+		SHADOWS,         // Collecting sides and filling visibility polygons into the shadow mask.
+		MASK,            // Darkening the region through the shadow mask.
+		BLEND,           // Blending one output frame within a stripe.
+		SAVE_BMP,        // One SDL_SaveBMP.
+		TIMER_COUNT,
+		OBJECTS_DRAWN = TIMER_COUNT, // Objects drawn into a region.
+		SHADOW_SIDES,    // Object sides that could shade a region.
+		PROBE_COUNT
+	};
+
+	Profiler();
+	virtual ~Profiler();
+
+	bool enabled(void) {
+		return m_enabled.load(boost::memory_order_relaxed);
+	}
+	void enable(bool enabled);
+	void reset(void);
+	void record(Probe probe, int frame, Uint64 start, Uint64 end);
+	void count(Probe probe, int frame, int value);
+	std::vector<std::string> stats(void);
+	bool writeTrace(std::string filename);
+	static const char *probeName(Probe probe);
+private:
+	static const int THREAD_TRACE_LIMIT = 1 << 14; // Events a running thread keeps for the trace.
+	static const int RETIRED_TRACE_LIMIT = 1 << 16; // Events kept from threads that have exited.
+
+	class Event
+	{
+	public:
+		Event(Probe probe, int thread, int frame, Uint64 start, Uint64 end, int value) :
+			probe(probe), thread(thread), frame(frame), start(start), end(end), value(value)
+		{
+		}
+
+		Probe probe;
+		int thread;
+		int frame;
+		Uint64 start;
+		Uint64 end;
+		int value;
+	};
+
+	// Counts of values in buckets 2^(1/8) apart, enough for percentiles within 9%.
+	class Histogram
+	{
+	public:
+		Histogram();
+
+		void add(double value);
+		void merge(const Histogram &other);
+		double percentile(double p) const;
+
+		int count;
+		double total;
+		double max;
+	private:
+		std::vector<int> m_buckets;
+	};
+
+	// What a probe recorded: every value, and the sum of them for each frame.
+	class ProbeTotals
+	{
+	public:
+		Histogram calls;
+		std::map<int, double> frames;
+
+		void merge(const ProbeTotals &other);
+	};
+
+	// The newest limit events, oldest overwritten first.
+	class TraceRing
+	{
+	public:
+		TraceRing(int limit);
+
+		void add(const Event &event);
+		void appendTo(std::vector<Event> &events) const;
+		void clear(void);
+	private:
+		std::vector<Event> m_events;
+		size_t m_next;
+		size_t m_limit;
+	};
+
+	// Everything one thread recorded. Only its own thread adds to a log; the
+	// lock is for stats and traces read from another.
+	class ThreadLog
+	{
+	public:
+		ThreadLog(Profiler *profiler, int id, int traceLimit);
+
+		void clear(void);
+
+		Profiler *profiler;
+		int id;
+		boost::mutex mutex;
+		std::vector<ProbeTotals> probes;
+		int events;
+		double busy; // Milliseconds spent in timers.
+		Uint64 first;
+		Uint64 last;
+		TraceRing trace;
+	};
+
+	boost::atomic<bool> m_enabled;
+	Uint64 m_origin; // Performance counter that trace timestamps count from.
+	boost::mutex m_mutex; // Guards everything below.
+	std::vector<ThreadLog *> m_logs; // Of the threads still running.
+	int m_nextThreadId;
+	ThreadLog m_retired; // Totals and trace of the threads that have exited, folded together.
+	int m_retiredThreads;
+	boost::thread_specific_ptr<ThreadLog> m_threadLog;
+
+	static void retireLog(ThreadLog *log);
+	void retire(ThreadLog *log);
+	ThreadLog &threadLog(void);
+	void add(Probe probe, int frame, Uint64 start, Uint64 end, int value);
+};
+
+extern Profiler g_profiler;
+
+// Records the time from construction to destruction (or end()) against probe
+// and frame, if the profiler was on when it started.
+class ProfileScope
+{
+public:
+	ProfileScope(Profiler::Probe probe, int frame) :
+		m_probe(probe), m_frame(frame), m_start(0)
+	{
+		if (g_profiler.enabled()) m_start = SDL_GetPerformanceCounter();
+	}
+
+	~ProfileScope() {
+		end();
+	}
+
+	// Stops timing before the scope ends, for phases that don't have a block of their own.
+	void end(void) {
+		if (m_start != 0) g_profiler.record(m_probe, m_frame, m_start, SDL_GetPerformanceCounter());
+		m_start = 0;
+	}
+private:
+	Profiler::Probe m_probe;
+	int m_frame;
+	Uint64 m_start;
+};
+
+#endif // PROFILER_HPP
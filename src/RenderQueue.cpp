@@ -0,0 +1,161 @@
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "RenderQueue.hpp"
+#include "WorkerPool.hpp"
+
+RenderQueue::RenderQueue(WriterFactory writerFactory, std::string outputDirectory, int concurrency) :
+	m_writerFactory(writerFactory), m_outputDirectory(outputDirectory), m_blend(false), m_cancelled(false), m_finishedCount(0), m_seconds(0.0)
+{
+	m_concurrency = concurrency > 0 ? concurrency : std::max(1, (int)boost::thread::hardware_concurrency());
+}
+
+RenderQueue::~RenderQueue()
+{
+}
+
+// Saves into a directory named after the scene file, numbered when two scenes
+// share a name.
+void RenderQueue::add(std::string sceneFile)
+{
+	std::string name = boost::filesystem::path(sceneFile).stem().string();
+	std::string directory = m_outputDirectory + "/" + name;
+	for (int i = 2; ; i ++) {
+		bool taken = false;
+		for (std::vector<Job>::iterator it = m_jobs.begin(); it != m_jobs.end() && !taken; ++ it) {
+			taken = (*it).outputDirectory == directory;
+		}
+		if (!taken) break;
+		directory = (boost::format("%s/%s-%i") % m_outputDirectory % name % i).str();
+	}
+	m_jobs.push_back(Job(sceneFile, directory));
+}
+
+// Overrides applied to every scene, as with Animation::setOption.
+void RenderQueue::options(const boost::property_tree::ptree &options)
+{
+	m_options = options;
+}
+
+void RenderQueue::blend(bool enabled)
+{
+	m_blend = enabled;
+}
+
+int RenderQueue::jobCount(void)
+{
+	return (int)m_jobs.size();
+}
+
+int RenderQueue::concurrency(void)
+{
+	return m_concurrency;
+}
+
+// Runs every job, at most concurrency() at once, and returns when they have
+// all finished. True if every scene was rendered and saved.
+bool RenderQueue::run(void)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_finishedCount = 0;
+	}
+	if (m_jobs.empty()) return true;
+
+	Uint32 start = SDL_GetTicks();
+	WorkerPool pool(std::min(m_concurrency, (int)m_jobs.size()));
+	std::vector<WorkerPool::Task> tasks;
+	for (int i = 0; i < (int)m_jobs.size(); i ++) {
+		tasks.push_back(boost::bind(&RenderQueue::runJob, this, i));
+	}
+	pool.run(tasks);
+	m_seconds = (SDL_GetTicks() - start) / 1000.0;
+
+	for (std::vector<Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++ it) {
+		if (!(*it).succeeded) return false;
+	}
+	return true;
+}
+
+// Stops the jobs that are running after the frame they're on, and skips the rest.
+void RenderQueue::cancel(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_cancelled = true;
+	for (std::vector<Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++ it) {
+		if ((*it).animation != NULL) (*it).animation->cancel();
+	}
+}
+
+std::string RenderQueue::summary(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	int succeeded = 0;
+	std::string failed;
+	for (std::vector<Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++ it) {
+		if ((*it).succeeded) succeeded ++;
+		else failed += (failed.empty() ? "" : ", ") + (*it).sceneFile;
+	}
+
+	std::string summary = (boost::format("Rendered %i of %i scenes in %.1fs, %i at a time") % succeeded % m_jobs.size() % m_seconds % std::min(m_concurrency, (int)m_jobs.size())).str();
+	if (!failed.empty()) summary += "; failed or skipped: " + failed;
+	return summary;
+}
+
+void RenderQueue::runJob(int jobIndex)
+{
+	Job &job = m_jobs[jobIndex];
+	int jobCount = (int)m_jobs.size();
+	Uint32 start = SDL_GetTicks();
+
+	Animation animation;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (m_cancelled) {
+			m_finishedCount ++;
+			return;
+		}
+		job.animation = &animation;
+	}
+
+	for (boost::property_tree::ptree::const_iterator it = m_options.begin(); it != m_options.end(); ++ it) {
+		animation.setOption(it->first, it->second.data());
+	}
+	// Jobs running at once mustn't share a mapped frame store's file, and their
+	// tile pools and writers share the cores between them.
+	int cores = std::max(1, (int)boost::thread::hardware_concurrency());
+	int threadsPerJob = std::max(1, cores / std::min(m_concurrency, jobCount));
+	animation.setOption("framecache", job.outputDirectory + "/animation.frames");
+	if (m_options.find("tilethreads") == m_options.not_found()) {
+		animation.setOption("tilethreads", boost::lexical_cast<std::string>(threadsPerJob));
+	}
+
+	g_console.print(boost::format("Queue job %i of %i: rendering %s into %s") % (jobIndex + 1) % jobCount % job.sceneFile % job.outputDirectory);
+	boost::system::error_code error;
+	boost::filesystem::create_directories(job.outputDirectory, error);
+	if (error) {
+		g_console.print(boost::format("Could not create %s: %s") % job.outputDirectory % error.message());
+	}
+	bool succeeded = !error && animation.load(job.sceneFile);
+	if (succeeded && m_blend) {
+		animation.blendFrames();
+	}
+	if (succeeded && !animation.cancelled()) {
+		boost::scoped_ptr<FrameWriter> writer(m_writerFactory(animation, job.outputDirectory));
+		AsyncFrameWriter asyncWriter(*writer, threadsPerJob);
+		succeeded = animation.save(asyncWriter);
+	}
+	else {
+		succeeded = false;
+	}
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	job.animation = NULL;
+	job.succeeded = succeeded && !m_cancelled;
+	job.frameCount = animation.frames().size();
+	job.seconds = (SDL_GetTicks() - start) / 1000.0;
+	m_finishedCount ++;
+	g_console.print(boost::format("Queue job %i of %i: %s %s in %.1fs (%i frames), %i of %i jobs finished")
+		% (jobIndex + 1) % jobCount % (job.succeeded ? "rendered" : "failed") % job.sceneFile % job.seconds % job.frameCount % m_finishedCount % jobCount);
+}
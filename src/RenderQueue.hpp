@@ -0,0 +1,64 @@
+#ifndef RENDERQUEUE_HPP
+#define RENDERQUEUE_HPP
+
+#include <string>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+#include "Animation.hpp"
+#include "FrameWriter.hpp"
+
+// Renders a list of scenes, each with an Animation of its own, several at a
+// time on one WorkerPool. Every job loads, optionally blends and saves its
+// scene into <outputDirectory>/<scene name>; the images they use are decoded
+// once into the shared g_imageCache. A failed job doesn't stop the others.
+class RenderQueue
+{
+public:
+	// Makes the writer a job saves through, given its output directory.
+	typedef boost::function<FrameWriter *(Animation &animation, std::string outputDirectory)> WriterFactory;
+
+	RenderQueue(WriterFactory writerFactory, std::string outputDirectory = "output", int concurrency = 0);
+	virtual ~RenderQueue();
+
+	void add(std::string sceneFile);
+	void options(const boost::property_tree::ptree &options);
+	void blend(bool enabled);
+	bool run(void);
+	void cancel(void);
+	int jobCount(void);
+	int concurrency(void);
+	std::string summary(void);
+private:
+	class Job
+	{
+	public:
+		Job(std::string sceneFile, std::string outputDirectory) :
+			sceneFile(sceneFile), outputDirectory(outputDirectory), animation(NULL), succeeded(false), frameCount(0), seconds(0.0)
+		{
+		}
+
+		std::string sceneFile;
+		std::string outputDirectory;
+		Animation *animation; // While it runs, so cancel() can reach it.
+		bool succeeded;
+		int frameCount;
+		double seconds;
+	};
+
+	WriterFactory m_writerFactory;
+	std::string m_outputDirectory;
+	int m_concurrency;
+	boost::property_tree::ptree m_options;
+	bool m_blend;
+	std::vector<Job> m_jobs;
+	boost::mutex m_mutex; // Guards the jobs' progress and m_cancelled while run() is going.
+	bool m_cancelled;
+	int m_finishedCount;
+	double m_seconds;
+
+	void runJob(int jobIndex);
+};
+
+#endif // RENDERQUEUE_HPP
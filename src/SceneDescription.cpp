@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include "Console.hpp"
+#include "SceneDescription.hpp"
+
+namespace {
+	// Numbers in a .scene file are little-endian; swaps one in place on machines that aren't.
+	void toLittleEndian(void *data, size_t size)
+	{
+		if (SDL_BYTEORDER == SDL_BIG_ENDIAN) std::reverse((Uint8 *)data, (Uint8 *)data + size);
+	}
+
+	// Appends values to a byte buffer: numbers little-endian, bytes as they are.
+	class Writer
+	{
+	public:
+		std::vector<Uint8> bytes;
+
+		void put(const void *data, size_t size) {
+			bytes.insert(bytes.end(), (const Uint8 *)data, (const Uint8 *)data + size);
+		}
+
+		template <typename T> void put(T value) {
+			toLittleEndian(&value, sizeof(value));
+			put(&value, sizeof(value));
+		}
+
+		void put(const std::string &value) {
+			put((Uint32)value.size());
+			put(value.data(), value.size());
+		}
+	};
+
+	// Reads back what Writer wrote, failing instead of reading past the end.
+	class Reader
+	{
+	public:
+		Reader(const std::vector<Uint8> &bytes) :
+			m_position(bytes.empty() ? NULL : &bytes[0]), m_end(m_position + bytes.size()), m_failed(false)
+		{
+		}
+
+		bool get(void *data, size_t size) {
+			if (m_failed || (size_t)(m_end - m_position) < size) {
+				m_failed = true;
+				return false;
+			}
+			memcpy(data, m_position, size);
+			m_position += size;
+			return true;
+		}
+
+		template <typename T> void get(T &value) {
+			if (get(&value, sizeof(value))) toLittleEndian(&value, sizeof(value));
+		}
+
+		void get(std::string &value) {
+			Uint32 size = 0;
+			get(size);
+			if (m_failed || (size_t)(m_end - m_position) < size) {
+				m_failed = true;
+				return;
+			}
+			value.assign((const char *)m_position, size);
+			m_position += size;
+		}
+
+		void get(bool &value) {
+			Uint8 byte = 0;
+			get(&byte, 1);
+			value = byte != 0;
+		}
+
+		bool failed(void) {
+			return m_failed;
+		}
+
+		size_t remaining(void) {
+			return m_end - m_position;
+		}
+	private:
+		const Uint8 *m_position;
+		const Uint8 *m_end;
+		bool m_failed;
+	};
+
+	// A [r, g, b] array, or false when key is missing or has fewer than 3 values.
+	bool readColor(const boost::property_tree::ptree &tree, const char *key, double defaultValue, double rgb[3])
+	{
+		boost::optional<const boost::property_tree::ptree &> values = tree.get_child_optional(key);
+		if (!values || (*values).size() < 3) return false;
+
+		boost::property_tree::ptree::const_iterator it = (*values).begin();
+		for (int channel = 0; channel < 3; channel ++, ++ it) {
+			rgb[channel] = (it->second).get_value(defaultValue);
+		}
+		return true;
+	}
+
+	// Bytes an image name takes at least, and an object record exactly.
+	const size_t IMAGE_RECORD_SIZE = sizeof(Uint32);
+	const size_t OBJECT_RECORD_SIZE = 3 * sizeof(Uint8) + sizeof(Uint32) + 9 * sizeof(double);
+
+	double milliseconds(Uint64 start, Uint64 end)
+	{
+		return (end - start) * 1000.0 / SDL_GetPerformanceFrequency();
+	}
+}
+
+SceneDescription::SceneDescription() :
+	readMilliseconds(0.0), compileMilliseconds(0.0),
+	width(512), height(512), framerate(320.0), physicsRate(0.0), outputRate(0.0), animationLength(320.0), gravityX(0.0), gravityY(0.0),
+	hasBackgroundColor(false), cameraX(0.0), cameraY(0.0), zoom(1.0), blendFrames(16), blendCurve("sine"), blendStep(0),
+	frameStore("memory"), frameCache("output/animation.frames"), trajectoryCache("output/trajectories"), dirtyRects(false), batchDraw(false),
+	spriteAngleStep(0.0), shadowScale(1), tiles(1), tileThreads(0), lazyPreview(false), lazyWindow(8)
+{
+	backgroundColor[0] = backgroundColor[1] = backgroundColor[2] = 0.0;
+}
+
+// Reads a JSON or binary scene and applies the overrides on top of it.
+bool SceneDescription::read(std::string filename, const boost::property_tree::ptree &overrides, std::string &error)
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	if (isBinary(filename)) {
+		if (!readBinary(filename, error)) return false;
+		Uint64 read = SDL_GetPerformanceCounter();
+		if (!compile(overrides, error)) return false;
+		readMilliseconds = milliseconds(start, read);
+		compileMilliseconds = milliseconds(read, SDL_GetPerformanceCounter());
+		return true;
+	}
+
+	boost::property_tree::ptree tree;
+	try {
+		boost::property_tree::json_parser::read_json(filename, tree);
+	}
+	catch (boost::property_tree::ptree_error &e) {
+		error = e.what();
+		return false;
+	}
+	for (boost::property_tree::ptree::const_iterator it = overrides.begin(); it != overrides.end(); ++ it) {
+		tree.put_child(it->first, it->second);
+	}
+
+	Uint64 read = SDL_GetPerformanceCounter();
+	if (!compile(tree, error)) return false;
+	readMilliseconds = milliseconds(start, read);
+	compileMilliseconds = milliseconds(read, SDL_GetPerformanceCounter());
+	return true;
+}
+
+bool SceneDescription::compile(const boost::property_tree::ptree &tree, std::string &error)
+{
+	width = tree.get("width", width);
+	height = tree.get("height", height);
+	framerate = tree.get("framerate", framerate);
+	physicsRate = tree.get("physicsrate", physicsRate);
+	outputRate = tree.get("outputrate", outputRate);
+	animationLength = tree.get("animationlength", animationLength);
+	gravityX = tree.get("gravityx", gravityX);
+	gravityY = tree.get("gravityy", gravityY);
+	background = tree.get("background", background);
+	if (readColor(tree, "backgroundcolor", 0.0, backgroundColor)) hasBackgroundColor = true;
+	cameraX = tree.get("camerax", cameraX);
+	cameraY = tree.get("cameray", cameraY);
+	zoom = tree.get("zoom", zoom);
+	blendFrames = tree.get("blendframes", blendFrames);
+	blendCurve = tree.get("blendcurve", blendCurve);
+	blendStep = tree.get("blendstep", blendStep);
+	frameStore = tree.get("framestore", frameStore);
+	frameCache = tree.get("framecache", frameCache);
+	trajectoryCache = tree.get("trajectorycache", trajectoryCache);
+	dirtyRects = tree.get("dirtyrects", dirtyRects);
+	batchDraw = tree.get("batchdraw", batchDraw);
+	spriteAngleStep = tree.get("spriteanglestep", spriteAngleStep);
+	shadowScale = tree.get("shadowscale", shadowScale);
+	tiles = tree.get("tiles", tiles);
+	tileThreads = tree.get("tilethreads", tileThreads);
+	lazyPreview = tree.get("lazypreview", lazyPreview);
+	lazyWindow = tree.get("lazywindow", lazyWindow);
+
+	boost::optional<const boost::property_tree::ptree &> objectsTree = tree.get_child_optional("objects");
+	if (!objectsTree) return validate(error);
+
+	objects.clear();
+	objects.reserve((*objectsTree).size());
+	int skipped = 0;
+	for (boost::property_tree::ptree::const_iterator it = (*objectsTree).begin(); it != (*objectsTree).end(); ++ it) {
+		const boost::property_tree::ptree &objectTree = it->second;
+		ObjectDescription object;
+		std::string type = objectTree.get("type", "");
+		if (type == "box") object.type = ObjectDescription::BOX;
+		else if (type == "circle") object.type = ObjectDescription::CIRCLE;
+		else {
+			skipped ++;
+			continue;
+		}
+
+		object.x = objectTree.get("x", 0.0);
+		object.y = objectTree.get("y", 0.0);
+		object.density = objectTree.get("density", 1.0);
+		object.vx = objectTree.get("vx", 0.0);
+		object.vy = objectTree.get("vy", 0.0);
+		object.image = objectTree.get("image", "");
+		object.light = objectTree.get("light", false);
+		object.lightRadius = objectTree.get("lightradius", 16.0);
+		double rgb[3];
+		if (readColor(objectTree, "lightcolor", 255.0, rgb)) {
+			object.tinted = true;
+			object.red = rgb[0] / 255.0;
+			object.green = rgb[1] / 255.0;
+			object.blue = rgb[2] / 255.0;
+		}
+		objects.push_back(object);
+	}
+
+	if (skipped > 0) {
+		g_console.print(boost::format("Skipped %i objects that aren't a box or a circle") % skipped);
+	}
+
+	return validate(error);
+}
+
+// Checks and clamps what compile() left, whether it came from JSON or a .scene file.
+bool SceneDescription::validate(std::string &error)
+{
+	if (width <= 0 || height <= 0) {
+		error = (boost::format("width and height must be positive, got %ix%i") % width % height).str();
+		return false;
+	}
+	if (framerate <= 0.0 || animationLength < 0.0) {
+		error = (boost::format("framerate must be positive and animationlength not negative, got %g and %g") % framerate % animationLength).str();
+		return false;
+	}
+
+	for (std::vector<ObjectDescription>::iterator it = objects.begin(); it != objects.end(); ++ it) {
+		(*it).lightRadius = std::max(0.1, (*it).lightRadius);
+	}
+	return true;
+}
+
+bool SceneDescription::readBinary(std::string filename, std::string &error)
+{
+	std::vector<Uint8> bytes;
+	{
+		std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+		if (!file) {
+			error = "could not open " + filename;
+			return false;
+		}
+		bytes.resize((size_t)file.tellg());
+		file.seekg(0);
+		if (!bytes.empty()) file.read((char *)&bytes[0], bytes.size());
+		if (!file) {
+			error = "could not read " + filename;
+			return false;
+		}
+	}
+
+	Reader reader(bytes);
+	char magic[8];
+	Uint32 version = 0;
+	Uint32 objectCount = 0;
+	Uint32 imageCount = 0;
+	reader.get(magic, sizeof(magic));
+	reader.get(version);
+	reader.get(objectCount);
+	reader.get(imageCount);
+	if (reader.failed() || memcmp(magic, "BOXSCENE", 8) != 0 || version != VERSION) {
+		error = filename + " isn't a version " + boost::lexical_cast<std::string>(VERSION) + " binary scene";
+		return false;
+	}
+
+	reader.get(width);
+	reader.get(height);
+	reader.get(framerate);
+	reader.get(physicsRate);
+	reader.get(outputRate);
+	reader.get(animationLength);
+	reader.get(gravityX);
+	reader.get(gravityY);
+	reader.get(background);
+	reader.get(hasBackgroundColor);
+	for (int channel = 0; channel < 3; channel ++) {
+		reader.get(backgroundColor[channel]);
+	}
+	reader.get(cameraX);
+	reader.get(cameraY);
+	reader.get(zoom);
+	reader.get(blendFrames);
+	reader.get(blendCurve);
+	reader.get(blendStep);
+	reader.get(frameStore);
+	reader.get(frameCache);
+	reader.get(trajectoryCache);
+	reader.get(dirtyRects);
+	reader.get(batchDraw);
+	reader.get(spriteAngleStep);
+	reader.get(shadowScale);
+	reader.get(tiles);
+	reader.get(tileThreads);
+	reader.get(lazyPreview);
+	reader.get(lazyWindow);
+
+	// The counts come from the file, so check the records are there before making room for them.
+	if (reader.failed() || (Uint64)imageCount * IMAGE_RECORD_SIZE + (Uint64)objectCount * OBJECT_RECORD_SIZE > reader.remaining()) {
+		error = filename + " is cut short";
+		return false;
+	}
+
+	std::vector<std::string> images(imageCount);
+	for (Uint32 i = 0; i < imageCount; i ++) {
+		reader.get(images[i]);
+	}
+
+	objects.resize(objectCount);
+	for (Uint32 i = 0; i < objectCount && !reader.failed(); i ++) {
+		ObjectDescription &object = objects[i];
+		Uint8 type = 0;
+		Uint32 image = 0;
+		reader.get(type);
+		reader.get(image);
+		reader.get(object.light);
+		reader.get(object.tinted);
+		reader.get(object.x);
+		reader.get(object.y);
+		reader.get(object.density);
+		reader.get(object.vx);
+		reader.get(object.vy);
+		reader.get(object.lightRadius);
+		reader.get(object.red);
+		reader.get(object.green);
+		reader.get(object.blue);
+		if (type > ObjectDescription::CIRCLE || image >= imageCount) {
+			error = (boost::format("%s has a bad object at %i") % filename % i).str();
+			return false;
+		}
+		object.type = (ObjectDescription::Type)type;
+		object.image = images[image];
+	}
+
+	if (reader.failed()) {
+		error = filename + " is cut short";
+		return false;
+	}
+
+	return true;
+}
+
+bool SceneDescription::writeBinary(std::string filename, std::string &error)
+{
+	// Each image name is stored once and objects refer to it by index.
+	std::map<std::string, Uint32> imageIndices;
+	std::vector<std::string> images;
+	for (std::vector<ObjectDescription>::const_iterator it = objects.begin(); it != objects.end(); ++ it) {
+		if (imageIndices.find((*it).image) == imageIndices.end()) {
+			imageIndices[(*it).image] = images.size();
+			images.push_back((*it).image);
+		}
+	}
+
+	Writer writer;
+	writer.put("BOXSCENE", 8);
+	writer.put((Uint32)VERSION);
+	writer.put((Uint32)objects.size());
+	writer.put((Uint32)images.size());
+
+	writer.put(width);
+	writer.put(height);
+	writer.put(framerate);
+	writer.put(physicsRate);
+	writer.put(outputRate);
+	writer.put(animationLength);
+	writer.put(gravityX);
+	writer.put(gravityY);
+	writer.put(background);
+	writer.put((Uint8)hasBackgroundColor);
+	for (int channel = 0; channel < 3; channel ++) {
+		writer.put(backgroundColor[channel]);
+	}
+	writer.put(cameraX);
+	writer.put(cameraY);
+	writer.put(zoom);
+	writer.put(blendFrames);
+	writer.put(blendCurve);
+	writer.put(blendStep);
+	writer.put(frameStore);
+	writer.put(frameCache);
+	writer.put(trajectoryCache);
+	writer.put((Uint8)dirtyRects);
+	writer.put((Uint8)batchDraw);
+	writer.put(spriteAngleStep);
+	writer.put(shadowScale);
+	writer.put(tiles);
+	writer.put(tileThreads);
+	writer.put((Uint8)lazyPreview);
+	writer.put(lazyWindow);
+
+	for (std::vector<std::string>::const_iterator it = images.begin(); it != images.end(); ++ it) {
+		writer.put(*it);
+	}
+
+	for (std::vector<ObjectDescription>::const_iterator it = objects.begin(); it != objects.end(); ++ it) {
+		const ObjectDescription &object = *it;
+		writer.put((Uint8)object.type);
+		writer.put(imageIndices[object.image]);
+		writer.put((Uint8)object.light);
+		writer.put((Uint8)object.tinted);
+		writer.put(object.x);
+		writer.put(object.y);
+		writer.put(object.density);
+		writer.put(object.vx);
+		writer.put(object.vy);
+		writer.put(object.lightRadius);
+		writer.put(object.red);
+		writer.put(object.green);
+		writer.put(object.blue);
+	}
+
+	std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	file.write((const char *)&writer.bytes[0], writer.bytes.size());
+	if (!file) {
+		error = "could not write " + filename;
+		return false;
+	}
+
+	return true;
+}
+
+bool SceneDescription::isBinary(std::string filename)
+{
+	return boost::filesystem::path(filename).extension() == ".scene";
+}
@@ -0,0 +1,93 @@
+#ifndef SCENEDESCRIPTION_HPP
+#define SCENEDESCRIPTION_HPP
+
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include <SDL2/SDL.h>
+
+// One entry of a scene's "objects".
+class ObjectDescription
+{
+public:
+	enum Type { BOX, CIRCLE };
+
+	ObjectDescription() :
+		type(BOX), x(0.0), y(0.0), density(1.0), vx(0.0), vy(0.0), light(false), lightRadius(16.0), tinted(false), red(1.0), green(1.0), blue(1.0)
+	{
+	}
+
+	Type type;
+	double x;
+	double y;
+	double density;
+	double vx;
+	double vy;
+	std::string image;
+	bool light;
+	double lightRadius;
+	bool tinted; // Whether lightcolor was given.
+	double red; // Light colour, 0 to 1.
+	double green;
+	double blue;
+};
+
+// Every scene setting, read and checked once so loading and rendering never
+// look anything up by name. Settings missing from the JSON keep their current
+// values, so compile() also applies "set" overrides on top of a scene.
+//
+// A scene can also be kept in a compact binary form (.scene, written with
+// boxes --compile) that is read in one go and needs no JSON parsing: a
+// "BOXSCENE" header, the settings, a table of image names and then one fixed
+// size record per object. Numbers are little-endian, so a .scene file loads on
+// any machine.
+class SceneDescription
+{
+public:
+	SceneDescription();
+
+	bool read(std::string filename, const boost::property_tree::ptree &overrides, std::string &error);
+	bool compile(const boost::property_tree::ptree &tree, std::string &error);
+	bool readBinary(std::string filename, std::string &error);
+	bool writeBinary(std::string filename, std::string &error);
+	static bool isBinary(std::string filename);
+
+	double readMilliseconds; // Time read() spent on the file and on compile(), for load metrics.
+	double compileMilliseconds;
+
+	int width;
+	int height;
+	double framerate;
+	double physicsRate; // 0 for the same as framerate.
+	double outputRate; // 0 for the same as framerate.
+	double animationLength;
+	double gravityX;
+	double gravityY;
+	std::string background;
+	bool hasBackgroundColor;
+	double backgroundColor[3]; // 0 to 255.
+	double cameraX;
+	double cameraY;
+	double zoom;
+	int blendFrames;
+	std::string blendCurve;
+	int blendStep;
+	std::string frameStore;
+	std::string frameCache;
+	std::string trajectoryCache;
+	bool dirtyRects;
+	bool batchDraw;
+	double spriteAngleStep; // Degrees.
+	int shadowScale;
+	int tiles;
+	int tileThreads; // 0 for one per core.
+	bool lazyPreview;
+	int lazyWindow;
+	std::vector<ObjectDescription> objects;
+private:
+	bool validate(std::string &error);
+
+	static const Uint32 VERSION = 2;
+};
+
+#endif // SCENEDESCRIPTION_HPP
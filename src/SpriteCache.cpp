@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <boost/format.hpp>
+#include <SDL2/SDL.h>
+#include "SpriteCache.hpp"
+
+SpriteCache::SpriteCache() :
+	m_memoryUsage(0), m_limit(DEFAULT_LIMIT), m_users(0), m_hits(0), m_misses(0)
+{
+}
+
+SpriteCache::~SpriteCache()
+{
+	clear();
+}
+
+const Sprite *SpriteCache::get(std::string image, cairo_pattern_t *pattern, double imageSize, double scale, double angle, double angleStep)
+{
+	double quantized = quantize(angle, angleStep);
+	Key key(image, (long long)std::floor(scale * 1e6 + 0.5), angleKey(angle, angleStep));
+
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		std::map<Key, Sprite>::iterator it = m_sprites.find(key);
+		if (it != m_sprites.end()) {
+			m_hits ++;
+			it->second.lastUsed = m_hits + m_misses;
+			return &it->second;
+		}
+		m_misses ++;
+	}
+
+	// Draw outside the lock; if another thread got there first, keep theirs.
+	Sprite sprite = render(pattern, imageSize, scale, quantized);
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	sprite.lastUsed = m_hits + m_misses;
+	std::pair<std::map<Key, Sprite>::iterator, bool> inserted = m_sprites.insert(std::make_pair(key, sprite));
+	if (inserted.second) {
+		m_memoryUsage += cairo_image_surface_get_stride(sprite.surface) * cairo_image_surface_get_height(sprite.surface);
+	}
+	else {
+		cairo_surface_destroy(sprite.surface);
+	}
+
+	return &inserted.first->second;
+}
+
+// The angle of the sprite drawn for angle. Angles wrap, so 0 and 2 pi share a sprite.
+double SpriteCache::quantize(double angle, double angleStep)
+{
+	double turn = 2.0 * M_PI;
+	double quantized = std::floor(angle / angleStep + 0.5) * angleStep;
+	quantized -= std::floor(quantized / turn) * turn;
+	if (quantized > turn - angleStep / 2.0) quantized = 0.0;
+	return quantized;
+}
+
+// quantize() in millionths, exact enough to key sprites by.
+long long SpriteCache::angleKey(double angle, double angleStep)
+{
+	return (long long)std::floor(quantize(angle, angleStep) * 1e6 + 0.5);
+}
+
+void SpriteCache::clear(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	for (std::map<Key, Sprite>::iterator it = m_sprites.begin(); it != m_sprites.end(); ++ it) {
+		cairo_surface_destroy(it->second.surface);
+	}
+	m_sprites.clear();
+	m_memoryUsage = 0;
+}
+
+// Most memory the sprites may take once nothing is using them.
+void SpriteCache::limit(size_t bytes)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_limit = bytes;
+	if (m_users == 0) evict();
+}
+
+void SpriteCache::beginUse(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_users ++;
+}
+
+void SpriteCache::endUse(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (-- m_users == 0 && m_memoryUsage > m_limit) evict();
+}
+
+// Frees the least recently used sprites until they fit the limit. Called
+// with m_mutex held and no Use outstanding.
+void SpriteCache::evict(void)
+{
+	std::vector< std::pair<long long, Key> > byAge;
+	for (std::map<Key, Sprite>::iterator it = m_sprites.begin(); it != m_sprites.end(); ++ it) {
+		byAge.push_back(std::make_pair(it->second.lastUsed, it->first));
+	}
+	std::sort(byAge.begin(), byAge.end());
+
+	for (size_t i = 0; i < byAge.size() && m_memoryUsage > m_limit; i ++) {
+		std::map<Key, Sprite>::iterator it = m_sprites.find(byAge[i].second);
+		cairo_surface_t *surface = it->second.surface;
+		m_memoryUsage -= cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+		cairo_surface_destroy(surface);
+		m_sprites.erase(it);
+	}
+}
+
+int SpriteCache::spriteCount(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_sprites.size();
+}
+
+size_t SpriteCache::memoryUsage(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_memoryUsage;
+}
+
+double SpriteCache::hitRate(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	long long lookups = m_hits + m_misses;
+	return lookups > 0 ? (double)m_hits / lookups : 0.0;
+}
+
+void SpriteCache::resetStatistics(void)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_hits = 0;
+	m_misses = 0;
+}
+
+std::string SpriteCache::summary(void)
+{
+	return (boost::format("Sprite cache: %i sprites, %.1f KiB, %.1f%% hits") % spriteCount() % (memoryUsage() / 1024.0) % (hitRate() * 100.0)).str();
+}
+
+// Fills the object's square the same way Animation::rasterizeRegion does,
+// only centred in a surface just big enough for it at this angle.
+Sprite SpriteCache::render(cairo_pattern_t *pattern, double imageSize, double scale, double angle)
+{
+	double halfSize = imageSize * scale;
+	double extent = halfSize * (std::fabs(std::cos(angle)) + std::fabs(std::sin(angle)));
+	int size = (int)std::ceil(extent * 2.0) + 2; // A pixel of margin for antialiasing.
+
+	Sprite sprite;
+	sprite.surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+	SDL_assert(cairo_surface_status(sprite.surface) == CAIRO_STATUS_SUCCESS);
+	sprite.originX = size / 2.0;
+	sprite.originY = size / 2.0;
+
+	cairo_t *cr = cairo_create(sprite.surface);
+	cairo_translate(cr, sprite.originX, sprite.originY);
+	cairo_scale(cr, scale, scale);
+	cairo_rotate(cr, angle);
+	cairo_set_source(cr, pattern);
+	cairo_rectangle(cr, -imageSize, -imageSize, 2.0 * imageSize, 2.0 * imageSize);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+
+	return sprite;
+}
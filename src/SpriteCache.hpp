@@ -0,0 +1,73 @@
+#ifndef SPRITECACHE_HPP
+#define SPRITECACHE_HPP
+
+#include <map>
+#include <string>
+#include <boost/thread.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+#include <cairo/cairo.h>
+
+// An object's image already scaled and rotated to how it appears in a frame,
+// as premultiplied ARGB32. originX, originY is where the object's centre lands.
+class Sprite
+{
+public:
+	cairo_surface_t *surface;
+	double originX;
+	double originY;
+	long long lastUsed; // Lookup count at the last hit, for eviction.
+};
+
+// Sprites keyed by image, device scale and angle rounded to a multiple of the
+// angle step, so drawing an object is a blit instead of resampling the full
+// size image through the view matrix. Safe to use from several rasterizer
+// threads. Sprites stay valid until clear(), and while a Use is held; once
+// the last Use goes, the least recently used sprites above the memory limit
+// are freed.
+class SpriteCache
+{
+public:
+	// Held by whoever keeps pointers from get(), e.g. for drawing one region.
+	class Use
+	{
+	public:
+		Use(SpriteCache &cache) : m_cache(cache) { m_cache.beginUse(); }
+		~Use() { m_cache.endUse(); }
+	private:
+		SpriteCache &m_cache;
+	};
+
+	static const size_t DEFAULT_LIMIT = 256 * 1024 * 1024;
+
+	SpriteCache();
+	virtual ~SpriteCache();
+
+	const Sprite *get(std::string image, cairo_pattern_t *pattern, double imageSize, double scale, double angle, double angleStep);
+	static double quantize(double angle, double angleStep);
+	static long long angleKey(double angle, double angleStep);
+	void clear(void);
+	void limit(size_t bytes);
+	int spriteCount(void);
+	size_t memoryUsage(void);
+	double hitRate(void);
+	void resetStatistics(void);
+	std::string summary(void);
+private:
+	typedef boost::tuple<std::string, long long, long long> Key;
+
+	std::map<Key, Sprite> m_sprites;
+	boost::mutex m_mutex;
+	size_t m_memoryUsage;
+	size_t m_limit;
+	int m_users;
+	long long m_hits;
+	long long m_misses;
+
+	void beginUse(void);
+	void endUse(void);
+	void evict(void);
+	static Sprite render(cairo_pattern_t *pattern, double imageSize, double scale, double angle);
+};
+
+#endif // SPRITECACHE_HPP
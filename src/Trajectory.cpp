@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "Trajectory.hpp"
+
+Trajectory::Trajectory(int objectCount) :
+	m_objectCount(objectCount), m_stepCount(0)
+{
+}
+
+// 64 bit FNV-1a of the settings that affect the simulation: the Box2D
+// version, gravity, both rates, the length and each object's type, position,
+// density and velocity. Images and lights only change how objects look and
+// are left out.
+Uint64 Trajectory::key(const SceneDescription &scene, double physicsRate, double outputRate)
+{
+	std::vector<double> values;
+	values.push_back(VERSION);
+	values.push_back(b2_version.major);
+	values.push_back(b2_version.minor);
+	values.push_back(b2_version.revision);
+	values.push_back(scene.gravityX);
+	values.push_back(scene.gravityY);
+	values.push_back(physicsRate);
+	values.push_back(outputRate);
+	values.push_back(scene.animationLength);
+	for (std::vector<ObjectDescription>::const_iterator it = scene.objects.begin(); it != scene.objects.end(); ++ it) {
+		values.push_back((*it).type);
+		values.push_back((*it).x);
+		values.push_back((*it).y);
+		values.push_back((*it).density);
+		values.push_back((*it).vx);
+		values.push_back((*it).vy);
+	}
+
+	const unsigned char *bytes = (const unsigned char *)&values[0];
+	Uint64 hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < values.size() * sizeof(double); i ++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::string Trajectory::filename(std::string directory, Uint64 key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.traj", (unsigned long long)key);
+	return directory + "/" + name;
+}
+
+// Fails unless the file holds exactly stepCount steps of the same objects for the same key.
+bool Trajectory::load(std::string filename, Uint64 key, int stepCount)
+{
+	std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+	if (!file) return false;
+
+	Header header;
+	file.read((char *)&header, sizeof(header));
+	if (!file || memcmp(header.magic, "BOXTRAJ", 8) != 0 || header.version != VERSION || header.key != key) return false;
+	if ((int)header.objectCount != m_objectCount || (int)header.stepCount != stepCount) return false;
+
+	m_states.resize((size_t)m_objectCount * stepCount);
+	if (!m_states.empty()) {
+		file.read((char *)&m_states[0], m_states.size() * sizeof(ObjectState));
+	}
+	if (!file) {
+		m_states.clear();
+		return false;
+	}
+
+	m_stepCount = stepCount;
+	return true;
+}
+
+// Written next to the target and renamed over it, so an interrupted save never leaves a short file behind.
+bool Trajectory::save(std::string filename, Uint64 key)
+{
+	boost::system::error_code error;
+	boost::filesystem::create_directories(boost::filesystem::path(filename).parent_path(), error);
+
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "BOXTRAJ", 8);
+	header.version = VERSION;
+	header.objectCount = m_objectCount;
+	header.stepCount = stepCount();
+	header.key = key;
+
+	std::string temporary = filename + ".tmp";
+	{
+		std::ofstream file(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write((const char *)&header, sizeof(header));
+		if (!m_states.empty()) {
+			file.write((const char *)&m_states[0], m_states.size() * sizeof(ObjectState));
+		}
+		if (!file) {
+			g_console.print(boost::format("Could not write trajectory %s") % temporary);
+			return false;
+		}
+	}
+
+	boost::filesystem::rename(temporary, filename, error);
+	if (error) {
+		g_console.print(boost::format("Could not write trajectory %s: %s") % filename % error.message());
+		return false;
+	}
+
+	return true;
+}
+
+void Trajectory::add(const FrameState &state)
+{
+	SDL_assert((int)state.objects.size() == m_objectCount);
+	m_states.insert(m_states.end(), state.objects.begin(), state.objects.end());
+	m_stepCount ++;
+}
+
+void Trajectory::get(int step, FrameState &state)
+{
+	SDL_assert(step >= 0 && step < m_stepCount);
+	std::vector<ObjectState>::const_iterator first = m_states.begin() + (size_t)step * m_objectCount;
+	state.objects.assign(first, first + m_objectCount);
+}
+
+int Trajectory::stepCount(void)
+{
+	return m_stepCount;
+}
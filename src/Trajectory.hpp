@@ -0,0 +1,45 @@
+#ifndef TRAJECTORY_HPP
+#define TRAJECTORY_HPP
+
+#include <string>
+#include <vector>
+#include "Animation.hpp"
+
+// Every object's position and angle after each physics step of a simulation,
+// saved to <directory>/<key>.traj so the next load of the same physics can be
+// replayed instead of simulated. The key hashes only the scene settings that
+// affect the simulation, so moving the camera, zooming or changing images,
+// lights or the frame size still finds the cached run.
+class Trajectory
+{
+public:
+	Trajectory(int objectCount = 0);
+
+	static Uint64 key(const SceneDescription &scene, double physicsRate, double outputRate);
+	static std::string filename(std::string directory, Uint64 key);
+
+	bool load(std::string filename, Uint64 key, int stepCount);
+	bool save(std::string filename, Uint64 key);
+	void add(const FrameState &state);
+	void get(int step, FrameState &state);
+	int stepCount(void);
+private:
+	class Header
+	{
+	public:
+		char magic[8];
+		Uint32 version;
+		Uint32 objectCount;
+		Uint32 stepCount;
+		Uint32 reserved;
+		Uint64 key;
+	};
+
+	static const Uint32 VERSION = 3;
+
+	int m_objectCount;
+	int m_stepCount;
+	std::vector<ObjectState> m_states; // m_objectCount per step.
+};
+
+#endif // TRAJECTORY_HPP
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <boost/filesystem.hpp>
+#include "VideoStreamWriter.hpp"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VIDEOSTREAMWRITER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+	// Converts two rows into two rows of Y and one row of U and V, from an even
+	// first pixel on. row1 is the same as row0, and y1 NULL, for the last row
+	// of an odd height.
+	typedef void (*ConvertKernel)(const Uint32 *row0, const Uint32 *row1, int first, int width, Uint8 *y0, Uint8 *y1, Uint8 *u, Uint8 *v);
+
+	Uint8 luma(Uint32 pixel)
+	{
+		int r = (pixel >> 16) & 0xff;
+		int g = (pixel >> 8) & 0xff;
+		int b = pixel & 0xff;
+		return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+	}
+
+	void convertScalar(const Uint32 *row0, const Uint32 *row1, int first, int width, Uint8 *y0, Uint8 *y1, Uint8 *u, Uint8 *v)
+	{
+		for (int x = first; x < width; x ++) {
+			y0[x] = luma(row0[x]);
+			if (y1 != NULL) y1[x] = luma(row1[x]);
+		}
+
+		for (int x = first; x < width; x += 2) {
+			int x1 = std::min(x + 1, width - 1);
+			Uint32 pixels[4] = { row0[x], row0[x1], row1[x], row1[x1] };
+			int r = 0, g = 0, b = 0;
+			for (int i = 0; i < 4; i ++) {
+				r += (pixels[i] >> 16) & 0xff;
+				g += (pixels[i] >> 8) & 0xff;
+				b += pixels[i] & 0xff;
+			}
+			// Sums of 4 pixels, so shift by 2 more than for luma.
+			u[x / 2] = ((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128;
+			v[x / 2] = ((112 * r - 94 * g - 18 * b + 512) >> 10) + 128;
+		}
+	}
+
+#ifdef VIDEOSTREAMWRITER_X86
+	// Sums each pixel's pmaddwd pair (b * cb + g * cg, r * cr) and gathers the
+	// four results into one register.
+	__attribute__((target("sse2")))
+	inline __m128i dotPixels(__m128i low, __m128i high, __m128i coefficients)
+	{
+		__m128i a = _mm_madd_epi16(low, coefficients);
+		__m128i b = _mm_madd_epi16(high, coefficients);
+		a = _mm_add_epi32(a, _mm_srli_epi64(a, 32));
+		b = _mm_add_epi32(b, _mm_srli_epi64(b, 32));
+		return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0)), _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	__attribute__((target("sse2")))
+	inline int packBytes(__m128i values)
+	{
+		__m128i words = _mm_packs_epi32(values, values);
+		return _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+	}
+
+	// Four pixels of each row at a time; the two 2x2 blocks they cover give
+	// two U and two V samples.
+	__attribute__((target("sse2")))
+	void convertSse2(const Uint32 *row0, const Uint32 *row1, int first, int width, Uint8 *y0, Uint8 *y1, Uint8 *u, Uint8 *v)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i lumaCoefficients = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+		const __m128i uCoefficients = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+		const __m128i vCoefficients = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+		const __m128i lumaRound = _mm_set1_epi32(128);
+		const __m128i lumaOffset = _mm_set1_epi32(16);
+		const __m128i chromaRound = _mm_set1_epi32(512);
+		const __m128i chromaOffset = _mm_set1_epi32(128);
+		int x = first;
+		for (; x + 4 <= width; x += 4) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(row0 + x));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row1 + x));
+			__m128i aLow = _mm_unpacklo_epi8(a, zero);
+			__m128i aHigh = _mm_unpackhi_epi8(a, zero);
+			__m128i bLow = _mm_unpacklo_epi8(b, zero);
+			__m128i bHigh = _mm_unpackhi_epi8(b, zero);
+
+			__m128i luma0 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(dotPixels(aLow, aHigh, lumaCoefficients), lumaRound), 8), lumaOffset);
+			int packed = packBytes(luma0);
+			memcpy(y0 + x, &packed, 4);
+			if (y1 != NULL) {
+				__m128i luma1 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(dotPixels(bLow, bHigh, lumaCoefficients), lumaRound), 8), lumaOffset);
+				packed = packBytes(luma1);
+				memcpy(y1 + x, &packed, 4);
+			}
+
+			// Columns summed down the two rows, then across each pair of pixels.
+			__m128i low = _mm_add_epi16(aLow, bLow);
+			__m128i high = _mm_add_epi16(aHigh, bHigh);
+			__m128i blocks = _mm_unpacklo_epi64(_mm_add_epi16(low, _mm_srli_si128(low, 8)), _mm_add_epi16(high, _mm_srli_si128(high, 8)));
+			__m128i us = _mm_madd_epi16(blocks, uCoefficients);
+			__m128i vs = _mm_madd_epi16(blocks, vCoefficients);
+			us = _mm_add_epi32(us, _mm_srli_epi64(us, 32));
+			vs = _mm_add_epi32(vs, _mm_srli_epi64(vs, 32));
+			__m128i chroma = _mm_unpacklo_epi64(_mm_shuffle_epi32(us, _MM_SHUFFLE(3, 1, 2, 0)), _mm_shuffle_epi32(vs, _MM_SHUFFLE(3, 1, 2, 0)));
+			chroma = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(chroma, chromaRound), 10), chromaOffset);
+			packed = packBytes(chroma);
+			u[x / 2] = packed & 0xff;
+			u[x / 2 + 1] = (packed >> 8) & 0xff;
+			v[x / 2] = (packed >> 16) & 0xff;
+			v[x / 2 + 1] = (packed >> 24) & 0xff;
+		}
+
+		convertScalar(row0, row1, x, width, y0, y1, u, v);
+	}
+#endif
+
+	ConvertKernel selectKernel(std::string &name)
+	{
+#ifdef VIDEOSTREAMWRITER_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2")) {
+			name = "sse2";
+			return convertSse2;
+		}
+#endif
+		name = "scalar";
+		return convertScalar;
+	}
+
+	std::string g_kernelName;
+	ConvertKernel g_kernel = selectKernel(g_kernelName);
+
+	int greatestCommonDivisor(int a, int b)
+	{
+		while (b != 0) {
+			int remainder = a % b;
+			a = b;
+			b = remainder;
+		}
+		return a;
+	}
+}
+
+VideoStreamWriter::VideoStreamWriter(std::string target, std::string container, std::string pixelFormat) :
+	m_target(target), m_container(container), m_pixelFormat(container == "y4m" ? "i420" : pixelFormat), m_file(NULL), m_width(0), m_height(0)
+{
+}
+
+VideoStreamWriter::~VideoStreamWriter()
+{
+	if (m_file != NULL && m_file != stdout) fclose(m_file);
+}
+
+bool VideoStreamWriter::begin(int width, int height, int frameCount, double framerate)
+{
+	m_width = width;
+	m_height = height;
+
+#ifdef SIGPIPE
+	// A reader that goes away should fail the write, not kill the process.
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	if (m_target == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		m_file = stdout;
+	}
+	else {
+		boost::system::error_code error;
+		if (boost::filesystem::status(m_target, error).type() == boost::filesystem::fifo_file) {
+			g_console.print(boost::format("Waiting for a reader on %s") % m_target);
+		}
+		m_file = fopen(m_target.c_str(), "wb");
+		if (m_file == NULL) {
+			g_console.print(boost::format("Could not open '%s' for writing") % m_target);
+			return false;
+		}
+	}
+
+	if (m_pixelFormat == "i420") {
+		int chromaSize = ((width + 1) / 2) * ((height + 1) / 2);
+		m_planes.resize(width * height + 2 * chromaSize);
+	}
+
+	if (m_container == "y4m") {
+		// Framerate as an exact fraction in thousandths.
+		int numerator = std::max(1, (int)(framerate * 1000.0 + 0.5));
+		int denominator = 1000;
+		int divisor = greatestCommonDivisor(numerator, denominator);
+		std::string header = (boost::format("YUV4MPEG2 W%i H%i F%i:%i Ip A1:1 C420jpeg\n") % width % height % (numerator / divisor) % (denominator / divisor)).str();
+		if (!put(header.data(), header.size())) return false;
+	}
+
+	return true;
+}
+
+bool VideoStreamWriter::write(FramePtr frame, int frameIndex)
+{
+	SDL_Surface *surface = frame->surface();
+	if (m_container == "y4m" && !put("FRAME\n", 6)) return false;
+
+	if (m_pixelFormat == "i420") {
+		convert(surface);
+		if (!put(&m_planes[0], m_planes.size())) return false;
+	}
+	else if (surface->pitch == m_width * (int)sizeof(Uint32)) {
+		if (!put(surface->pixels, (size_t)surface->pitch * m_height)) return false;
+	}
+	else {
+		for (int y = 0; y < m_height; y ++) {
+			if (!put((const Uint8 *)surface->pixels + y * surface->pitch, m_width * sizeof(Uint32))) return false;
+		}
+	}
+
+	// Hand each frame to the reader as soon as it is complete.
+	if (fflush(m_file) != 0) {
+		g_console.print(boost::format("Error writing to %s") % m_target);
+		return false;
+	}
+
+	return true;
+}
+
+bool VideoStreamWriter::end(void)
+{
+	if (m_file == NULL) return true;
+
+	bool ok = fflush(m_file) == 0;
+	if (m_file != stdout) {
+		ok = fclose(m_file) == 0 && ok;
+	}
+	m_file = NULL;
+	if (!ok) {
+		g_console.print(boost::format("Error writing to %s") % m_target);
+	}
+	return ok;
+}
+
+bool VideoStreamWriter::validFormat(std::string container, std::string pixelFormat)
+{
+	if (container == "y4m") return pixelFormat == "i420";
+	if (container == "rawvideo") return pixelFormat == "i420" || pixelFormat == "bgra";
+	return false;
+}
+
+std::string VideoStreamWriter::kernelName(void)
+{
+	return g_kernelName;
+}
+
+void VideoStreamWriter::convert(SDL_Surface *surface)
+{
+	int chromaWidth = (m_width + 1) / 2;
+	Uint8 *yPlane = &m_planes[0];
+	Uint8 *uPlane = yPlane + m_width * m_height;
+	Uint8 *vPlane = uPlane + chromaWidth * ((m_height + 1) / 2);
+	for (int y = 0; y < m_height; y += 2) {
+		const Uint32 *row0 = (const Uint32 *)((const Uint8 *)surface->pixels + y * surface->pitch);
+		bool pair = y + 1 < m_height;
+		const Uint32 *row1 = pair ? (const Uint32 *)((const Uint8 *)row0 + surface->pitch) : row0;
+		g_kernel(row0, row1, 0, m_width, yPlane + y * m_width, pair ? yPlane + (y + 1) * m_width : NULL, uPlane + (y / 2) * chromaWidth, vPlane + (y / 2) * chromaWidth);
+	}
+}
+
+bool VideoStreamWriter::put(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, m_file) != size) {
+		g_console.print(boost::format("Error writing to %s") % m_target);
+		return false;
+	}
+
+	return true;
+}
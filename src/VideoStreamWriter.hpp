@@ -0,0 +1,44 @@
+#ifndef VIDEOSTREAMWRITER_HPP
+#define VIDEOSTREAMWRITER_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "FrameWriter.hpp"
+
+// Streams frames to stdout ("-"), a named pipe or a file for a video encoder
+// to read as they come, e.g.
+//
+//   boxes --stream --format y4m --output - scene.json | ffmpeg -i - out.mp4
+//
+// y4m is self-describing 4:2:0 (I420). rawvideo is headerless, either BGRA
+// rows as stored in frames (ffmpeg's -pix_fmt bgra) or I420 planes (yuv420p).
+// I420 uses BT.601 studio range, each chroma sample averaging a 2x2 block, and
+// is converted with an SSE2 kernel where available.
+class VideoStreamWriter : public FrameWriter
+{
+public:
+	VideoStreamWriter(std::string target, std::string container = "y4m", std::string pixelFormat = "i420");
+	virtual ~VideoStreamWriter();
+
+	virtual bool begin(int width, int height, int frameCount, double framerate);
+	virtual bool write(FramePtr frame, int frameIndex);
+	virtual bool end(void);
+	virtual bool sequential(void) { return true; }
+
+	static bool validFormat(std::string container, std::string pixelFormat);
+	static std::string kernelName(void);
+private:
+	std::string m_target;
+	std::string m_container;
+	std::string m_pixelFormat;
+	FILE *m_file;
+	int m_width;
+	int m_height;
+	std::vector<Uint8> m_planes; // Y, then U, then V.
+
+	void convert(SDL_Surface *surface);
+	bool put(const void *data, size_t size);
+};
+
+#endif // VIDEOSTREAMWRITER_HPP
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <cmath>
+#include "VisibilityPolygon.hpp"
+
+namespace {
+	double cross(const cml::vector2d &a, const cml::vector2d &b)
+	{
+		return a[0] * b[1] - a[1] * b[0];
+	}
+
+	bool leftOf(const VisibilityPolygon::Segment &segment, const cml::vector2d &point)
+	{
+		return cross(segment.second - segment.first, point - segment.first) < 0.0;
+	}
+
+	cml::vector2d interpolate(const cml::vector2d &a, const cml::vector2d &b, double f)
+	{
+		return a * (1.0 - f) + b * f;
+	}
+
+	// Cuts the segment down to the part inside the square around center
+	// (Liang-Barsky). Returns false if none of it is inside.
+	bool clip(VisibilityPolygon::Segment &segment, const cml::vector2d &center, double halfSize)
+	{
+		cml::vector2d start = segment.first - center;
+		cml::vector2d delta = segment.second - segment.first;
+		double t0 = 0.0;
+		double t1 = 1.0;
+		for (int axis = 0; axis < 2; axis ++) {
+			for (int side = -1; side <= 1; side += 2) {
+				// Inside means side * (start + t * delta) <= halfSize.
+				double p = side * delta[axis];
+				double q = halfSize - side * start[axis];
+				if (p == 0.0) {
+					if (q < 0.0) return false;
+					continue;
+				}
+				double t = q / p;
+				if (p < 0.0) t0 = std::max(t0, t);
+				else t1 = std::min(t1, t);
+			}
+		}
+		if (t0 >= t1) return false;
+
+		cml::vector2d first = segment.first + delta * t0;
+		segment.second = segment.first + delta * t1;
+		segment.first = first;
+		return true;
+	}
+}
+
+VisibilityPolygon::VisibilityPolygon()
+{
+}
+
+void VisibilityPolygon::compute(const cml::vector2d &origin, double radius, const std::vector<Segment> &segments)
+{
+	m_origin = origin;
+	m_segments.clear();
+	m_points.clear();
+
+	// A square around the radius, so every ray hits something.
+	cml::vector2d corners[4] = {
+		origin + cml::vector2d(-radius, -radius),
+		origin + cml::vector2d(radius, -radius),
+		origin + cml::vector2d(radius, radius),
+		origin + cml::vector2d(-radius, radius)
+	};
+	std::vector<Segment> candidates;
+	for (int i = 0; i < 4; i ++) {
+		candidates.push_back(Segment(corners[i], corners[(i + 1) % 4]));
+	}
+	// Clipped to the square so none of them cross it.
+	for (std::vector<Segment>::const_iterator it = segments.begin(); it != segments.end(); ++ it) {
+		Segment segment = *it;
+		if (clip(segment, origin, radius)) candidates.push_back(segment);
+	}
+
+	for (std::vector<Segment>::iterator it = candidates.begin(); it != candidates.end(); ++ it) {
+		double turn = cross((*it).first - origin, (*it).second - origin);
+		if (turn == 0.0) continue; // Seen edge-on, or degenerate; blocks nothing.
+
+		m_segments.push_back(turn > 0.0 ? *it : Segment((*it).second, (*it).first));
+	}
+
+	std::vector<Event> events;
+	for (int i = 0; i < (int)m_segments.size(); i ++) {
+		cml::vector2d first = m_segments[i].first - origin;
+		cml::vector2d second = m_segments[i].second - origin;
+		Event begin = { std::atan2(first[1], first[0]), i, true };
+		Event end = { std::atan2(second[1], second[0]), i, false };
+		events.push_back(begin);
+		events.push_back(end);
+	}
+	std::sort(events.begin(), events.end());
+
+	m_heap.clear();
+	m_heapIndex.assign(m_segments.size(), -1);
+	double beginAngle = 0.0;
+	for (int pass = 0; pass < 2; pass ++) {
+		for (std::vector<Event>::iterator it = events.begin(); it != events.end(); ++ it) {
+			int nearest = m_heap.empty() ? -1 : m_heap[0];
+			if ((*it).begins) {
+				open((*it).segment);
+			}
+			else {
+				close((*it).segment);
+			}
+
+			if (m_heap.empty() || m_heap[0] != nearest) {
+				if (pass == 1 && nearest >= 0) {
+					m_points.push_back(hit(nearest, beginAngle));
+					m_points.push_back(hit(nearest, (*it).angle));
+				}
+				beginAngle = (*it).angle;
+			}
+		}
+	}
+}
+
+const std::vector<cml::vector2d> &VisibilityPolygon::points(void)
+{
+	return m_points;
+}
+
+void VisibilityPolygon::open(int segment)
+{
+	if (m_heapIndex[segment] >= 0) return;
+
+	m_heap.push_back(segment);
+	m_heapIndex[segment] = m_heap.size() - 1;
+	siftUp(m_heap.size() - 1);
+}
+
+void VisibilityPolygon::close(int segment)
+{
+	int position = m_heapIndex[segment];
+	if (position < 0) return;
+
+	swap(position, m_heap.size() - 1);
+	m_heap.pop_back();
+	m_heapIndex[segment] = -1;
+	if (position < (int)m_heap.size()) {
+		siftUp(position);
+		siftDown(position);
+	}
+}
+
+void VisibilityPolygon::siftUp(int position)
+{
+	while (position > 0) {
+		int parent = (position - 1) / 2;
+		if (!inFront(m_heap[position], m_heap[parent])) break;
+		swap(position, parent);
+		position = parent;
+	}
+}
+
+void VisibilityPolygon::siftDown(int position)
+{
+	int size = m_heap.size();
+	while (true) {
+		int nearest = position;
+		for (int child = position * 2 + 1; child <= position * 2 + 2 && child < size; child ++) {
+			if (inFront(m_heap[child], m_heap[nearest])) nearest = child;
+		}
+		if (nearest == position) break;
+		swap(position, nearest);
+		position = nearest;
+	}
+}
+
+void VisibilityPolygon::swap(int positionA, int positionB)
+{
+	std::swap(m_heap[positionA], m_heap[positionB]);
+	m_heapIndex[m_heap[positionA]] = positionA;
+	m_heapIndex[m_heap[positionB]] = positionB;
+}
+
+// Whether segment a hides segment b from the origin, for segments that don't
+// cross each other and are both hit by some ray from it.
+bool VisibilityPolygon::inFront(int a, int b)
+{
+	const Segment &segmentA = m_segments[a];
+	const Segment &segmentB = m_segments[b];
+	bool a1 = leftOf(segmentA, interpolate(segmentB.first, segmentB.second, 0.01));
+	bool a2 = leftOf(segmentA, interpolate(segmentB.second, segmentB.first, 0.01));
+	bool a3 = leftOf(segmentA, m_origin);
+	bool b1 = leftOf(segmentB, interpolate(segmentA.first, segmentA.second, 0.01));
+	bool b2 = leftOf(segmentB, interpolate(segmentA.second, segmentA.first, 0.01));
+	bool b3 = leftOf(segmentB, m_origin);
+
+	// a is in front if b lies beyond it as seen from the origin, or if a lies
+	// on the origin's side of b.
+	if (b1 == b2 && b2 != b3) return false;
+	if (a1 == a2 && a2 == a3) return false;
+	if (a1 == a2 && a2 != a3) return true;
+	if (b1 == b2 && b2 == b3) return true;
+	return false;
+}
+
+// Where the ray from the origin at angle meets the segment's line.
+cml::vector2d VisibilityPolygon::hit(int segment, double angle)
+{
+	cml::vector2d direction(std::cos(angle), std::sin(angle));
+	cml::vector2d a = m_segments[segment].first;
+	cml::vector2d ab = m_segments[segment].second - a;
+	double denominator = cross(direction, ab);
+	if (denominator == 0.0) return a;
+
+	double t = cross(a - m_origin, ab) / denominator;
+	return m_origin + direction * t;
+}
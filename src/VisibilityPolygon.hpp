@@ -0,0 +1,54 @@
+#ifndef VISIBILITYPOLYGON_HPP
+#define VISIBILITYPOLYGON_HPP
+
+#include <utility>
+#include <vector>
+#include <cml/cml.h>
+
+// The area a light at a point can see, up to a radius, among wall segments.
+//
+// Segment endpoints are sorted by angle around the light and swept twice, the
+// first pass only to find the segments already open where the sweep starts.
+// Open segments are kept in an indexed heap ordered by which is in front, so
+// every comparison is between segments crossed by the same ray. Each time the
+// nearest segment changes, the visible part of the previous one is emitted.
+// That makes it O(n log n) in the number of segments within the radius.
+class VisibilityPolygon
+{
+public:
+	typedef std::pair<cml::vector2d, cml::vector2d> Segment;
+
+	VisibilityPolygon();
+
+	void compute(const cml::vector2d &origin, double radius, const std::vector<Segment> &segments);
+	const std::vector<cml::vector2d> &points(void);
+private:
+	class Event
+	{
+	public:
+		double angle;
+		int segment;
+		bool begins;
+
+		bool operator<(const Event &other) const {
+			if (angle != other.angle) return angle < other.angle;
+			return begins && !other.begins;
+		}
+	};
+
+	cml::vector2d m_origin;
+	std::vector<Segment> m_segments; // Oriented so that first comes first in the sweep.
+	std::vector<cml::vector2d> m_points;
+	std::vector<int> m_heap; // Open segments, nearest first.
+	std::vector<int> m_heapIndex; // Position of each segment in m_heap, -1 if closed.
+
+	void open(int segment);
+	void close(int segment);
+	void siftUp(int position);
+	void siftDown(int position);
+	void swap(int positionA, int positionB);
+	bool inFront(int a, int b);
+	cml::vector2d hit(int segment, double angle);
+};
+
+#endif // VISIBILITYPOLYGON_HPP
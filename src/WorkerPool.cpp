@@ -0,0 +1,95 @@
+#include "WorkerPool.hpp"
+
+namespace {
+	// Counts down as the tasks of one run() batch finish.
+	class Batch
+	{
+	public:
+		Batch(int remaining) :
+			m_remaining(remaining)
+		{
+		}
+
+		void runTask(WorkerPool::Task task) {
+			task();
+
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			if (-- m_remaining == 0) {
+				m_finished.notify_all();
+			}
+		}
+
+		void wait(void) {
+			boost::unique_lock<boost::mutex> lock(m_mutex);
+			while (m_remaining > 0) {
+				m_finished.wait(lock);
+			}
+		}
+	private:
+		int m_remaining;
+		boost::mutex m_mutex;
+		boost::condition_variable m_finished;
+	};
+}
+
+WorkerPool::WorkerPool(int threadCount) :
+	m_stopping(false)
+{
+	m_threadCount = threadCount > 0 ? threadCount : std::max(1, (int)boost::thread::hardware_concurrency());
+	for (int i = 0; i < m_threadCount; i ++) {
+		m_threads.create_thread(boost::bind(&WorkerPool::workerLoop, this));
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_stopping = true;
+		m_taskAvailable.notify_all();
+	}
+
+	m_threads.join_all();
+}
+
+void WorkerPool::post(Task task)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_tasks.push_back(task);
+	m_taskAvailable.notify_one();
+}
+
+void WorkerPool::run(const std::vector<Task> &tasks)
+{
+	if (tasks.empty()) return;
+
+	Batch batch(tasks.size());
+	for (std::vector<Task>::const_iterator it = tasks.begin(); it != tasks.end(); ++ it) {
+		post(boost::bind(&Batch::runTask, &batch, *it));
+	}
+	batch.wait();
+}
+
+int WorkerPool::threadCount(void)
+{
+	return m_threadCount;
+}
+
+void WorkerPool::workerLoop(void)
+{
+	while (true) {
+		Task task;
+		{
+			boost::unique_lock<boost::mutex> lock(m_mutex);
+			while (m_tasks.empty() && !m_stopping) {
+				m_taskAvailable.wait(lock);
+			}
+			if (m_tasks.empty()) return;
+
+			task = m_tasks.front();
+			m_tasks.pop_front();
+		}
+
+		task();
+	}
+}
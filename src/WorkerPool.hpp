@@ -0,0 +1,34 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <deque>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+// Fixed set of threads that run posted tasks. run() hands over a batch and
+// blocks until every task in it has finished, so several callers can share one
+// pool without waiting on each other's work.
+class WorkerPool
+{
+public:
+	typedef boost::function<void (void)> Task;
+
+	WorkerPool(int threadCount = 0);
+	virtual ~WorkerPool();
+
+	void post(Task task);
+	void run(const std::vector<Task> &tasks);
+	int threadCount(void);
+private:
+	bool m_stopping;
+	std::deque<Task> m_tasks;
+	boost::mutex m_mutex;
+	boost::condition_variable m_taskAvailable;
+	boost::thread_group m_threads;
+	int m_threadCount;
+
+	void workerLoop(void);
+};
+
+#endif // WORKERPOOL_HPP
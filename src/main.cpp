@@ -1,17 +1,317 @@
 #include <fstream>
 #include <boost/math/special_functions/round.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <SDL2/SDL.h>
 #include "Application.hpp"
+#include "GifWriter.hpp"
+#include "Pipeline.hpp"
+#include "Profiler.hpp"
+#include "RenderQueue.hpp"
+#include "SceneDescription.hpp"
+#include "VideoStreamWriter.hpp"
 
-int main(int argc, char *argv[])
+static void printUsage(void)
 {
-	Application application;
+	std::cerr << "Usage: boxes [options] <scene.json | scene.scene | cache.frames> [more scenes...]" << std::endl;
+	std::cerr << "Renders the scene without opening a window. Run without arguments for the interactive preview." << std::endl;
+	std::cerr << "Several scenes are rendered at once, each into <output>/<scene name>." << std::endl;
+	std::cerr << "A .frames file kept with --set framestore=mapped is reopened instead of simulated again." << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "\t--blend         Reduce groups of frames into 1 for motion blur (blendframes, blendcurve settings)." << std::endl;
+	std::cerr << "\t--reverse       Save the frames in reverse order." << std::endl;
+	std::cerr << "\t--output <dir>  Directory for frame####.bmp/png, animation.gif or animation.raw (default: output)." << std::endl;
+	std::cerr << "\t               For y4m and rawvideo, the file or FIFO to stream to, - for stdout (default)." << std::endl;
+	std::cerr << "\t--format <f>    bmp (default), png, raw (one file of BGRA frames), gif, y4m or rawvideo." << std::endl;
+	std::cerr << "\t--pixfmt <p>    rawvideo pixels: i420 (default, yuv420p) or bgra. y4m is always i420." << std::endl;
+	std::cerr << "\t--level <n>     PNG compression level, 0 (fastest) to 9 (smallest, default 6)." << std::endl;
+	std::cerr << "\t--palette <p>   GIF palette: global (default, shared by all frames) or local (one per frame)." << std::endl;
+	std::cerr << "\t--stream        Simulate, rasterize, blend and save concurrently without keeping all frames in memory." << std::endl;
+	std::cerr << "\t--threads <n>   Rasterizer threads for --stream." << std::endl;
+	std::cerr << "\t--queue <n>     Frames buffered between --stream stages (default: 8)." << std::endl;
+	std::cerr << "\t--jobs <n>      Scenes rendered at once when given several (default: one per core)." << std::endl;
+	std::cerr << "\t--set <k>=<v>   Override a scene setting, e.g. --set tiles=4." << std::endl;
+	std::cerr << "\t--stats         Time the render hot paths and print percentiles at the end." << std::endl;
+	std::cerr << "\t--trace         Like --stats, and also write output/trace.json for chrome://tracing." << std::endl;
+	std::cerr << "\t--compile <f>   Write the scene, with any --set overrides, to a binary .scene file and exit." << std::endl;
+	std::cerr << "\t--help          Show this message." << std::endl;
+}
+
+static FrameWriter *createWriter(Animation &animation, std::string format, std::string palette, int level, std::string pixelFormat, std::string outputDirectory)
+{
+	if (format == "y4m" || format == "rawvideo") {
+		return new VideoStreamWriter(outputDirectory, format, pixelFormat);
+	}
+
+	if (format == "gif") {
+		GifWriter *writer = new GifWriter(outputDirectory + "/animation.gif", palette == "global");
+		Uint32 key;
+		if (animation.transparencyKey(key)) {
+			writer->transparencyKey(key);
+		}
+		return writer;
+	}
+
+	if (format == "png") {
+		return new PngFrameWriter(outputDirectory, level);
+	}
+
+	if (format == "raw") {
+		return new RawFrameWriter(outputDirectory + "/animation.raw");
+	}
+
+	return new BmpFrameWriter(outputDirectory);
+}
+
+static void reportProfile(bool trace)
+{
+	if (!g_profiler.enabled()) return;
+
+	std::vector<std::string> lines = g_profiler.stats();
+	for (std::vector<std::string>::iterator it = lines.begin(); it != lines.end(); ++ it) {
+		g_console.print(*it);
+	}
+	if (trace) {
+		std::string filename = "output/trace.json";
+		if (g_profiler.writeTrace(filename)) {
+			g_console.print(boost::format("Wrote a trace to %s") % filename);
+		}
+		else {
+			g_console.print(boost::format("Error writing %s") % filename);
+		}
+	}
+}
+
+// Headless batch render: load, optionally blend, and save without SDL video or frame pacing.
+static int runBatch(int argc, char *argv[])
+{
+	Animation animation;
+	std::vector<std::string> sceneFiles;
+	std::string outputDirectory;
+	bool blend = false;
+	bool reverse = false;
+	bool stream = false;
+	std::string format = "bmp";
+	std::string palette = "global";
+	std::string pixelFormat = "i420";
+	int level = 6;
+	int rasterThreads = -1;
+	int queueDepth = -1;
+	int jobs = 0;
+	std::string compiledFile;
+	bool trace = false;
+
+	for (int i = 1; i < argc; i ++) {
+		std::string argument = argv[i];
+		if (argument == "--blend") {
+			blend = true;
+		}
+		else if (argument == "--reverse") {
+			reverse = true;
+		}
+		else if (argument == "--output" && i + 1 < argc) {
+			outputDirectory = argv[++ i];
+		}
+		else if (argument == "--format" && i + 1 < argc) {
+			format = argv[++ i];
+		}
+		else if (argument == "--palette" && i + 1 < argc) {
+			palette = argv[++ i];
+		}
+		else if (argument == "--pixfmt" && i + 1 < argc) {
+			pixelFormat = argv[++ i];
+		}
+		else if (argument == "--level" && i + 1 < argc) {
+			level = atoi(argv[++ i]);
+		}
+		else if (argument == "--stream") {
+			stream = true;
+		}
+		else if (argument == "--threads" && i + 1 < argc) {
+			rasterThreads = atoi(argv[++ i]);
+		}
+		else if (argument == "--queue" && i + 1 < argc) {
+			queueDepth = atoi(argv[++ i]);
+		}
+		else if (argument == "--jobs" && i + 1 < argc) {
+			jobs = atoi(argv[++ i]);
+		}
+		else if (argument == "--set" && i + 1 < argc) {
+			std::string setting = argv[++ i];
+			size_t separator = setting.find('=');
+			if (separator == std::string::npos) {
+				std::cerr << "Expected <key>=<value> after --set, got '" << setting << "'" << std::endl;
+				return EXIT_FAILURE;
+			}
+			animation.setOption(setting.substr(0, separator), setting.substr(separator + 1));
+		}
+		else if (argument == "--stats" || argument == "--trace") {
+			trace = trace || argument == "--trace";
+			g_profiler.enable(true);
+		}
+		else if (argument == "--compile" && i + 1 < argc) {
+			compiledFile = argv[++ i];
+		}
+		else if (argument == "--help") {
+			printUsage();
+			return EXIT_SUCCESS;
+		}
+		else if (argument.find("--") == 0) {
+			std::cerr << "Unexpected argument '" << argument << "'" << std::endl;
+			printUsage();
+			return EXIT_FAILURE;
+		}
+		else {
+			sceneFiles.push_back(argument);
+		}
+	}
+
+	if (sceneFiles.empty()) {
+		printUsage();
+		return EXIT_FAILURE;
+	}
+	std::string sceneFile = sceneFiles[0];
+	if (sceneFiles.size() > 1 && (stream || reverse || !compiledFile.empty() || format == "y4m" || format == "rawvideo")) {
+		std::cerr << "--stream, --reverse, --compile, y4m and rawvideo take a single scene" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!compiledFile.empty()) {
+		SceneDescription scene;
+		std::string error;
+		if (!scene.read(sceneFile, animation.options(), error) || !scene.writeBinary(compiledFile, error)) {
+			std::cerr << "Could not compile " << sceneFile << ": " << error << std::endl;
+			return EXIT_FAILURE;
+		}
+		g_console.print(boost::format("Compiled %i objects from %s to %s") % scene.objects.size() % sceneFile % compiledFile);
+		return EXIT_SUCCESS;
+	}
+
+	bool video = format == "y4m" || format == "rawvideo";
+	if ((format != "bmp" && format != "png" && format != "raw" && format != "gif" && !video) || (palette != "global" && palette != "local") || level < 0 || level > 9) {
+		std::cerr << "Unknown --format, --palette or --level" << std::endl;
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	if (video) {
+		if (format == "y4m" && pixelFormat == "bgra") {
+			std::cerr << "y4m only carries i420, use --format rawvideo for bgra" << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (!VideoStreamWriter::validFormat(format, pixelFormat)) {
+			std::cerr << "Unknown --pixfmt '" << pixelFormat << "'" << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (outputDirectory.empty()) outputDirectory = "-";
+		if (outputDirectory == "-") {
+			// Keep progress messages out of the video on stdout.
+			g_console.echoTo(&std::cerr);
+		}
+	}
+	else if (outputDirectory.empty()) {
+		outputDirectory = "output";
+	}
+
+	if (sceneFiles.size() > 1) {
+		RenderQueue queue(boost::bind(&createWriter, _1, format, palette, level, pixelFormat, _2), outputDirectory, jobs);
+		queue.options(animation.options());
+		queue.blend(blend);
+		for (std::vector<std::string>::iterator it = sceneFiles.begin(); it != sceneFiles.end(); ++ it) {
+			queue.add(*it);
+		}
+		bool succeeded = queue.run();
+		g_console.print(queue.summary());
+		reportProfile(trace);
+		return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	bool reopen = boost::filesystem::path(sceneFile).extension() == ".frames";
+	if (stream && reopen) {
+		std::cerr << "--stream needs a scene file, not a frame cache" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (stream) {
+		if (!animation.loadScene(sceneFile)) {
+			g_console.print(boost::format("Error loading %s") % sceneFile);
+			return EXIT_FAILURE;
+		}
+
+		if (reverse) {
+			animation.reverse();
+		}
+
+		boost::scoped_ptr<FrameWriter> writer(createWriter(animation, format, palette, level, pixelFormat, outputDirectory));
+		AsyncFrameWriter asyncWriter(*writer);
+		Pipeline pipeline(animation, asyncWriter);
+		pipeline.blend(blend);
+		if (rasterThreads > 0) pipeline.rasterThreads(rasterThreads);
+		if (queueDepth > 0) pipeline.queueDepth(queueDepth);
+		if (!pipeline.run()) {
+			return EXIT_FAILURE;
+		}
+		g_console.print(boost::format("Streamed %s to %s") % sceneFile % outputDirectory);
+		if (animation.spriteCache().spriteCount() > 0) {
+			g_console.print(animation.spriteCache().summary());
+		}
+		reportProfile(trace);
 
+		return EXIT_SUCCESS;
+	}
+
+	if (reopen) {
+		if (!animation.open(sceneFile)) {
+			g_console.print(boost::format("Error opening %s") % sceneFile);
+			return EXIT_FAILURE;
+		}
+		g_console.print(boost::format("Opened %i frames from %s") % animation.frames().size() % sceneFile);
+	}
+	else {
+		if (!animation.load(sceneFile)) {
+			g_console.print(boost::format("Error loading %s") % sceneFile);
+			return EXIT_FAILURE;
+		}
+		g_console.print(boost::format("Rendered %i frames from %s") % animation.frames().size() % sceneFile);
+	}
+	g_console.print(animation.frames().summary());
+	if (animation.spriteCache().spriteCount() > 0) {
+		g_console.print(animation.spriteCache().summary());
+	}
+
+	if (blend) {
+		animation.blendFrames();
+		g_console.print(boost::format("Blended down to %i frames") % animation.frames().size());
+		g_console.print(animation.frames().summary());
+	}
+
+	if (reverse) {
+		animation.reverse();
+	}
+
+	boost::scoped_ptr<FrameWriter> writer(createWriter(animation, format, palette, level, pixelFormat, outputDirectory));
+	AsyncFrameWriter asyncWriter(*writer);
+	if (!animation.save(asyncWriter)) {
+		return EXIT_FAILURE;
+	}
+	g_console.print(boost::format("Saved %i frames to %s") % animation.frames().size() % outputDirectory);
+	reportProfile(trace);
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
 	if (!boost::filesystem::is_directory("output")) {
 		boost::filesystem::create_directory("output");
 	}
 
+	if (argc > 1) {
+		return runBatch(argc, argv);
+	}
+
+	Application application;
+
 	std::ofstream framerateLog("output/framerate.txt");
 	while (!application.wantsToExit()) {
 		application.update();